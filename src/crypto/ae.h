@@ -175,6 +175,22 @@ int ae_decrypt(ae_ctx     *ctx,
  *
  * ----------------------------------------------------------------------- */
 
+/* --------------------------------------------------------------------------
+ *
+ * Implementation Routines (Mosh)
+ *
+ * ----------------------------------------------------------------------- */
+
+int         ae_impl_count (void);      /* Number usable on this CPU         */
+const char *ae_impl_name  (int impl);  /* Its name, or NULL if out of range */
+int         ae_impl_select(int impl);  /* Use it in later ae_init() calls   */
+/* A build can carry more than one AES implementation, such as hardware
+ * instructions and a library's software AES; those the CPU can run are
+ * numbered from 0, the default. ae_impl_select() returns AE_SUCCESS, or
+ * AE_NOT_SUPPORTED for an out of range impl. Contexts keep the
+ * implementation they were initialized with.
+ */
+
 #ifdef __cplusplus
 } /* closing brace for extern "C" */
 #endif
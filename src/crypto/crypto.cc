@@ -32,9 +32,11 @@
 
 #include <cassert>
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <chrono>
 #include <fstream>
 
 #include <sys/resource.h>
@@ -159,8 +161,7 @@ std::string Base64Key::printable_key( void ) const
 Session::Session( Base64Key s_key )
   : key( s_key ), ctx_buf( ae_ctx_sizeof() ),
     ctx( (ae_ctx *)ctx_buf.data() ), blocks_encrypted( 0 ),
-    plaintext_buffer( RECEIVE_MTU ),
-    ciphertext_buffer( RECEIVE_MTU ),
+    buffer( RECEIVE_MTU ),
     nonce_buffer( Nonce::NONCE_LEN )
 {
   if ( AE_SUCCESS != ae_init( ctx, key.data(), 16, 12, 16 ) ) {
@@ -198,24 +199,41 @@ Nonce::Nonce( const char *s_bytes, size_t len )
   memcpy( bytes + 4, s_bytes, 8 );
 }
 
+static bool aligned( const char *buf )
+{
+  return ( reinterpret_cast<uintptr_t>( buf ) & 0xF ) == 0;
+}
+
 const std::string Session::encrypt( const Message & plaintext )
 {
   const size_t pt_len = plaintext.text.size();
+
+  assert( pt_len + ADDED_BYTES <= buffer.len() );
+
+  memcpy( buffer.data(), plaintext.text.data(), pt_len );
+
+  const size_t ciphertext_len = encrypt( plaintext.nonce, buffer.data(), pt_len );
+
+  std::string text( buffer.data(), ciphertext_len );
+
+  return plaintext.nonce.cc_str() + text;
+}
+
+size_t Session::encrypt( const Nonce & nonce, char *buf, size_t pt_len )
+{
   const int ciphertext_len = pt_len + 16;
 
-  assert( (size_t)ciphertext_len <= ciphertext_buffer.len() );
-  assert( pt_len <= plaintext_buffer.len() );
+  assert( aligned( buf ) );
 
-  memcpy( plaintext_buffer.data(), plaintext.text.data(), pt_len );
-  memcpy( nonce_buffer.data(), plaintext.nonce.data(), Nonce::NONCE_LEN );
+  memcpy( nonce_buffer.data(), nonce.data(), Nonce::NONCE_LEN );
 
   if ( ciphertext_len != ae_encrypt( ctx,                                     /* ctx */
 				     nonce_buffer.data(),                     /* nonce */
-				     plaintext_buffer.data(),                 /* pt */
+				     buf,                                     /* pt */
 				     pt_len,                                  /* pt_len */
 				     NULL,                                    /* ad */
 				     0,                                       /* ad_len */
-				     ciphertext_buffer.data(),                /* ct */
+				     buf,                                     /* ct */
 				     NULL,                                    /* tag */
 				     AE_FINALIZE ) ) {                        /* final */
     throw CryptoException( "ae_encrypt() returned error." );
@@ -243,9 +261,7 @@ const std::string Session::encrypt( const Message & plaintext )
     throw CryptoException( "Encrypted 2^47 blocks.", true );
   }
 
-  std::string text( ciphertext_buffer.data(), ciphertext_len );
-
-  return plaintext.nonce.cc_str() + text;
+  return ciphertext_len;
 }
 
 const Message Session::decrypt( const char *str, size_t len )
@@ -254,7 +270,29 @@ const Message Session::decrypt( const char *str, size_t len )
     throw CryptoException( "Ciphertext must contain nonce and tag." );
   }
 
-  int body_len = len - 8;
+  return decrypt( Nonce( str, 8 ), str + 8, len - 8 );
+}
+
+const Message Session::decrypt( const Nonce & nonce, const char *str, size_t len )
+{
+  if ( len > buffer.len() ) {
+    throw CryptoException( "Ciphertext too long." );
+  }
+
+  memcpy( buffer.data(), str, len );
+
+  const MessageView view = decrypt( nonce, buffer.data(), len );
+
+  return Message( nonce, std::string( view.text ) );
+}
+
+const MessageView Session::decrypt( const Nonce & nonce, char *buf, size_t len )
+{
+  if ( len < 16 ) {
+    throw CryptoException( "Ciphertext must contain tag." );
+  }
+
+  int body_len = len;
   int pt_len = body_len - 16;
 
   if ( pt_len < 0 ) { /* super-assertion that pt_len does not equal AE_INVALID */
@@ -262,30 +300,181 @@ const Message Session::decrypt( const char *str, size_t len )
     exit( 1 );
   }
 
-  assert( (size_t)body_len <= ciphertext_buffer.len() );
-  assert( (size_t)pt_len <= plaintext_buffer.len() );
+  assert( aligned( buf ) );
 
-  Nonce nonce( str, 8 );
-  memcpy( ciphertext_buffer.data(), str + 8, body_len );
   memcpy( nonce_buffer.data(), nonce.data(), Nonce::NONCE_LEN );
 
   if ( pt_len != ae_decrypt( ctx,                      /* ctx */
 			     nonce_buffer.data(),      /* nonce */
-			     ciphertext_buffer.data(), /* ct */
+			     buf,                      /* ct */
 			     body_len,                 /* ct_len */
 			     NULL,                     /* ad */
 			     0,                        /* ad_len */
-			     plaintext_buffer.data(),  /* pt */
+			     buf,                      /* pt */
 			     NULL,                     /* tag */
 			     AE_FINALIZE ) ) {         /* final */
     throw CryptoException( "Packet failed integrity check." );
   }
 
-  const Message ret( nonce, std::string( plaintext_buffer.data(), pt_len ) );
+  return MessageView( nonce, buf, pt_len );
+}
+
+static size_t selected_implementation = 0;
 
+std::vector<std::string> Crypto::implementations( void )
+{
+  std::vector<std::string> ret;
+  for ( int i = 0; i < ae_impl_count(); i++ ) {
+    ret.push_back( ae_impl_name( i ) );
+  }
   return ret;
 }
 
+void Crypto::select_implementation( size_t index )
+{
+  if ( AE_SUCCESS != ae_impl_select( index ) ) {
+    throw CryptoException( "No such AES implementation." );
+  }
+  selected_implementation = index;
+}
+
+/* draft-krovetz-ocb-03, appendix A: no associated data, 24 bytes */
+static bool known_answer_correct( void )
+{
+  static const char key[] = "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A\x0B\x0C\x0D\x0E\x0F";
+  static const char nonce[] = "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A\x0B";
+  static const char plaintext[] = "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A\x0B\x0C\x0D\x0E\x0F"
+    "\x10\x11\x12\x13\x14\x15\x16\x17";
+  static const char ciphertext[] = "\xBE\xA5\xE8\x79\x8D\xBE\x71\x10\x03\x1C\x14\x4D\xA0\xB2\x61\x22"
+    "\xFC\xFC\xEE\x7A\x2A\x8D\x4D\x48\x6E\xF2\xF5\x25\x87\xFD\xA0\xED"
+    "\x97\xDC\x7E\xED\xE2\x41\xDF\x68";
+  const int pt_len = sizeof( plaintext ) - 1, ct_len = sizeof( ciphertext ) - 1;
+
+  AlignedBuffer ctx_buf( ae_ctx_sizeof() );
+  ae_ctx *ctx = (ae_ctx *)ctx_buf.data();
+  AlignedBuffer key_buf( 16, key ), nonce_buf( 12, nonce );
+  AlignedBuffer pt_buf( pt_len, plaintext ), ct_buf( ct_len );
+
+  if ( AE_SUCCESS != ae_init( ctx, key_buf.data(), 16, 12, 16 ) ) {
+    return false;
+  }
+  bool correct = ( ct_len == ae_encrypt( ctx, nonce_buf.data(), pt_buf.data(), pt_len,
+					  NULL, 0, ct_buf.data(), NULL, AE_FINALIZE ) )
+    && ( 0 == memcmp( ct_buf.data(), ciphertext, ct_len ) );
+  memset( pt_buf.data(), 0, pt_len );
+  correct = correct
+    && ( pt_len == ae_decrypt( ctx, nonce_buf.data(), ct_buf.data(), ct_len,
+			       NULL, 0, pt_buf.data(), NULL, AE_FINALIZE ) )
+    && ( 0 == memcmp( pt_buf.data(), plaintext, pt_len ) );
+  ae_clear( ctx );
+  return correct;
+}
+
+bool Crypto::implementation_correct( size_t index )
+{
+  const size_t previous = selected_implementation;
+  const size_t reference = implementations().size() - 1;
+  Base64Key key;
+  std::string text( Session::RECEIVE_MTU - Session::ADDED_BYTES, '\0' );
+  for ( size_t i = 0; i < text.size(); i++ ) {
+    text[ i ] = i * 37 + ( i >> 8 );
+  }
+
+  select_implementation( reference );
+  Session reference_session( key );
+  select_implementation( index );
+  bool correct = known_answer_correct();
+  Session session( key );
+  select_implementation( previous );
+
+  /* each length through the first blocks, then a spread of longer ones */
+  for ( size_t len = 0; correct && len <= text.size(); len += ( len < 256 ) ? 1 : 61 ) {
+    const Message plaintext( Nonce( len ), text.substr( 0, len ) );
+    try {
+      const std::string ciphertext = session.encrypt( plaintext );
+      correct = ciphertext == reference_session.encrypt( plaintext )
+	&& session.decrypt( ciphertext ).text == plaintext.text;
+    } catch ( const CryptoException & ) {
+      correct = false;
+    }
+  }
+
+  return correct;
+}
+
+/* seconds to encrypt and decrypt packets of some typical sizes */
+static double packet_time( Session &session )
+{
+  static const size_t sizes[] = { 30, 100, 300, 1300 };
+  static const int PACKETS = 200;
+  const std::string text( 1300, 'x' );
+  double best = -1;
+
+  for ( int round = 0; round < 3; round++ ) {
+    const auto start = std::chrono::steady_clock::now();
+    for ( size_t len : sizes ) {
+      for ( int i = 0; i < PACKETS; i++ ) {
+	session.decrypt( session.encrypt( Message( Nonce( i ), text.substr( 0, len ) ) ) );
+      }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if ( best < 0 || elapsed.count() < best ) {
+      best = elapsed.count();
+    }
+  }
+
+  return best;
+}
+
+size_t Crypto::select_fastest_implementation( void )
+{
+  const size_t count = implementations().size();
+  size_t fastest = count - 1; /* the library's AES */
+  double fastest_time = -1;
+
+  for ( size_t i = 0; i < count; i++ ) {
+    if ( !implementation_correct( i ) ) {
+      continue;
+    }
+    select_implementation( i );
+    Base64Key key;
+    Session session( key );
+    const double time = packet_time( session );
+    if ( fastest_time < 0 || time < fastest_time ) {
+      fastest = i;
+      fastest_time = time;
+    }
+  }
+
+  select_implementation( fastest );
+  return fastest;
+}
+
+void Crypto::select_implementation_from_environment( void )
+{
+  const char *name = getenv( "MOSH_AES_IMPLEMENTATION" );
+  if ( name == NULL || *name == '\0' ) {
+    return;
+  }
+  if ( 0 == strcmp( name, "fastest" ) ) {
+    select_fastest_implementation();
+    return;
+  }
+
+  const std::vector<std::string> names = implementations();
+  for ( size_t i = 0; i < names.size(); i++ ) {
+    if ( names[ i ] == name ) {
+      if ( implementation_correct( i ) ) {
+	select_implementation( i );
+      } else {
+	fprintf( stderr, "MOSH_AES_IMPLEMENTATION %s fails its self-test, ignoring\n", name );
+      }
+      return;
+    }
+  }
+  fprintf( stderr, "MOSH_AES_IMPLEMENTATION %s not available, ignoring\n", name );
+}
+
 static rlim_t saved_core_rlimit;
 
 /* Disable dumping core, as a precaution to avoid saving sensitive data
@@ -40,6 +40,8 @@
 #include <cstring>
 #include <exception>
 #include <string>
+#include <string_view>
+#include <vector>
 
 
 long int myatoi( const char *str );
@@ -110,7 +112,9 @@ namespace Crypto {
     Nonce( uint64_t val );
     Nonce( const char *s_bytes, size_t len );
     
-    std::string cc_str( void ) const { return std::string( bytes + 4, 8 ); }
+    static const int CC_LEN = 8; /* bytes of the nonce carried on the wire */
+    std::string cc_str( void ) const { return std::string( cc_data(), CC_LEN ); }
+    const char *cc_data( void ) const { return bytes + 4; }
     const char *data( void ) const { return bytes; }
     uint64_t val( void ) const;
   };
@@ -129,6 +133,21 @@ namespace Crypto {
       : nonce( s_nonce ),
       text( s_text ) {}
   };
+
+  /* A message decrypted in place, good for as long as its buffer is */
+  class MessageView {
+  public:
+    const Nonce nonce;
+    const std::string_view text;
+
+    MessageView( const Nonce & s_nonce, const char *text_bytes, size_t text_len )
+      : nonce( s_nonce ),
+      text( text_bytes, text_len ) {}
+
+    explicit MessageView( const Message & message )
+      : nonce( message.nonce ),
+      text( message.text ) {}
+  };
   
   class Session {
   private:
@@ -137,8 +156,7 @@ namespace Crypto {
     ae_ctx *ctx;
     uint64_t blocks_encrypted;
 
-    AlignedBuffer plaintext_buffer;
-    AlignedBuffer ciphertext_buffer;
+    AlignedBuffer buffer; /* for the copying interface */
     AlignedBuffer nonce_buffer;
     
   public:
@@ -150,7 +168,18 @@ namespace Crypto {
     ~Session();
     
     const std::string encrypt( const Message & plaintext );
+
+    /* In place, in a 16-byte-aligned buffer of the caller's: encrypt()
+       turns pt_len bytes of plaintext into the ciphertext and tag,
+       ADDED_BYTES longer, and returns their length; decrypt() turns
+       the ciphertext and tag back into plaintext, which the returned
+       view points into.  The nonce itself is not included. */
+    size_t encrypt( const Nonce & nonce, char *buf, size_t pt_len );
+    const MessageView decrypt( const Nonce & nonce, char *buf, size_t len );
+
     const Message decrypt( const char *str, size_t len );
+    /* ciphertext and tag whose nonce did not come on the wire before them */
+    const Message decrypt( const Nonce & nonce, const char *str, size_t len );
     const Message decrypt( const std::string & ciphertext ) {
       return decrypt( ciphertext.data(), ciphertext.size() );
     }
@@ -159,6 +188,20 @@ namespace Crypto {
     Session & operator=( const Session & );
   };
 
+  /* The AES-OCB implementations built in that this CPU can run, the
+     default first.  A selection applies to Sessions created after it. */
+  std::vector<std::string> implementations( void );
+  void select_implementation( size_t index );
+  /* Checks an implementation against a published test vector, and
+     against the library's AES (the last one) on packets of many sizes. */
+  bool implementation_correct( size_t index );
+  /* Times the correct implementations on 30- to 1300-byte packets and
+     selects the fastest; returns its index. */
+  size_t select_fastest_implementation( void );
+  /* As MOSH_AES_IMPLEMENTATION says: unset for the default, the name
+     of an implementation, or "fastest". */
+  void select_implementation_from_environment( void );
+
   void disable_dumping_core( void );
   void reenable_dumping_core( void );
 }
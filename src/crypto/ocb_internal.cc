@@ -366,6 +366,8 @@
 
 namespace ocb_aes {
 
+static const char name[] = "OpenSSL AES";
+
 typedef EVP_CIPHER_CTX KEY;
 
 enum { BLOCK_SIZE = 16 };
@@ -479,6 +481,8 @@ static void ecb_decrypt_blks(block *blks, unsigned nblks, KEY *key) {
 
 namespace ocb_aes {
 
+static const char name[] = "CommonCrypto AES";
+
 typedef struct {
 	CCCryptorRef ref;
 	uint8_t b[4096];
@@ -567,6 +571,8 @@ static void ecb_decrypt_blks(block *blks, unsigned nblks, KEY *key) {
 
 namespace ocb_aes {
 
+static const char name[] = "Nettle AES";
+
 typedef struct aes128_ctx KEY;
 
 static KEY *KEY_new() { return new KEY; }
@@ -607,6 +613,211 @@ static void ecb_decrypt_blks(block *blks, unsigned nblks, KEY *key) {
 #error "No AES implementation selected."
 #endif
 
+/* ----------------------------------------------------------------------- */
+/* Hardware AES                                                            */
+/* ----------------------------------------------------------------------- */
+
+/* Where the compiler has the intrinsics, AES-128 kernels for the AES-NI
+/  and ARMv8 Cryptography Extension instructions are built too, and used
+/  in place of the library's AES when the CPU has the instructions. The
+/  library keys are kept, so either path can run with any context.
+/  Round keys are memory correct: the AES state is the block's bytes.     */
+
+#if HAVE_AESNI_INTRINSICS
+/*-----------------------*/
+
+#include <wmmintrin.h>                     /* AES-NI instructions         */
+
+namespace ocb_aes_hw {
+
+static const char name[] = "AES-NI";
+
+static bool cpu_has_aes() { return __builtin_cpu_supports("aes"); }
+
+#define AES_TARGET __attribute__((target("aes")))
+
+AES_TARGET static inline __m128i expand_step(__m128i key, __m128i assist) {
+	assist = _mm_shuffle_epi32(assist, _MM_SHUFFLE(3,3,3,3));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+/* Encryption round keys, and the equivalent inverse cipher's          */
+AES_TARGET static void set_keys(const unsigned char *user_key, unsigned char *enc, unsigned char *dec) {
+	__m128i ek[11];
+	ek[0] = _mm_loadu_si128((const __m128i *)user_key);
+	ek[1] = expand_step(ek[0], _mm_aeskeygenassist_si128(ek[0], 0x01));
+	ek[2] = expand_step(ek[1], _mm_aeskeygenassist_si128(ek[1], 0x02));
+	ek[3] = expand_step(ek[2], _mm_aeskeygenassist_si128(ek[2], 0x04));
+	ek[4] = expand_step(ek[3], _mm_aeskeygenassist_si128(ek[3], 0x08));
+	ek[5] = expand_step(ek[4], _mm_aeskeygenassist_si128(ek[4], 0x10));
+	ek[6] = expand_step(ek[5], _mm_aeskeygenassist_si128(ek[5], 0x20));
+	ek[7] = expand_step(ek[6], _mm_aeskeygenassist_si128(ek[6], 0x40));
+	ek[8] = expand_step(ek[7], _mm_aeskeygenassist_si128(ek[7], 0x80));
+	ek[9] = expand_step(ek[8], _mm_aeskeygenassist_si128(ek[8], 0x1b));
+	ek[10] = expand_step(ek[9], _mm_aeskeygenassist_si128(ek[9], 0x36));
+	for (int i = 0; i < 11; i++) {
+		_mm_storeu_si128((__m128i *)enc + i, ek[i]);
+		_mm_storeu_si128((__m128i *)dec + i,
+		                 (i == 0 || i == 10) ? ek[10-i] : _mm_aesimc_si128(ek[10-i]));
+	}
+}
+
+/* Up to eight blocks at a time, each round interleaved across them, so
+/  the pipelined AES unit has independent work every cycle.             */
+AES_TARGET static void ecb_encrypt_blks(unsigned char *blks, unsigned nblks, const unsigned char *rk) {
+	const __m128i *k = (const __m128i *)rk;
+	while (nblks) {
+		const unsigned n = nblks < 8 ? nblks : 8;
+		__m128i b[8];
+		unsigned i, r;
+		for (i = 0; i < n; i++)
+			b[i] = _mm_xor_si128(_mm_loadu_si128((__m128i *)blks + i), _mm_loadu_si128(k));
+		for (r = 1; r < 10; r++) {
+			const __m128i key = _mm_loadu_si128(k + r);
+			for (i = 0; i < n; i++)
+				b[i] = _mm_aesenc_si128(b[i], key);
+		}
+		for (i = 0; i < n; i++)
+			_mm_storeu_si128((__m128i *)blks + i, _mm_aesenclast_si128(b[i], _mm_loadu_si128(k + 10)));
+		blks += 16 * n;
+		nblks -= n;
+	}
+}
+
+AES_TARGET static void ecb_decrypt_blks(unsigned char *blks, unsigned nblks, const unsigned char *rk) {
+	const __m128i *k = (const __m128i *)rk;
+	while (nblks) {
+		const unsigned n = nblks < 8 ? nblks : 8;
+		__m128i b[8];
+		unsigned i, r;
+		for (i = 0; i < n; i++)
+			b[i] = _mm_xor_si128(_mm_loadu_si128((__m128i *)blks + i), _mm_loadu_si128(k));
+		for (r = 1; r < 10; r++) {
+			const __m128i key = _mm_loadu_si128(k + r);
+			for (i = 0; i < n; i++)
+				b[i] = _mm_aesdec_si128(b[i], key);
+		}
+		for (i = 0; i < n; i++)
+			_mm_storeu_si128((__m128i *)blks + i, _mm_aesdeclast_si128(b[i], _mm_loadu_si128(k + 10)));
+		blks += 16 * n;
+		nblks -= n;
+	}
+}
+
+#undef AES_TARGET
+
+}  // namespace ocb_aes_hw
+
+#define HAVE_AES_HW 1
+
+/*-----------------------*/
+#elif HAVE_ARM_AES_INTRINSICS
+/*-----------------------*/
+
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace ocb_aes_hw {
+
+static const char name[] = "ARMv8 AES";
+
+static bool cpu_has_aes() {
+#if defined(__linux__)
+	return getauxval(AT_HWCAP) & HWCAP_AES;
+#else
+	return true;                           /* Apple silicon               */
+#endif
+}
+
+#define AES_TARGET __attribute__((target(ARM_AES_TARGET)))
+
+/* SubWord() of w: with all four columns alike, ShiftRows() moves nothing */
+AES_TARGET static inline uint32_t sub_word(uint32_t w) {
+	uint8x16_t v = vaeseq_u8(vreinterpretq_u8_u32(vdupq_n_u32(w)), vdupq_n_u8(0));
+	return vgetq_lane_u32(vreinterpretq_u32_u8(v), 0);
+}
+
+/* Encryption round keys, and the equivalent inverse cipher's          */
+AES_TARGET static void set_keys(const unsigned char *user_key, unsigned char *enc, unsigned char *dec) {
+	static const uint8_t rcon[10] = { 0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80,0x1b,0x36 };
+	uint32_t w[44];                        /* little-endian words         */
+	unsigned i;
+	memcpy(w, user_key, 16);
+	for (i = 4; i < 44; i++) {
+		uint32_t t = w[i-1];
+		if (i % 4 == 0) {
+			t = sub_word(t);
+			t = ((t >> 8) | (t << 24)) ^ rcon[i/4 - 1];
+		}
+		w[i] = w[i-4] ^ t;
+	}
+	memcpy(enc, w, sizeof(w));
+	for (i = 0; i < 11; i++) {
+		uint8x16_t k = vld1q_u8(enc + 16 * (10 - i));
+		vst1q_u8(dec + 16 * i, (i == 0 || i == 10) ? k : vaesimcq_u8(k));
+	}
+}
+
+/* Up to eight blocks at a time, each round interleaved across them, so
+/  the pipelined AES unit has independent work every cycle.             */
+AES_TARGET static void ecb_encrypt_blks(unsigned char *blks, unsigned nblks, const unsigned char *rk) {
+	while (nblks) {
+		const unsigned n = nblks < 8 ? nblks : 8;
+		uint8x16_t b[8];
+		unsigned i, r;
+		for (i = 0; i < n; i++)
+			b[i] = vld1q_u8(blks + 16 * i);
+		for (r = 0; r < 9; r++) {
+			const uint8x16_t key = vld1q_u8(rk + 16 * r);
+			for (i = 0; i < n; i++)
+				b[i] = vaesmcq_u8(vaeseq_u8(b[i], key));
+		}
+		for (i = 0; i < n; i++)
+			vst1q_u8(blks + 16 * i, veorq_u8(vaeseq_u8(b[i], vld1q_u8(rk + 16 * 9)), vld1q_u8(rk + 16 * 10)));
+		blks += 16 * n;
+		nblks -= n;
+	}
+}
+
+AES_TARGET static void ecb_decrypt_blks(unsigned char *blks, unsigned nblks, const unsigned char *rk) {
+	while (nblks) {
+		const unsigned n = nblks < 8 ? nblks : 8;
+		uint8x16_t b[8];
+		unsigned i, r;
+		for (i = 0; i < n; i++)
+			b[i] = vld1q_u8(blks + 16 * i);
+		for (r = 0; r < 9; r++) {
+			const uint8x16_t key = vld1q_u8(rk + 16 * r);
+			for (i = 0; i < n; i++)
+				b[i] = vaesimcq_u8(vaesdq_u8(b[i], key));
+		}
+		for (i = 0; i < n; i++)
+			vst1q_u8(blks + 16 * i, veorq_u8(vaesdq_u8(b[i], vld1q_u8(rk + 16 * 9)), vld1q_u8(rk + 16 * 10)));
+		blks += 16 * n;
+		nblks -= n;
+	}
+}
+
+#undef AES_TARGET
+
+}  // namespace ocb_aes_hw
+
+#define HAVE_AES_HW 1
+
+/*-----------------------*/
+#endif
+
+#if HAVE_AES_HW
+#undef BPI
+#define BPI 8  /* Blocks in flight to keep the AES pipeline full        */
+#endif
+
 /* ----------------------------------------------------------------------- */
 /* Define OCB context structure.                                           */
 /* ----------------------------------------------------------------------- */
@@ -635,6 +846,11 @@ struct _ae_ctx {
     uint32_t blocks_processed;
     ocb_aes::KEY *decrypt_key;
     ocb_aes::KEY *encrypt_key;
+    #if HAVE_AES_HW
+    block hw_encrypt_key[11];              /* Memory correct               */
+    block hw_decrypt_key[11];              /* Memory correct               */
+    int use_hw;                            /* Whether to use them          */
+    #endif
     #if (OCB_TAG_LEN == 0)
     unsigned tag_len;
     #endif
@@ -663,10 +879,91 @@ static block getL(const ae_ctx *ctx, unsigned tz)
 }
 #endif
 
+/* ----------------------------------------------------------------------- */
+/* AES by whichever implementation the context uses                        */
+/* ----------------------------------------------------------------------- */
+
+static void ecb_encrypt_blks(ae_ctx *ctx, block *blks, unsigned nblks) {
+	#if HAVE_AES_HW
+	if (ctx->use_hw) {
+		ocb_aes_hw::ecb_encrypt_blks(reinterpret_cast<unsigned char *>(blks), nblks,
+		                             reinterpret_cast<unsigned char *>(ctx->hw_encrypt_key));
+		return;
+	}
+	#endif
+	ocb_aes::ecb_encrypt_blks(blks, nblks, ctx->encrypt_key);
+}
+
+static void ecb_decrypt_blks(ae_ctx *ctx, block *blks, unsigned nblks) {
+	#if HAVE_AES_HW
+	if (ctx->use_hw) {
+		ocb_aes_hw::ecb_decrypt_blks(reinterpret_cast<unsigned char *>(blks), nblks,
+		                             reinterpret_cast<unsigned char *>(ctx->hw_decrypt_key));
+		return;
+	}
+	#endif
+	ocb_aes::ecb_decrypt_blks(blks, nblks, ctx->decrypt_key);
+}
+
+static void encrypt_blk(ae_ctx *ctx, unsigned char *in, unsigned char *out) {
+	#if HAVE_AES_HW
+	if (ctx->use_hw) {
+		if (in != out)
+			memcpy(out, in, 16);
+		ocb_aes_hw::ecb_encrypt_blks(out, 1, reinterpret_cast<unsigned char *>(ctx->hw_encrypt_key));
+		return;
+	}
+	#endif
+	ocb_aes::encrypt(in, out, ctx->encrypt_key);
+}
+
 /* ----------------------------------------------------------------------- */
 /* Public functions                                                        */
 /* ----------------------------------------------------------------------- */
 
+/* Implementation 0 is the hardware AES when the CPU has it; the library's
+   AES comes last and is always there.                                      */
+
+#if HAVE_AES_HW
+static bool hw_usable(void)
+{
+	static const bool usable = ocb_aes_hw::cpu_has_aes();
+	return usable;
+}
+#endif
+
+static int selected_impl = 0;
+
+int ae_impl_count(void)
+{
+	#if HAVE_AES_HW
+	if (hw_usable())
+		return 2;
+	#endif
+	return 1;
+}
+
+const char *ae_impl_name(int impl)
+{
+	if (impl < 0 || impl >= ae_impl_count())
+		return NULL;
+	#if HAVE_AES_HW
+	if (impl == 0 && hw_usable())
+		return ocb_aes_hw::name;
+	#endif
+	return ocb_aes::name;
+}
+
+int ae_impl_select(int impl)
+{
+	if (impl < 0 || impl >= ae_impl_count())
+		return AE_NOT_SUPPORTED;
+	selected_impl = impl;
+	return AE_SUCCESS;
+}
+
+/* ----------------------------------------------------------------------- */
+
 /* 32-bit SSE2 and Altivec systems need to be forced to allocate memory
    on 16-byte alignments. (I believe all major 64-bit systems do already.) */
 
@@ -703,14 +1000,23 @@ int ae_init(ae_ctx *ctx, const void *key, int key_len, int nonce_len, int tag_le
     #endif
     ocb_aes::set_encrypt_key(reinterpret_cast<const unsigned char *>(key), key_len*8, ctx->encrypt_key);
     ocb_aes::set_decrypt_key(reinterpret_cast<const unsigned char *>(key), static_cast<int>(key_len*8), ctx->decrypt_key);
+    #if HAVE_AES_HW
+    ctx->use_hw = hw_usable() && selected_impl == 0;
+    if (ctx->use_hw) {
+        fatal_assert(key_len == 16);
+        ocb_aes_hw::set_keys(reinterpret_cast<const unsigned char *>(key),
+                             reinterpret_cast<unsigned char *>(ctx->hw_encrypt_key),
+                             reinterpret_cast<unsigned char *>(ctx->hw_decrypt_key));
+    }
+    #endif
 
     /* Zero things that need zeroing */
     ctx->cached_Top = ctx->ad_checksum = zero_block();
     ctx->ad_blocks_processed = 0;
 
     /* Compute key-dependent values */
-    ocb_aes::encrypt(reinterpret_cast<unsigned char *>(&ctx->cached_Top),
-                            reinterpret_cast<unsigned char *>(&ctx->Lstar), ctx->encrypt_key);
+    encrypt_blk(ctx, reinterpret_cast<unsigned char *>(&ctx->cached_Top),
+                     reinterpret_cast<unsigned char *>(&ctx->Lstar));
     tmp_blk = swap_if_le(ctx->Lstar);
     tmp_blk = double_block(tmp_blk);
     ctx->Ldollar = swap_if_le(tmp_blk);
@@ -747,7 +1053,7 @@ static block gen_offset_from_nonce(ae_ctx *ctx, const void *nonce)
 	tmp.u8[15] = tmp.u8[15] & 0xc0;        /* Zero low 6 bits of nonce */
 	if ( unequal_blocks(tmp.bl,ctx->cached_Top) )   { /* Cached?       */
 		ctx->cached_Top = tmp.bl;          /* Update cache, KtopStr    */
-		ocb_aes::encrypt(tmp.u8, (unsigned char *)&ctx->KtopStr, ctx->encrypt_key);
+		encrypt_blk(ctx, tmp.u8, (unsigned char *)&ctx->KtopStr);
 		if (little.endian) {               /* Make Register Correct    */
 			ctx->KtopStr[0] = bswap64(ctx->KtopStr[0]);
 			ctx->KtopStr[1] = bswap64(ctx->KtopStr[1]);
@@ -795,7 +1101,7 @@ static void process_ad(ae_ctx *ctx, const void *ad, int ad_len, int final)
 				ad_offset = xor_block(oa[6], getL(ctx, tz));
 				ta[7] = xor_block(ad_offset, adp[7]);
 			#endif
-			ocb_aes::ecb_encrypt_blks(ta, BPI, ctx->encrypt_key);
+			ecb_encrypt_blks(ctx, ta, BPI);
 			ad_checksum = xor_block(ad_checksum, ta[0]);
 			ad_checksum = xor_block(ad_checksum, ta[1]);
 			ad_checksum = xor_block(ad_checksum, ta[2]);
@@ -856,7 +1162,7 @@ static void process_ad(ae_ctx *ctx, const void *ad, int ad_len, int final)
 				ta[k] = xor_block(ad_offset, tmp.bl);
 				++k;
 			}
-			ocb_aes::ecb_encrypt_blks(ta, k, ctx->encrypt_key);
+			ecb_encrypt_blks(ctx, ta, k);
 			switch (k) {
 				#if (BPI == 8)
 				case 8: ad_checksum = xor_block(ad_checksum, ta[7]);
@@ -866,8 +1172,8 @@ static void process_ad(ae_ctx *ctx, const void *ad, int ad_len, int final)
 				case 6: ad_checksum = xor_block(ad_checksum, ta[5]);
 					/* fallthrough */
 				case 5: ad_checksum = xor_block(ad_checksum, ta[4]);
-					/* fallthrough */
 				#endif
+					/* fallthrough */
 				case 4: ad_checksum = xor_block(ad_checksum, ta[3]);
 					/* fallthrough */
 				case 3: ad_checksum = xor_block(ad_checksum, ta[2]);
@@ -953,7 +1259,7 @@ int ae_encrypt(ae_ctx     *  ctx,
 				ta[7] = xor_block(oa[7], ptp[7]);
 				checksum = xor_block(checksum, ptp[7]);
 			#endif
-			ocb_aes::ecb_encrypt_blks(ta, BPI, ctx->encrypt_key);
+			ecb_encrypt_blks(ctx, ta, BPI);
 			ctp[0] = xor_block(ta[0], oa[0]);
 			ctp[1] = xor_block(ta[1], oa[1]);
 			ctp[2] = xor_block(ta[2], oa[2]);
@@ -1025,7 +1331,7 @@ int ae_encrypt(ae_ctx     *  ctx,
 		}
         offset = xor_block(offset, ctx->Ldollar);      /* Part of tag gen */
         ta[k] = xor_block(offset, checksum);           /* Part of tag gen */
-		ocb_aes::ecb_encrypt_blks(ta, k + 1, ctx->encrypt_key);
+		ecb_encrypt_blks(ctx, ta, k + 1);
 		offset = xor_block(ta[k], ctx->ad_checksum);   /* Part of tag gen */
 		if (remaining) {
 			--k;
@@ -1041,8 +1347,8 @@ int ae_encrypt(ae_ctx     *  ctx,
 			case 5: ctp[4] = xor_block(ta[4], oa[4]);
 				/* fallthrough */
 			case 4: ctp[3] = xor_block(ta[3], oa[3]);
-				/* fallthrough */
 			#endif
+				/* fallthrough */
 			case 3: ctp[2] = xor_block(ta[2], oa[2]);
 				/* fallthrough */
 			case 2: ctp[1] = xor_block(ta[1], oa[1]);
@@ -1166,7 +1472,7 @@ int ae_decrypt(ae_ctx     *ctx,
 				oa[7] = xor_block(oa[6], getL(ctx, ntz(block_num)));
 				ta[7] = xor_block(oa[7], ctp[7]);
 			#endif
-			ocb_aes::ecb_decrypt_blks(ta,BPI,ctx->decrypt_key);
+			ecb_decrypt_blks(ctx, ta, BPI);
 			ptp[0] = xor_block(ta[0], oa[0]);
 			checksum = xor_block(checksum, ptp[0]);
 			ptp[1] = xor_block(ta[1], oa[1]);
@@ -1231,7 +1537,7 @@ int ae_decrypt(ae_ctx     *ctx,
 			if (remaining) {
 				block pad;
 				offset = xor_block(offset,ctx->Lstar);
-				ocb_aes::encrypt(reinterpret_cast<unsigned char *>(&offset), tmp.u8, ctx->encrypt_key);
+				encrypt_blk(ctx, reinterpret_cast<unsigned char *>(&offset), tmp.u8);
 				pad = tmp.bl;
 				memcpy(tmp.u8,ctp+k,remaining);
 				tmp.bl = xor_block(tmp.bl, pad);
@@ -1240,7 +1546,7 @@ int ae_decrypt(ae_ctx     *ctx,
 				checksum = xor_block(checksum, tmp.bl);
 			}
 		}
-		ocb_aes::ecb_decrypt_blks(ta,k,ctx->decrypt_key);
+		ecb_decrypt_blks(ctx, ta, k);
 		switch (k) {
 			#if (BPI == 8)
 			case 7: ptp[6] = xor_block(ta[6], oa[6]);
@@ -1254,8 +1560,8 @@ int ae_decrypt(ae_ctx     *ctx,
 				    /* fallthrough */
 			case 4: ptp[3] = xor_block(ta[3], oa[3]);
 				    checksum = xor_block(checksum, ptp[3]);
-				    /* fallthrough */
 			#endif
+				    /* fallthrough */
 			case 3: ptp[2] = xor_block(ta[2], oa[2]);
 				    checksum = xor_block(checksum, ptp[2]);
 				    /* fallthrough */
@@ -1269,7 +1575,7 @@ int ae_decrypt(ae_ctx     *ctx,
 		/* Calculate expected tag */
         offset = xor_block(offset, ctx->Ldollar);
         tmp.bl = xor_block(offset, checksum);
-		ocb_aes::encrypt(tmp.u8, tmp.u8, ctx->encrypt_key);
+		encrypt_blk(ctx, tmp.u8, tmp.u8);
 		tmp.bl = xor_block(tmp.bl, ctx->ad_checksum); /* Full tag */
 
 		/* Compare with proposed tag, change ct_len if invalid */
@@ -22,6 +22,19 @@ int ae_ctx_sizeof() {
   return sizeof(_ae_ctx);
 }
 
+// OpenSSL picks its own AES code for the CPU, so there is just the one.
+int ae_impl_count() {
+  return 1;
+}
+
+const char *ae_impl_name(int impl) {
+  return impl == 0 ? "OpenSSL OCB" : NULL;
+}
+
+int ae_impl_select(int impl) {
+  return impl == 0 ? AE_SUCCESS : AE_NOT_SUPPORTED;
+}
+
 // If direction is 1, initializes encryption. If 0, initializes
 // decryption. See the documentation of EVP_CipherInit_ex
 static int ae_evp_cipher_init(EVP_CIPHER_CTX **in_ctx, int direction,
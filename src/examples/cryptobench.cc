@@ -0,0 +1,120 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Times Session::encrypt() and decrypt() with each AES-OCB
+   implementation built in, on packets of typical sizes. */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "src/crypto/crypto.h"
+
+using namespace Crypto;
+
+static const int ITERATIONS = 100000;
+
+typedef std::chrono::steady_clock clock_type;
+
+static double seconds_since( clock_type::time_point start )
+{
+  const std::chrono::duration<double> elapsed = clock_type::now() - start;
+  return elapsed.count();
+}
+
+int main( int argc, char *argv[] )
+{
+  int iterations = ITERATIONS;
+  if ( argc > 1 ) {
+    iterations = atoi( argv[ 1 ] );
+    if ( iterations < 1 || iterations > 1000000000 ) {
+      fprintf( stderr, "bogus iteration count\n" );
+      exit( 1 );
+    }
+  }
+
+  static const size_t sizes[] = { 30, 64, 100, 300, 600, 1300 };
+
+  try {
+    const std::vector<std::string> names = implementations();
+
+    printf( "%-16s %6s %12s %12s %12s %12s\n", "implementation", "bytes",
+	    "encrypt us", "decrypt us", "encrypt MB/s", "decrypt MB/s" );
+
+    for ( size_t i = 0; i < names.size(); i++ ) {
+      if ( !implementation_correct( i ) ) {
+	printf( "%-16s fails its self-test\n", names[ i ].c_str() );
+	continue;
+      }
+      select_implementation( i );
+      Base64Key key;
+      Session session( key );
+      AlignedBuffer buf( Session::RECEIVE_MTU );
+
+      for ( size_t len : sizes ) {
+	/* as Connection does: encrypted in place in its send buffer, and
+	   decrypted in place where the datagram was received */
+	memset( buf.data(), 'x', len );
+	const size_t ct_len = session.encrypt( Nonce( 0 ), buf.data(), len );
+	const std::string datagram( buf.data(), ct_len );
+
+	clock_type::time_point start = clock_type::now();
+	for ( int j = 0; j < iterations; j++ ) {
+	  session.encrypt( Nonce( j ), buf.data(), len );
+	}
+	const double encrypt_time = seconds_since( start ) / iterations;
+
+	start = clock_type::now();
+	for ( int j = 0; j < iterations; j++ ) {
+	  memcpy( buf.data(), datagram.data(), datagram.size() ); /* its arrival */
+	  session.decrypt( Nonce( 0 ), buf.data(), datagram.size() );
+	}
+	const double decrypt_time = seconds_since( start ) / iterations;
+
+	printf( "%-16s %6zu %12.3f %12.3f %12.1f %12.1f\n", names[ i ].c_str(), len,
+		encrypt_time * 1e6, decrypt_time * 1e6,
+		len / encrypt_time / 1e6, len / decrypt_time / 1e6 );
+      }
+    }
+
+    const size_t fastest = select_fastest_implementation();
+    printf( "\nfastest: %s\n", names[ fastest ].c_str() );
+  } catch ( const CryptoException &e ) {
+    fprintf( stderr, "%s\n", e.what() );
+    exit( 1 );
+  }
+
+  return 0;
+}
@@ -192,6 +192,8 @@ int main( int argc, char *argv[] )
 
   bool success = false;
   try {
+    Crypto::select_implementation_from_environment();
+
     STMClient client( ip, desired_port, key.c_str(), predict_mode, verbose, predict_overwrite );
     client.init();
 
@@ -409,6 +409,8 @@ static int run_server( const char *desired_ip, const char *desired_port,
       network_signaled_timeout = 0;
     }
   }
+  /* choose the AES implementation before the connection makes its session */
+  Crypto::select_implementation_from_environment();
   /* get initial window size */
   struct winsize window_size;
   if ( ioctl( STDIN_FILENO, TIOCGWINSZ, &window_size ) < 0 ||
@@ -471,7 +471,7 @@ bool STMClient::main( void )
 	    it++ ) {
 	if ( sel.read( *it ) ) {
 	  /* packet received from the network */
-	  /* we only read one socket each run */
+	  /* one recv() drains all the sockets */
 	  network_ready_to_read = true;
 	}
       }
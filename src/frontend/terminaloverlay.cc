@@ -34,7 +34,6 @@
 #include <climits>
 #include <cwchar>
 #include <list>
-#include <typeinfo>
 
 #include "src/frontend/terminaloverlay.h"
 
@@ -669,21 +668,20 @@ void PredictionEngine::new_user_byte( char the_byte, const Framebuffer &fb )
   }
   last_byte = the_byte;
 
-  Parser::Actions actions;
-  parser.input( the_byte, actions );
+  Parser::Tokens tokens;
+  parser.input( the_byte, tokens );
 
-  for ( Parser::Actions::iterator it = actions.begin();
-        it != actions.end();
+  for ( Parser::Tokens::const_iterator it = tokens.begin();
+        it != tokens.end();
         it++ ) {
-    Parser::Action& act = **it;
+    const Parser::Token& act = *it;
 
     /*
-    fprintf( stderr, "Action: %s (%lc)\n",
-	     act->name().c_str(), act->char_present ? act->ch : L'_' );
+    fprintf( stderr, "Action: %d (%lc)\n",
+	     act.type, act.char_present ? act.ch : L'_' );
     */
 
-    const std::type_info& type_act = typeid( act );
-    if ( type_act == typeid( Parser::Print ) ) {
+    if ( act.type == Parser::PRINT ) {
       /* make new prediction */
 
       init_cursor( fb );
@@ -828,7 +826,7 @@ void PredictionEngine::new_user_byte( char the_byte, const Framebuffer &fb )
 	  newline_carriage_return( fb );
 	}
       }
-    } else if ( type_act == typeid( Parser::Execute ) ) {
+    } else if ( act.type == Parser::EXECUTE ) {
       if ( act.char_present && (act.ch == 0x0d) /* CR */ ) {
 	become_tentative();
 	newline_carriage_return( fb );
@@ -836,10 +834,10 @@ void PredictionEngine::new_user_byte( char the_byte, const Framebuffer &fb )
 	//	fprintf( stderr, "Execute 0x%x\n", act.ch );
 	become_tentative();	
       }
-    } else if ( type_act == typeid( Parser::Esc_Dispatch ) ) {
+    } else if ( act.type == Parser::ESC_DISPATCH ) {
       //      fprintf( stderr, "Escape sequence\n" );
       become_tentative();
-    } else if ( type_act == typeid( Parser::CSI_Dispatch ) ) {
+    } else if ( act.type == Parser::CSI_DISPATCH ) {
       if ( act.char_present && (act.ch == L'C') ) { /* right arrow */
 	init_cursor( fb );
 	if ( cursor().col < fb.ds.get_width() - 1 ) {
@@ -34,9 +34,23 @@
 
 #include "compressor.h"
 #include "src/util/dos_assert.h"
+#include "src/util/fatal_assert.h"
 
 using namespace Network;
 
+Compressor::Compressor()
+  : buffer(), deflater(), inflater()
+{
+  fatal_assert( Z_OK == deflateInit( &deflater, Z_DEFAULT_COMPRESSION ) );
+  fatal_assert( Z_OK == inflateInit( &inflater ) );
+}
+
+Compressor::~Compressor()
+{
+  deflateEnd( &deflater );
+  inflateEnd( &inflater );
+}
+
 std::string Compressor::compress_str( const std::string &input )
 {
   long unsigned int len = BUFFER_SIZE;
@@ -55,6 +69,63 @@ std::string Compressor::uncompress_str( const std::string &input )
   return std::string( reinterpret_cast<char *>( buffer ), len );
 }
 
+std::string Compressor::compress_str( const std::string &input, const std::string &dictionary )
+{
+  fatal_assert( Z_OK == deflateReset( &deflater ) );
+  fatal_assert( Z_OK == deflateSetDictionary( &deflater,
+					      reinterpret_cast<const unsigned char *>( dictionary.data() ),
+					      dictionary.size() ) );
+
+  deflater.next_in = reinterpret_cast<unsigned char *>( const_cast<char *>( input.data() ) );
+  deflater.avail_in = input.size();
+  deflater.next_out = buffer;
+  deflater.avail_out = BUFFER_SIZE;
+  fatal_assert( Z_STREAM_END == deflate( &deflater, Z_FINISH ) );
+
+  return std::string( reinterpret_cast<char *>( buffer ), BUFFER_SIZE - deflater.avail_out );
+}
+
+bool Compressor::uncompress_str( const std::string &input, const std::string &dictionary, std::string &output )
+{
+  fatal_assert( Z_OK == inflateReset( &inflater ) );
+
+  inflater.next_in = reinterpret_cast<unsigned char *>( const_cast<char *>( input.data() ) );
+  inflater.avail_in = input.size();
+  inflater.next_out = buffer;
+  inflater.avail_out = BUFFER_SIZE;
+  int ret = inflate( &inflater, Z_FINISH );
+  if ( ret == Z_NEED_DICT ) {
+    if ( Z_OK != inflateSetDictionary( &inflater,
+				       reinterpret_cast<const unsigned char *>( dictionary.data() ),
+				       dictionary.size() ) ) {
+      return false; /* sender's dictionary has another checksum */
+    }
+    ret = inflate( &inflater, Z_FINISH );
+  }
+  dos_assert( Z_STREAM_END == ret );
+
+  output.assign( reinterpret_cast<char *>( buffer ), BUFFER_SIZE - inflater.avail_out );
+  return true;
+}
+
+/* Most frequent last, as matches there are cheapest */
+static const char builtin_dictionary_data[] =
+  "\033]0;\007\033]1;\007\033]2;\007\033[?1004l\033[?2004h\033[?2004l"
+  "\033[?1003l\033[?1002l\033[?1001l\033[?1000l\033[?1015l\033[?1006l\033[?1005l"
+  "\033[?1l\033[?1h\033[r\033[0m\033[H\033[2J\033[1L\033[1;24r"
+  "\033[0;7m\033[0;4m\033[0;1m\033[0;2m\033[0;1;38;5;"
+  "\033[0;48;5;\033[0;38;5;\033[0;38;2;\033[0;48;2;"
+  "\033[0;37m\033[0;36m\033[0;35m\033[0;34m\033[0;33m\033[0;32m\033[0;31m\033[0;30m"
+  "\033[0;1;37m\033[0;1;36m\033[0;1;34m\033[0;1;33m\033[0;1;32m\033[0;1;31m"
+  "                                \033[1X\033[2X\033[3X\033[4X\033[5X\033[8X"
+  "\033[K\r\n\033[K\033[0m\033[?25l\033[?25h\033[1;1H\033[24;1H\033[0m\033[K\r\n";
+
+const std::string &Network::builtin_dictionary( void )
+{
+  static const std::string dictionary( builtin_dictionary_data, sizeof( builtin_dictionary_data ) - 1 );
+  return dictionary;
+}
+
 /* construct on first use */
 Compressor & Network::get_compressor( void )
 {
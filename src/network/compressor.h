@@ -35,6 +35,8 @@
 
 #include <string>
 
+#include <zlib.h>
+
 namespace Network {
   class Compressor {
   private:
@@ -42,19 +44,31 @@ namespace Network {
 
     unsigned char buffer[BUFFER_SIZE];
 
+    /* kept between calls with a preset dictionary to save setup */
+    z_stream deflater, inflater;
+
   public:
-  Compressor() : buffer() {}
-    ~Compressor() {}
+    Compressor();
+    ~Compressor();
 
     std::string compress_str( const std::string &input );
     std::string uncompress_str( const std::string &input );
 
+    /* Deflate with a preset dictionary the other side can also build.
+       uncompress_str returns false if output was compressed with a
+       different dictionary. */
+    std::string compress_str( const std::string &input, const std::string &dictionary );
+    bool uncompress_str( const std::string &input, const std::string &dictionary, std::string &output );
+
     /* unused */
     Compressor( const Compressor & );
     Compressor & operator=( const Compressor & );
   };
 
   Compressor & get_compressor( void );
+
+  /* Escape sequences common in terminal output */
+  const std::string &builtin_dictionary( void );
 }
 
 #endif
@@ -43,6 +43,7 @@
 #endif
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <unistd.h>
 
 #include "src/util/dos_assert.h"
@@ -66,38 +67,88 @@ using namespace Crypto;
 
 const uint64_t DIRECTION_MASK = uint64_t(1) << 63;
 const uint64_t SEQUENCE_MASK = uint64_t(-1) ^ DIRECTION_MASK;
+const uint64_t COMPACT_SEQUENCE_MASK = ( uint64_t(1) << 56 ) - 1; /* below the top byte */
+
+static uint64_t sequence_mask( uint64_t nonce_val )
+{
+  return ( nonce_val & Packet::COMPACT_FLAG ) ? COMPACT_SEQUENCE_MASK : SEQUENCE_MASK;
+}
 
 /* Read in packet */
-Packet::Packet( const Message & message )
-  : seq( message.nonce.val() & SEQUENCE_MASK ),
+Packet::Packet( const MessageView & message )
+  : seq( message.nonce.val() & sequence_mask( message.nonce.val() ) ),
     direction( (message.nonce.val() & DIRECTION_MASK) ? TO_CLIENT : TO_SERVER ),
     timestamp( -1 ),
     timestamp_reply( -1 ),
-    payload()
+    payload(),
+    compact( message.nonce.val() & COMPACT_FLAG )
 {
-  dos_assert( message.text.size() >= 2 * sizeof( uint16_t ) );
+  const bool has_reply = !compact || ( message.nonce.val() & REPLY_FLAG );
+  const size_t ts_len = ( has_reply ? 2 : 1 ) * sizeof( uint16_t );
+  dos_assert( message.text.size() >= ts_len );
 
   const uint16_t *data = (uint16_t *)message.text.data();
   timestamp = be16toh( data[ 0 ] );
-  timestamp_reply = be16toh( data[ 1 ] );
+  if ( has_reply ) {
+    timestamp_reply = be16toh( data[ 1 ] );
+  }
 
-  payload = std::string( message.text.begin() + 2 * sizeof( uint16_t ), message.text.end() );
+  payload = std::string( message.text.substr( ts_len ) );
 }
 
 /* Output from packet */
-Message Packet::toMessage( void )
+uint64_t Packet::direction_seq( void ) const
 {
-  uint64_t direction_seq = (uint64_t( direction == TO_CLIENT ) << 63) | (seq & SEQUENCE_MASK);
+  uint64_t ret = (uint64_t( direction == TO_CLIENT ) << 63) | (seq & SEQUENCE_MASK);
+  if ( compact ) {
+    fatal_assert( !( seq & ~COMPACT_SEQUENCE_MASK ) );
+    ret |= COMPACT_FLAG | ( ( timestamp_reply != uint16_t(-1) ) ? REPLY_FLAG : 0 );
+  }
+  return ret;
+}
+
+size_t Packet::timestamps_len( void ) const
+{
+  return ( ( compact && ( timestamp_reply == uint16_t(-1) ) ) ? 1 : 2 ) * sizeof( uint16_t );
+}
 
+Message Packet::toMessage( void )
+{
   uint16_t ts_net[ 2 ] = { static_cast<uint16_t>( htobe16( timestamp ) ),
                            static_cast<uint16_t>( htobe16( timestamp_reply ) ) };
 
-  std::string timestamps = std::string( (char *)ts_net, 2 * sizeof( uint16_t ) );
+  std::string timestamps = std::string( (char *)ts_net, timestamps_len() );
+
+  return Message( Nonce( direction_seq() ), timestamps + payload );
+}
+
+void Packet::write_compact_header( char *header, const Nonce &nonce )
+{
+  header[ 0 ] = nonce.cc_data()[ 0 ];
+  memcpy( header + 1, nonce.cc_data() + Nonce::CC_LEN - COMPACT_SEQ_LEN, COMPACT_SEQ_LEN );
+}
+
+/* The nonce of a compact packet: its top byte from the header, and
+   the sequence number nearest expected_seq that ends in the header's
+   low bytes */
+uint64_t Packet::compact_nonce( const char *header, uint64_t expected_seq )
+{
+  static_assert( COMPACT_SEQ_LEN == sizeof( uint32_t ), "compact header layout" );
+  uint32_t low_net;
+  memcpy( &low_net, header + 1, sizeof( low_net ) );
+
+  const uint64_t span = uint64_t(1) << 32;
+  uint64_t seq = ( expected_seq & ~( span - 1 ) ) | be32toh( low_net );
+  if ( seq + span / 2 < expected_seq ) {
+    seq += span;
+  } else if ( ( seq > expected_seq + span / 2 ) && ( seq >= span ) ) {
+    seq -= span;
+  }
 
-  return Message( Nonce( direction_seq ), timestamps + payload );
+  return ( uint64_t( uint8_t( header[ 0 ] ) ) << 56 ) | ( seq & COMPACT_SEQUENCE_MASK );
 }
 
-Packet Connection::new_packet( const std::string &s_payload )
+uint16_t Connection::new_timestamp_reply( void )
 {
   uint16_t outgoing_timestamp_reply = -1;
 
@@ -110,9 +161,7 @@ Packet Connection::new_packet( const std::string &s_payload )
     saved_timestamp_received_at = 0;
   }
 
-  Packet p( direction, timestamp16(), outgoing_timestamp_reply, s_payload );
-
-  return p;
+  return outgoing_timestamp_reply;
 }
 
 void Connection::hop_port( void )
@@ -122,6 +171,7 @@ void Connection::hop_port( void )
   setup();
   assert( remote_addr_len != 0 );
   socks.push_back( Socket( remote_addr.sa.sa_family ) );
+  restart_mtu_search();
 
   prune_sockets();
 }
@@ -202,14 +252,121 @@ void Connection::set_MTU( int family )
 {
   switch ( family ) {
   case AF_INET:
-    MTU = DEFAULT_IPV4_MTU - IPV4_HEADER_LEN;
+    base_MTU = DEFAULT_IPV4_MTU - IPV4_HEADER_LEN;
+    max_MTU = MAX_PROBED_MTU - IPV4_HEADER_LEN;
     break;
   case AF_INET6:
-    MTU = DEFAULT_IPV6_MTU - IPV6_HEADER_LEN;
+    base_MTU = DEFAULT_IPV6_MTU - IPV6_HEADER_LEN;
+    max_MTU = MAX_PROBED_MTU - IPV6_HEADER_LEN;
     break;
   default:
     throw NetworkException( "Unknown address family", 0 );
   }
+
+  restart_mtu_search();
+}
+
+/* Fall back to the MTU that needs no probing and search from there */
+void Connection::restart_mtu_search( void )
+{
+  MTU = base_MTU;
+  mtu_search_high = max_MTU;
+  mtu_probe_size = 0;
+  mtu_probe_losses = 0;
+  mtu_probe_time = 0;
+}
+
+/* Sets the don't-fragment bit on the current socket, or clears it.
+   Returns false where that is not possible. */
+bool Connection::set_dont_fragment( bool df )
+{
+  switch ( remote_addr.sa.sa_family ) {
+  case AF_INET:
+#if defined( HAVE_IP_MTU_DISCOVER ) && defined( IP_PMTUDISC_PROBE )
+    {
+      int flag = df ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+      return setsockopt( sock(), IPPROTO_IP, IP_MTU_DISCOVER, &flag, sizeof flag ) == 0;
+    }
+#else
+    break;
+#endif
+  case AF_INET6:
+#ifdef IPV6_DONTFRAG
+    if ( !IN6_IS_ADDR_V4MAPPED( &remote_addr.sin6.sin6_addr ) ) {
+      int flag = df;
+      return setsockopt( sock(), IPPROTO_IPV6, IPV6_DONTFRAG, &flag, sizeof flag ) == 0;
+    }
+#endif
+    break;
+  }
+
+  return false;
+}
+
+bool Connection::mtu_probe_due( int &size, uint32_t &probe_id )
+{
+  if ( !has_remote_addr ) {
+    return false;
+  }
+
+  const uint64_t now = timestamp();
+
+  /* large datagrams may be vanishing where they once got through */
+  if ( (MTU > base_MTU) && (now - last_roundtrip_success > MTU_BLACK_HOLE_TIMEOUT) ) {
+    restart_mtu_search();
+  }
+
+  if ( mtu_probe_size ) {
+    if ( now - mtu_probe_time < timeout() + MTU_PROBE_GRACE ) {
+      return false;
+    }
+    /* lost, perhaps for being too large */
+    if ( ++mtu_probe_losses >= MTU_PROBE_TRIES ) {
+      mtu_search_high = mtu_probe_size - 1;
+      mtu_probe_losses = 0;
+    }
+    mtu_probe_size = 0;
+  }
+
+  if ( mtu_search_high - MTU < MTU_SEARCH_STEP ) {
+    if ( now - mtu_probe_time < MTU_REPROBE_INTERVAL ) {
+      return false;
+    }
+    mtu_search_high = max_MTU; /* search again, the path may have changed */
+  }
+
+  size = (MTU + mtu_search_high + 1) / 2;
+  probe_id = mtu_probe_id + 1;
+  return true;
+}
+
+void Connection::send_mtu_probe( const char *header, size_t header_len, const std::string & s, bool compact )
+{
+  if ( !set_dont_fragment( true ) ) {
+    mtu_search_high = MTU; /* cannot tell a fragmented probe from a whole one */
+    mtu_probe_time = timestamp();
+    return;
+  }
+
+  mtu_probe_id++;
+  mtu_probe_time = timestamp();
+
+  sending_mtu_probe = true; /* send() notes its size */
+  send( header, header_len, s, compact );
+  sending_mtu_probe = false;
+
+  set_dont_fragment( false );
+}
+
+void Connection::mtu_probe_acked( uint32_t probe_id )
+{
+  if ( mtu_probe_size && (probe_id == mtu_probe_id) ) {
+    if ( mtu_probe_size > MTU ) {
+      MTU = mtu_probe_size;
+    }
+    mtu_probe_size = 0;
+    mtu_probe_losses = 0;
+  }
 }
 
 class AddrInfo {
@@ -236,6 +393,14 @@ Connection::Connection( const char *desired_ip, const char *desired_port ) /* se
     remote_addr_len( 0 ),
     server( true ),
     MTU( DEFAULT_SEND_MTU ),
+    base_MTU( DEFAULT_SEND_MTU ),
+    max_MTU( DEFAULT_SEND_MTU ),
+    mtu_search_high( DEFAULT_SEND_MTU ),
+    mtu_probe_size( 0 ),
+    mtu_probe_id( 0 ),
+    mtu_probe_losses( 0 ),
+    mtu_probe_time( 0 ),
+    sending_mtu_probe( false ),
     key(),
     session( key ),
     direction( TO_CLIENT ),
@@ -248,7 +413,19 @@ Connection::Connection( const char *desired_ip, const char *desired_port ) /* se
     RTT_hit( false ),
     SRTT( 1000 ),
     RTTVAR( 500 ),
-    send_error()
+    min_RTT( 0 ),
+    min_RTT_slots(),
+    min_RTT_slot( 0 ),
+    min_RTT_time( 0 ),
+    last_RTT( 0 ),
+    loss_rate( 0 ),
+    send_error(),
+    received( RECV_BATCH ),
+    received_count( 0 ),
+    received_next( 0 ),
+    received_compact( false ),
+    send_buffer( SEND_BATCH * SEND_SLOT_LEN ),
+    gso_usable( true )
 {
   setup();
 
@@ -358,6 +535,14 @@ Connection::Connection( const char *key_str, const char *ip, const char *port )
     remote_addr_len( 0 ),
     server( false ),
     MTU( DEFAULT_SEND_MTU ),
+    base_MTU( DEFAULT_SEND_MTU ),
+    max_MTU( DEFAULT_SEND_MTU ),
+    mtu_search_high( DEFAULT_SEND_MTU ),
+    mtu_probe_size( 0 ),
+    mtu_probe_id( 0 ),
+    mtu_probe_losses( 0 ),
+    mtu_probe_time( 0 ),
+    sending_mtu_probe( false ),
     key( key_str ),
     session( key ),
     direction( TO_SERVER ),
@@ -370,7 +555,19 @@ Connection::Connection( const char *key_str, const char *ip, const char *port )
     RTT_hit( false ),
     SRTT( 1000 ),
     RTTVAR( 500 ),
-    send_error()
+    min_RTT( 0 ),
+    min_RTT_slots(),
+    min_RTT_slot( 0 ),
+    min_RTT_time( 0 ),
+    last_RTT( 0 ),
+    loss_rate( 0 ),
+    send_error(),
+    received( RECV_BATCH ),
+    received_count( 0 ),
+    received_next( 0 ),
+    received_compact( false ),
+    send_buffer( SEND_BATCH * SEND_SLOT_LEN ),
+    gso_usable( true )
 {
   setup();
 
@@ -392,27 +589,77 @@ Connection::Connection( const char *key_str, const char *ip, const char *port )
   set_MTU( remote_addr.sa.sa_family );
 }
 
-void Connection::send( const std::string & s )
+void Connection::send( const char *header, size_t header_len, const std::string & s, bool compact )
+{
+  const OutgoingDatagram datagram = { header, header_len, &s, compact };
+  send( &datagram, 1 );
+}
+
+#if defined( HAVE_RECVMMSG ) || defined( HAVE_SENDMMSG )
+typedef struct mmsghdr BatchHeader;
+#else
+/* enough of the recvmmsg()/sendmmsg() interface for the loops below */
+struct BatchHeader {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
+void Connection::send( const OutgoingDatagram *datagrams, size_t count )
 {
   if ( !has_remote_addr ) {
     return;
   }
 
-  Packet px = new_packet( s );
-
-  std::string p = session.encrypt( px.toMessage() );
+  while ( count ) {
+    const size_t batch = ( count < SEND_BATCH ) ? count : SEND_BATCH;
+    struct iovec sealed[ SEND_BATCH ];
+
+    for ( size_t i = 0; i < batch; i++ ) {
+      const OutgoingDatagram &d = datagrams[ i ];
+      char *slot = send_buffer.data() + i * SEND_SLOT_LEN;
+
+      /* Lay the packet out as Packet::toMessage() would -- timestamps,
+	 then the payload -- to be encrypted where it lies. */
+      Packet px( direction, timestamp16(), new_timestamp_reply(), std::string(), d.compact );
+      const size_t ts_len = px.timestamps_len();
+      const size_t pt_len = ts_len + d.header_len + d.payload->size();
+      fatal_assert( pt_len + Session::ADDED_BYTES <= Session::RECEIVE_MTU );
+
+      char *pt = slot + CIPHERTEXT_OFFSET;
+      uint16_t ts_net[ 2 ] = { static_cast<uint16_t>( htobe16( px.timestamp ) ),
+			       static_cast<uint16_t>( htobe16( px.timestamp_reply ) ) };
+      memcpy( pt, ts_net, ts_len );
+      pt += ts_len;
+      if ( d.header_len ) {
+	memcpy( pt, d.header, d.header_len );
+	pt += d.header_len;
+      }
+      memcpy( pt, d.payload->data(), d.payload->size() );
 
-  ssize_t bytes_sent = sendto( sock(), p.data(), p.size(), MSG_DONTWAIT,
-			       &remote_addr.sa, remote_addr_len );
+      const Nonce nonce( px.direction_seq() );
+      const size_t ct_len = session.encrypt( nonce, slot + CIPHERTEXT_OFFSET, pt_len );
 
-  if ( bytes_sent != static_cast<ssize_t>( p.size() ) ) {
-    /* Make sendto() failure available to the frontend. */
-    send_error = "sendto: ";
-    send_error += strerror( errno );
+      /* the wire nonce, just ahead of the ciphertext */
+      const size_t nonce_len = d.compact ? Packet::COMPACT_HEADER_LEN : Nonce::CC_LEN;
+      char *out = slot + CIPHERTEXT_OFFSET - nonce_len;
+      if ( d.compact ) {
+	Packet::write_compact_header( out, nonce );
+      } else {
+	memcpy( out, nonce.cc_data(), Nonce::CC_LEN );
+      }
+      sealed[ i ].iov_base = out;
+      sealed[ i ].iov_len = nonce_len + ct_len;
 
-    if ( errno == EMSGSIZE ) {
-      MTU = DEFAULT_SEND_MTU; /* payload MTU of last resort */
+      if ( sending_mtu_probe ) {
+	mtu_probe_size = sealed[ i ].iov_len;
+      }
     }
+
+    transmit( sealed, batch );
+
+    datagrams += batch;
+    count -= batch;
   }
 
   uint64_t now = timestamp();
@@ -429,72 +676,133 @@ void Connection::send( const std::string & s )
   }
 }
 
-std::string Connection::recv( void )
+/* Hand the datagrams sealed in send_buffer to the kernel */
+void Connection::transmit( struct iovec *datagrams, size_t count )
 {
-  assert( !socks.empty() );
-  for ( std::deque< Socket >::const_iterator it = socks.begin();
-	it != socks.end();
-	it++ ) {
-    std::string payload;
-    try {
-      payload = recv_one( it->fd());
-    } catch ( NetworkException & e ) {
-      if ( (e.the_errno == EAGAIN)
-	   || (e.the_errno == EWOULDBLOCK) ) {
-	continue;
-      } else {
-	throw;
-      }
-    }
-
-    /* succeeded */
-    prune_sockets();
-    return payload;
+#ifdef UDP_SEGMENT
+  /* The kernel cuts one large send, gathered from all of them, into
+     datagrams of the first one's size, the last of which may be
+     shorter. */
+  const size_t first_len = datagrams[ 0 ].iov_len;
+  bool segmentable = gso_usable && ( count > 1 );
+  size_t total = first_len;
+  for ( size_t i = 1; segmentable && ( i < count ); i++ ) {
+    const size_t len = datagrams[ i ].iov_len;
+    segmentable = ( i + 1 < count ) ? ( len == first_len ) : ( len <= first_len );
+    total += len;
   }
-  throw NetworkException( "No packet received" );
-}
-
-std::string Connection::recv_one( int sock_to_recv )
-{
-  /* receive source address, ECN, and payload in msghdr structure */
-  Addr packet_remote_addr;
-  struct msghdr header;
-  struct iovec msg_iovec;
-
-  char msg_payload[ Session::RECEIVE_MTU ];
-  char msg_control[ Session::RECEIVE_MTU ];
 
-  /* receive source address */
-  header.msg_name = &packet_remote_addr;
-  header.msg_namelen = sizeof packet_remote_addr;
-
-  /* receive payload */
-  msg_iovec.iov_base = msg_payload;
-  msg_iovec.iov_len = sizeof msg_payload;
-  header.msg_iov = &msg_iovec;
-  header.msg_iovlen = 1;
+  if ( segmentable ) {
+    union {
+      char buf[ CMSG_SPACE( sizeof( uint16_t ) ) ];
+      struct cmsghdr align;
+    } control;
+    memset( &control, 0, sizeof( control ) );
+
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_name = &remote_addr.sa;
+    msg.msg_namelen = remote_addr_len;
+    msg.msg_iov = datagrams;
+    msg.msg_iovlen = count;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof( control.buf );
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN( sizeof( uint16_t ) );
+    const uint16_t segment_size = first_len;
+    memcpy( CMSG_DATA( cmsg ), &segment_size, sizeof( segment_size ) );
+
+    if ( sendmsg( sock(), &msg, MSG_DONTWAIT ) == static_cast<ssize_t>( total ) ) {
+      return;
+    }
+    if ( ( errno != EINVAL ) && ( errno != EIO ) && ( errno != ENOPROTOOPT ) && ( errno != EOPNOTSUPP ) ) {
+      note_send_error( errno );
+      return;
+    }
+    gso_usable = false; /* old kernel or no checksum offload; send them singly */
+  }
+#endif
 
-  /* receive explicit congestion notification */
-  header.msg_control = msg_control;
-  header.msg_controllen = sizeof msg_control;
+  BatchHeader headers[ SEND_BATCH ];
 
-  /* receive flags */
-  header.msg_flags = 0;
+  for ( size_t i = 0; i < count; i++ ) {
+    struct msghdr &msg = headers[ i ].msg_hdr;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_name = &remote_addr.sa;
+    msg.msg_namelen = remote_addr_len;
+    msg.msg_iov = &datagrams[ i ];
+    msg.msg_iovlen = 1;
+    headers[ i ].msg_len = 0;
+  }
 
-  ssize_t received_len = recvmsg( sock_to_recv, &header, MSG_DONTWAIT );
+#ifdef HAVE_SENDMMSG
+  size_t sent = 0;
+  while ( sent < count ) {
+    int n = sendmmsg( sock(), headers + sent, count - sent, MSG_DONTWAIT );
+    if ( n < 0 ) {
+      note_send_error( errno );
+      n = 1; /* that one is lost; go on with the rest */
+    }
+    sent += n;
+  }
+#else
+  for ( size_t i = 0; i < count; i++ ) {
+    if ( sendmsg( sock(), &headers[ i ].msg_hdr, MSG_DONTWAIT ) != static_cast<ssize_t>( datagrams[ i ].iov_len ) ) {
+      note_send_error( errno );
+    }
+  }
+#endif
+}
 
-  if ( received_len < 0 ) {
-    throw NetworkException( "recvmsg", errno );
+void Connection::note_send_error( int err )
+{
+  /* Make sendto() failure available to the frontend. */
+  send_error = "sendto: ";
+  send_error += strerror( err );
+
+  if ( err == EMSGSIZE ) {
+    if ( sending_mtu_probe ) { /* too large for the interface */
+      mtu_search_high = mtu_probe_size - 1;
+      mtu_probe_size = 0;
+      mtu_probe_losses = 0;
+    } else {
+      MTU = DEFAULT_SEND_MTU; /* payload MTU of last resort */
+      mtu_search_high = MTU;
+      mtu_probe_time = timestamp();
+    }
   }
+}
 
-  if ( header.msg_flags & MSG_TRUNC ) {
-    throw NetworkException( "Received oversize datagram", errno );
+std::string Connection::recv( void )
+{
+  assert( !socks.empty() );
+  if ( !has_pending() ) {
+    received_count = received_next = 0;
+    for ( std::deque< Socket >::const_iterator it = socks.begin();
+	  it != socks.end() && received_count < RECV_BATCH;
+	  it++ ) {
+      if ( !recv_batch( it->fd() ) ) {
+	break;
+      }
+    }
+    if ( received_count == 0 ) {
+      throw NetworkException( "No packet received" );
+    }
+
+    /* succeeded */
+    prune_sockets();
   }
 
-  /* receive ECN */
-  bool congestion_experienced = false;
+  return process_datagram( received[ received_next++ ] );
+}
 
-  struct cmsghdr *ecn_hdr = CMSG_FIRSTHDR( &header );
+/* receive explicit congestion notification */
+static bool get_congestion_experienced( struct msghdr *header )
+{
+  struct cmsghdr *ecn_hdr = CMSG_FIRSTHDR( header );
   if ( ecn_hdr
        && ecn_hdr->cmsg_level == IPPROTO_IP
        && ( ecn_hdr->cmsg_type == IP_TOS
@@ -506,16 +814,130 @@ std::string Connection::recv_one( int sock_to_recv )
     uint8_t *ecn_octet_p = (uint8_t *)CMSG_DATA( ecn_hdr );
     assert( ecn_octet_p );
 
-    congestion_experienced = (*ecn_octet_p & 0x03) == 0x03;
+    return (*ecn_octet_p & 0x03) == 0x03;
+  }
+  return false;
+}
+
+/* Append whatever datagrams are waiting on sock_to_recv, up to the
+   batch limit.  Returns true if the caller may go on to read the next
+   socket: false once the batch is full, or if the read failed after
+   datagrams were taken (they are used, and the error recurs on the
+   next read).  Throws if the read fails with nothing taken. */
+bool Connection::recv_batch( int sock_to_recv )
+{
+  const size_t first = received_count;
+  const size_t room = RECV_BATCH - first;
+
+  /* receive source address, ECN, and payload in msghdr structures */
+  BatchHeader headers[ RECV_BATCH ];
+  struct iovec msg_iovecs[ RECV_BATCH ];
+  char msg_controls[ RECV_BATCH ][ 256 ];
+
+  for ( size_t i = 0; i < room; i++ ) {
+    Datagram &d = received[ first + i ];
+    struct msghdr &header = headers[ i ].msg_hdr;
+
+    /* receive source address */
+    header.msg_name = &d.remote_addr;
+    header.msg_namelen = sizeof d.remote_addr;
+
+    /* receive payload */
+    msg_iovecs[ i ].iov_base = d.payload();
+    msg_iovecs[ i ].iov_len = Session::RECEIVE_MTU;
+    header.msg_iov = &msg_iovecs[ i ];
+    header.msg_iovlen = 1;
+
+    /* receive explicit congestion notification */
+    header.msg_control = msg_controls[ i ];
+    header.msg_controllen = sizeof msg_controls[ i ];
+
+    /* receive flags */
+    header.msg_flags = 0;
+    headers[ i ].msg_len = 0;
+  }
+
+#ifdef HAVE_RECVMMSG
+  int count = recvmmsg( sock_to_recv, headers, room, MSG_DONTWAIT, NULL );
+#else
+  int count = 0;
+  while ( count < static_cast<int>( room ) ) {
+    ssize_t received_len = recvmsg( sock_to_recv, &headers[ count ].msg_hdr, MSG_DONTWAIT );
+    if ( received_len < 0 ) {
+      if ( count == 0 ) {
+	count = -1;
+      }
+      break;
+    }
+    headers[ count ].msg_len = received_len;
+    count++;
+  }
+#endif
+
+  if ( count < 0 ) {
+    const int saved_errno = errno;
+    if ( (saved_errno == EAGAIN)
+	 || (saved_errno == EWOULDBLOCK) ) {
+      return true;
+    }
+    if ( first == 0 ) {
+      throw NetworkException( "recvmsg", saved_errno );
+    }
+    return false; /* use what we have; the error will recur on the next read */
+  }
+
+  for ( int i = 0; i < count; i++ ) {
+    Datagram &d = received[ first + i ];
+    struct msghdr &header = headers[ i ].msg_hdr;
+    d.remote_addr_len = header.msg_namelen;
+    d.truncated = header.msg_flags & MSG_TRUNC;
+    d.congestion_experienced = get_congestion_experienced( &header );
+    d.len = headers[ i ].msg_len;
+  }
+  received_count += count;
+
+  return received_count < RECV_BATCH;
+}
+
+std::string Connection::process_datagram( Datagram &datagram )
+{
+  if ( datagram.truncated ) {
+    throw NetworkException( "Received oversize datagram", 0 );
   }
 
-  Packet p( session.decrypt( msg_payload, received_len ) );
+  const bool congestion_experienced = datagram.congestion_experienced;
+
+  char *payload = datagram.payload();
+  const bool compact = ( datagram.len > 0 ) && ( payload[ 0 ] & ( Packet::COMPACT_FLAG >> 56 ) );
+  if ( compact && ( datagram.len < Packet::COMPACT_HEADER_LEN ) ) {
+    throw NetworkException( "Received truncated compact header", 0 );
+  }
+  if ( !compact && ( datagram.len < size_t( Nonce::CC_LEN ) ) ) {
+    throw CryptoException( "Ciphertext must contain nonce and tag." );
+  }
+
+  const Nonce nonce = compact ? Nonce( Packet::compact_nonce( payload, expected_receiver_seq ) )
+                              : Nonce( payload, Nonce::CC_LEN );
+  const size_t nonce_len = compact ? Packet::COMPACT_HEADER_LEN : Nonce::CC_LEN;
+  char *ciphertext = payload + Packet::COMPACT_HEADER_LEN; /* aligned */
+  if ( !compact ) {
+    /* a full nonce leaves the ciphertext off the boundary */
+    memmove( ciphertext, payload + nonce_len, datagram.len - nonce_len );
+  }
+
+  Packet p( session.decrypt( nonce, ciphertext, datagram.len - nonce_len ) );
 
   dos_assert( p.direction == (server ? TO_SERVER : TO_CLIENT) ); /* prevent malicious playback to sender */
+  received_compact = p.compact;
 
   if ( p.seq < expected_receiver_seq ) { /* don't use (but do return) out-of-order packets for timestamp or targeting */
     return p.payload;
   }
+  /* datagrams skipped over count as lost (they may only be late) */
+  const double kept = 1 - 1.0 / 64.0; /* weight of the past per datagram */
+  loss_rate = 1 - (1 - loss_rate) * pow( kept, double( p.seq - expected_receiver_seq ) );
+  loss_rate *= kept;
+
   expected_receiver_seq = p.seq + 1; /* this is security-sensitive because a replay attack could otherwise
 					screw up the timestamp and targeting */
 
@@ -542,6 +964,10 @@ std::string Connection::recv_one( int sock_to_recv )
 	SRTT = R;
 	RTTVAR = R / 2;
 	RTT_hit = true;
+	for ( int i = 0; i < MIN_RTT_SLOTS; i++ ) {
+	  min_RTT_slots[ i ] = -1;
+	}
+	min_RTT_time = timestamp();
       } else {
 	const double alpha = 1.0 / 8.0;
 	const double beta = 1.0 / 4.0;
@@ -549,6 +975,9 @@ std::string Connection::recv_one( int sock_to_recv )
 	RTTVAR = (1 - beta) * RTTVAR + ( beta * fabs( SRTT - R ) );
 	SRTT = (1 - alpha) * SRTT + ( alpha * R );
       }
+
+      last_RTT = R;
+      update_min_RTT( R );
     }
   }
 
@@ -557,23 +986,52 @@ std::string Connection::recv_one( int sock_to_recv )
   last_heard = timestamp();
 
   if ( server && /* only client can roam */
-       ( remote_addr_len != header.msg_namelen ||
-	 memcmp( &remote_addr, &packet_remote_addr, remote_addr_len ) != 0 ) ) {
-    remote_addr = packet_remote_addr;
-    remote_addr_len = header.msg_namelen;
+       ( remote_addr_len != datagram.remote_addr_len ||
+	 memcmp( &remote_addr, &datagram.remote_addr, remote_addr_len ) != 0 ) ) {
+    remote_addr = datagram.remote_addr;
+    remote_addr_len = datagram.remote_addr_len;
     char host[ NI_MAXHOST ], serv[ NI_MAXSERV ];
     int errcode = getnameinfo( &remote_addr.sa, remote_addr_len,
 			       host, sizeof( host ), serv, sizeof( serv ),
 			       NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV );
     if ( errcode != 0 ) {
-      throw NetworkException( std::string( "recv_one: getnameinfo: " ) + gai_strerror( errcode ), 0 );
+      throw NetworkException( std::string( "process_datagram: getnameinfo: " ) + gai_strerror( errcode ), 0 );
     }
     fprintf( stderr, "Server now attached to client at %s:%s\n",
 	     host, serv );
+    restart_mtu_search(); /* over a new path */
   }
   return p.payload;
 }
 
+/* Slide the minimum RTT window up to now and take in sample R */
+void Connection::update_min_RTT( double R )
+{
+  const uint64_t slot_len = MIN_RTT_WINDOW / MIN_RTT_SLOTS;
+  const uint64_t now = timestamp();
+
+  for ( int i = 0; (i < MIN_RTT_SLOTS) && (min_RTT_time + slot_len <= now); i++ ) {
+    min_RTT_slot = (min_RTT_slot + 1) % MIN_RTT_SLOTS;
+    min_RTT_slots[ min_RTT_slot ] = -1;
+    min_RTT_time += slot_len;
+  }
+  if ( min_RTT_time + slot_len <= now ) { /* silent for the whole window */
+    min_RTT_time = now;
+  }
+
+  double &slot = min_RTT_slots[ min_RTT_slot ];
+  if ( (slot < 0) || (R < slot) ) {
+    slot = R;
+  }
+
+  min_RTT = R;
+  for ( int i = 0; i < MIN_RTT_SLOTS; i++ ) {
+    if ( (min_RTT_slots[ i ] >= 0) && (min_RTT_slots[ i ] < min_RTT) ) {
+      min_RTT = min_RTT_slots[ i ];
+    }
+  }
+}
+
 std::string Connection::port( void ) const
 {
   Addr local_addr;
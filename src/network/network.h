@@ -43,6 +43,7 @@
 #include <vector>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include "src/crypto/crypto.h"
@@ -75,21 +76,46 @@ namespace Network {
     TO_CLIENT = 1
   };
 
+  /*
+   * A compact packet, for peers that accept one, carries only the top
+   * byte of its nonce (the direction and the flags below) and the low
+   * COMPACT_SEQ_LEN bytes of the sequence number; the receiver fills
+   * in the rest from the sequence it expects.  Its timestamp reply is
+   * left out when there is none.  The flags are part of the nonce, so
+   * the integrity check covers them.
+   */
   class Packet {
   public:
+    static const uint64_t COMPACT_FLAG = uint64_t( 1 ) << 62;
+    static const uint64_t REPLY_FLAG = uint64_t( 1 ) << 61; /* compact, with timestamp reply */
+    static const size_t COMPACT_SEQ_LEN = 4;
+    static const size_t COMPACT_HEADER_LEN = 1 + COMPACT_SEQ_LEN;
+
     const uint64_t seq;
     Direction direction;
     uint16_t timestamp, timestamp_reply;
     std::string payload;
+    bool compact;
     
     Packet( Direction s_direction,
-	    uint16_t s_timestamp, uint16_t s_timestamp_reply, const std::string & s_payload )
+	    uint16_t s_timestamp, uint16_t s_timestamp_reply, const std::string & s_payload,
+	    bool s_compact = false )
       : seq( Crypto::unique() ), direction( s_direction ),
-	timestamp( s_timestamp ), timestamp_reply( s_timestamp_reply ), payload( s_payload )
+	timestamp( s_timestamp ), timestamp_reply( s_timestamp_reply ), payload( s_payload ),
+	compact( s_compact )
     {}
     
-    Packet( const Message & message );
+    Packet( const MessageView & message );
     
+    /* A compact packet's header: the nonce's top byte, then the low
+       COMPACT_SEQ_LEN bytes of its sequence number.  The receiver
+       takes the sequence number nearest the one it expects. */
+    static void write_compact_header( char *header, const Nonce &nonce );
+    static uint64_t compact_nonce( const char *header, uint64_t expected_seq );
+
+    uint64_t direction_seq( void ) const;
+    /* bytes of timestamps ahead of the payload */
+    size_t timestamps_len( void ) const;
     Message toMessage( void );
   };
 
@@ -125,12 +151,28 @@ namespace Network {
      * dropped if tunnelled packets are 1320 bytes or larger.  Use a
      * 1280-byte IPv4 MTU for now.
      *
-     * We may have to implement ICMP-less PMTUD (RFC 4821) eventually.
+     * Larger sizes are only used once probed (RFC 4821), below.
      */
     static const int DEFAULT_IPV4_MTU = 1280;
     /* IPv6 MTU. Use the guaranteed minimum to avoid fragmentation. */
     static const int DEFAULT_IPV6_MTU = 1280;
 
+    /*
+     * Packetization-layer path MTU discovery (RFC 4821): datagrams
+     * with the don't-fragment bit set probe for sizes up to an
+     * Ethernet MTU; the receiver's acknowledgement raises the MTU.
+     * (Jumbo frames would exceed Session::RECEIVE_MTU at old peers.)
+     */
+    static const int MAX_PROBED_MTU = 1500;
+    static const int MTU_SEARCH_STEP = 16; /* stop when this close */
+    static const int MTU_PROBE_TRIES = 3; /* losses before a size fails */
+    static const uint64_t MTU_PROBE_GRACE = 200; /* ms beyond RTO to await the ack */
+    static const uint64_t MTU_REPROBE_INTERVAL = 600000; /* ms */
+    /* ms without round trip before the MTU falls back to the base.  An
+       idle session round-trips only on an empty ack every 3 s, so this
+       must outlast a few lost keepalives. */
+    static const uint64_t MTU_BLACK_HOLE_TIMEOUT = 15000;
+
     static const uint64_t MIN_RTO = 50; /* ms */
     static const uint64_t MAX_RTO = 1000; /* ms */
 
@@ -139,12 +181,16 @@ namespace Network {
 
     static const unsigned int SERVER_ASSOCIATION_TIMEOUT = 40000;
     static const unsigned int PORT_HOP_INTERVAL          = 10000;
+    static_assert( MTU_BLACK_HOLE_TIMEOUT > PORT_HOP_INTERVAL, "a lost keepalive must not restart the MTU search" );
 
     static const unsigned int MAX_PORTS_OPEN             = 10;
     static const unsigned int MAX_OLD_SOCKET_AGE         = 60000;
 
     static const int CONGESTION_TIMESTAMP_PENALTY = 500; /* ms */
 
+    static const uint64_t MIN_RTT_WINDOW = 10000; /* ms a minimum RTT sample stands for */
+    static const int MIN_RTT_SLOTS = 5; /* sub-windows of it */
+
     bool try_bind( const char *addr, int port_low, int port_high );
 
     class Socket
@@ -169,6 +215,20 @@ namespace Network {
     bool server;
 
     int MTU; /* application datagram MTU */
+    int base_MTU; /* without probing */
+    int max_MTU;
+
+    /* path MTU search: MTU works, mtu_search_high is the largest size
+       not found to fail */
+    int mtu_search_high;
+    int mtu_probe_size; /* of the probe awaiting its ack, or 0 */
+    uint32_t mtu_probe_id;
+    int mtu_probe_losses;
+    uint64_t mtu_probe_time;
+    bool sending_mtu_probe;
+
+    void restart_mtu_search( void );
+    bool set_dont_fragment( bool df );
 
     Base64Key key;
     Session session;
@@ -188,10 +248,52 @@ namespace Network {
     double SRTT;
     double RTTVAR;
 
+    /* Lowest RTT of the last MIN_RTT_WINDOW, taken as the path's delay
+       with empty queues, and the last sample.  The window slides by
+       sub-windows, each keeping its own minimum (-1 when it had no
+       samples); min_RTT_time is when the current one began. */
+    double min_RTT;
+    double min_RTT_slots[ MIN_RTT_SLOTS ];
+    int min_RTT_slot;
+    uint64_t min_RTT_time;
+    double last_RTT;
+
+    void update_min_RTT( double R );
+
+    /* Moving average of the fraction of incoming datagrams missing
+       from the sequence */
+    double loss_rate;
+
     /* Error from send()/sendto(). */
     std::string send_error;
 
-    Packet new_packet( const std::string &s_payload );
+    /* Datagrams are encrypted and decrypted in place, with the
+       ciphertext this far into a 16-byte-aligned buffer, after the
+       wire nonce. */
+    static const size_t CIPHERTEXT_OFFSET = 16;
+
+    /* Datagrams read together from the sockets, handed out one at a
+       time by recv(). */
+    struct Datagram {
+      Addr remote_addr;
+      socklen_t remote_addr_len;
+      bool truncated;
+      bool congestion_experienced;
+      size_t len;
+      alignas( 16 ) char buffer[ CIPHERTEXT_OFFSET + Session::RECEIVE_MTU ];
+      /* received where a compact packet's ciphertext lands aligned */
+      char *payload( void ) { return buffer + CIPHERTEXT_OFFSET - Packet::COMPACT_HEADER_LEN; }
+    };
+    std::vector< Datagram > received;
+    size_t received_count, received_next;
+    bool received_compact; /* the last datagram recv() returned */
+
+    /* Datagrams sealed for one batched send, one per slot */
+    static const size_t SEND_SLOT_LEN = CIPHERTEXT_OFFSET + Session::RECEIVE_MTU;
+    AlignedBuffer send_buffer;
+    bool gso_usable; /* until the kernel refuses UDP_SEGMENT */
+
+    uint16_t new_timestamp_reply( void );
 
     void hop_port( void );
 
@@ -199,28 +301,67 @@ namespace Network {
 
     void prune_sockets( void );
 
-    std::string recv_one( int sock_to_recv );
+    bool recv_batch( int sock_to_recv );
+    void transmit( struct iovec *datagrams, size_t count );
+    void note_send_error( int err );
+    std::string process_datagram( Datagram &datagram );
 
     void set_MTU( int family );
 
   public:
-    /* Network transport overhead. */
+    /* Network transport overhead, at most (compact packets have less). */
     static const int ADDED_BYTES = 8 /* seqno/nonce */ + 4 /* timestamps */;
 
+    /* Most datagrams recv() reads from the sockets at once */
+    static const size_t RECV_BATCH = 16;
+
     Connection( const char *desired_ip, const char *desired_port ); /* server */
     Connection( const char *key_str, const char *ip, const char *port ); /* client */
 
-    void send( const std::string & s );
+    /* A header followed by a payload, sent as one datagram, with the
+       compact packet header if so */
+    struct OutgoingDatagram {
+      const char *header;
+      size_t header_len;
+      const std::string *payload;
+      bool compact;
+    };
+    static const size_t SEND_BATCH = 16;
+
+    void send( const std::string & s ) { send( NULL, 0, s ); }
+    /* Send header followed by s as one datagram, without building the
+       concatenation. */
+    void send( const char *header, size_t header_len, const std::string & s, bool compact = false );
+    /* Send several datagrams with as few system calls as the kernel
+       allows: one UDP_SEGMENT (GSO) send when all but the last are
+       the same size, else sendmmsg(). */
+    void send( const OutgoingDatagram *datagrams, size_t count );
+    /* Returns the next datagram's payload, reading a batch of up to
+       RECV_BATCH from all sockets when none are pending. */
     std::string recv( void );
+    /* Whether that datagram had the compact header */
+    bool recv_compact( void ) const { return received_compact; }
+    bool has_pending( void ) const { return received_next < received_count; }
     const std::vector< int > fds( void ) const;
     int get_MTU( void ) const { return MTU; }
 
+    /* Whether to probe the path MTU now, and if so the size (whole
+       UDP payload) and the number to put in the probe */
+    bool mtu_probe_due( int &size, uint32_t &probe_id );
+    /* Send a probe with the don't-fragment bit */
+    void send_mtu_probe( const char *header, size_t header_len, const std::string & s, bool compact );
+    void mtu_probe_acked( uint32_t probe_id );
+
     std::string port( void ) const;
     std::string get_key( void ) const { return key.printable_key(); }
     bool get_has_remote_addr( void ) const { return has_remote_addr; }
 
     uint64_t timeout( void ) const;
     double get_SRTT( void ) const { return SRTT; }
+    /* ms the last round trip spent waiting in queues */
+    double get_queue_delay( void ) const { return RTT_hit ? last_RTT - min_RTT : 0; }
+    /* Loss seen on the incoming path, as an estimate for both ways */
+    double get_loss_rate( void ) const { return loss_rate; }
 
     const Addr &get_remote_addr( void ) const { return remote_addr; }
     socklen_t get_remote_addr_len( void ) const { return remote_addr_len; }
@@ -33,6 +33,8 @@
 #ifndef NETWORK_TRANSPORT_IMPL_HPP
 #define NETWORK_TRANSPORT_IMPL_HPP
 
+#include <exception>
+
 #include "src/network/networktransport.h"
 
 #include "transportsender-impl.h"
@@ -51,6 +53,7 @@ Transport<MyState, RemoteState>::Transport( MyState &initial_state, RemoteState
     verbose( 0 )
 {
   /* server */
+  sender.set_diff_formats_accepted( RemoteState::DIFF_FORMATS );
 }
 
 template <class MyState, class RemoteState>
@@ -65,13 +68,44 @@ Transport<MyState, RemoteState>::Transport( MyState &initial_state, RemoteState
     verbose( 0 )
 {
   /* client */
+  sender.set_diff_formats_accepted( RemoteState::DIFF_FORMATS );
 }
 
 template <class MyState, class RemoteState>
 void Transport<MyState, RemoteState>::recv( void )
 {
-  std::string s( connection.recv() );
-  Fragment frag( s );
+  /* Take every datagram the connection read in this batch, so a burst
+     costs one wakeup.  A bad datagram is reported after the rest of
+     the batch has been used; a fatal crypto failure (or anything but
+     a network or crypto error) ends the batch at once. */
+  std::exception_ptr first_error;
+  do {
+    try {
+      const std::string s = connection.recv();
+      recv_fragment( s, connection.recv_compact() );
+    } catch ( const NetworkException & ) {
+      if ( !first_error ) {
+	first_error = std::current_exception();
+      }
+    } catch ( const Crypto::CryptoException &e ) {
+      if ( e.fatal ) {
+	throw;
+      }
+      if ( !first_error ) {
+	first_error = std::current_exception();
+      }
+    }
+  } while ( connection.has_pending() );
+
+  if ( first_error ) {
+    std::rethrow_exception( first_error );
+  }
+}
+
+template <class MyState, class RemoteState>
+void Transport<MyState, RemoteState>::recv_fragment( const std::string &s, bool compact )
+{
+  Fragment frag( s, compact );
 
   if ( fragments.add_fragment( frag ) ) { /* complete packet */
     Instruction inst = fragments.get_assembly();
@@ -82,6 +116,15 @@ void Transport<MyState, RemoteState>::recv( void )
 
     sender.process_acknowledgment_through( inst.ack_num() );
 
+    /* path MTU probes carry nothing else, so answer them at once */
+    if ( inst.has_mtu_probe_ack() ) {
+      connection.mtu_probe_acked( inst.mtu_probe_ack() );
+    }
+    if ( inst.has_mtu_probe() ) {
+      sender.set_mtu_probe_received( inst.mtu_probe() );
+      sender.set_data_ack();
+    }
+
     /* inform network layer of roundtrip (end-to-end-to-end) connectivity */
     connection.set_last_roundtrip_success( sender.get_sent_state_acked_timestamp() );
 
@@ -131,12 +174,22 @@ void Transport<MyState, RemoteState>::recv( void )
     }
 
     /* apply diff to reference state */
-    TimestampedState<RemoteState> new_state = *reference_state;
-    new_state.timestamp = timestamp();
-    new_state.num = inst.new_num();
+    TimestampedState<RemoteState> new_state( timestamp(), inst.new_num(), reference_state->state );
 
     if ( !inst.diff().empty() ) {
-      new_state.state.apply_string( inst.diff() );
+      std::string diff;
+      if ( !decode_diff( inst, *reference_state, diff ) ) {
+	return;
+      }
+      if ( !new_state.state.apply_string( diff ) ) {
+	/* drop it, and ask for diffs in the plainest format */
+	if ( verbose ) {
+	  fprintf( stderr, "[%u] Malformed diff to state %d, refusing diff formats\n",
+		   (unsigned int)(timestamp() % 100000), (int)inst.new_num() );
+	}
+	sender.set_diff_formats_accepted( 0 );
+	return;
+      }
     }
 
     /* Insert new state in sorted place */
@@ -158,6 +211,10 @@ void Transport<MyState, RemoteState>::recv( void )
     }
     received_states.push_back( new_state );
     sender.set_ack_num( received_states.back().num );
+    sender.set_peer_diff_encodings( inst.diff_encodings_accepted() );
+    sender.set_peer_accepts_parity( inst.fragment_parity_accepted() );
+    sender.set_peer_accepts_compact( inst.compact_header_accepted() );
+    sender.set_peer_diff_formats( inst.diff_formats_accepted() );
 
     sender.remote_heard( new_state.timestamp );
     if ( !inst.diff().empty() ) {
@@ -166,6 +223,32 @@ void Transport<MyState, RemoteState>::recv( void )
   }
 }
 
+/* Undo the sender's compression of the diff.  If our copy of the base
+   state gives another dictionary than the sender's, the instruction is
+   dropped and we ask for the encoding no more. */
+template <class MyState, class RemoteState>
+bool Transport<MyState, RemoteState>::decode_diff( const Instruction &inst, TimestampedState<RemoteState> &base, std::string &diff )
+{
+  switch ( inst.diff_encoding() ) {
+  case DIFF_RAW:
+    diff = inst.diff();
+    return true;
+  case DIFF_DEFLATE:
+  case DIFF_DEFLATE_STATE:
+    if ( get_compressor().uncompress_str( inst.diff(), diff_dictionary( inst.diff_encoding(), inst.dictionary_formats(), base ), diff ) ) {
+      return true;
+    }
+    if ( verbose ) {
+      fprintf( stderr, "[%u] Dictionary mismatch in diff to state %d, refusing encoding %d\n",
+	       (unsigned int)(timestamp() % 100000), (int)inst.new_num(), (int)inst.diff_encoding() );
+    }
+    sender.refuse_diff_encoding( inst.diff_encoding() );
+    return false;
+  default:
+    throw NetworkException( "unknown diff encoding", 0 );
+  }
+}
+
 /* The sender uses throwaway_num to tell us the earliest received state that we need to keep around */
 template <class MyState, class RemoteState>
 void Transport<MyState, RemoteState>::process_throwaway_until( uint64_t throwaway_num )
@@ -55,7 +55,9 @@ namespace Network {
     TransportSender<MyState> sender;
 
     /* helper methods for recv() */
+    void recv_fragment( const std::string &s, bool compact );
     void process_throwaway_until( uint64_t throwaway_num );
+    bool decode_diff( const Instruction &inst, TimestampedState<RemoteState> &base, std::string &diff );
 
     /* simple receiver */
     std::list< TimestampedState<RemoteState> > received_states;
@@ -76,7 +78,7 @@ namespace Network {
     /* Returns the number of ms to wait until next possible event. */
     int wait_time( void ) { return sender.wait_time(); }
 
-    /* Blocks waiting for a packet. */
+    /* Processes the datagrams that have arrived, in one batch. */
     void recv( void );
 
     /* Find diff between last receiver state and current remote state, then rationalize states. */
@@ -31,51 +31,111 @@
 */
 
 #include <cassert>
+#include <cstring>
 
 #include "src/crypto/byteorder.h"
 #include "transportfragment.h"
 #include "src/protobufs/transportinstruction.pb.h"
 #include "compressor.h"
 #include "src/util/fatal_assert.h"
+#include "src/network/network.h"
 
 using namespace Network;
 using namespace TransportBuffers;
 
-static std::string network_order_string( uint16_t host_order )
+static size_t put_varint( char *buf, uint64_t val )
 {
-  uint16_t net_int = htobe16( host_order );
-  return std::string( (char *)&net_int, sizeof( net_int ) );
+  size_t len = 0;
+  while ( val >= 0x80 ) {
+    buf[ len++ ] = static_cast<char>( val | 0x80 );
+    val >>= 7;
+  }
+  buf[ len++ ] = static_cast<char>( val );
+  return len;
 }
 
-static std::string network_order_string( uint64_t host_order )
+static uint64_t get_varint( const std::string &in, size_t &pos )
 {
-  uint64_t net_int = htobe64( host_order );
-  return std::string( (char *)&net_int, sizeof( net_int ) );
+  uint64_t val = 0;
+  for ( int shift = 0; ; shift += 7 ) {
+    fatal_assert( pos < in.size() && shift < 64 );
+    const uint8_t byte = in[ pos++ ];
+    val |= uint64_t( byte & 0x7f ) << shift;
+    if ( !(byte & 0x80) ) {
+      return val;
+    }
+  }
 }
 
-std::string Fragment::tostring( void )
+static size_t varint_len( uint64_t val )
 {
-  assert( initialized );
+  size_t len = 1;
+  while ( val >= 0x80 ) {
+    val >>= 7;
+    len++;
+  }
+  return len;
+}
+
+size_t Fragment::compact_header_len( uint64_t id, uint16_t fragment_num )
+{
+  return varint_len( id ) + varint_len( uint32_t( fragment_num ) << 1 | 1 );
+}
+
+size_t Fragment::header_len( void ) const
+{
+  return compact ? compact_header_len( id, fragment_num ) : frag_header_len;
+}
 
-  std::string ret;
-  
-  ret += network_order_string( id );
+size_t Fragment::write_header( char *buf ) const
+{
+  assert( initialized );
 
   fatal_assert( !( fragment_num & 0x8000 ) ); /* effective limit on size of a terminal screen change or buffered user input */
+
+  if ( compact ) {
+    size_t len = put_varint( buf, id );
+    len += put_varint( buf + len, ( uint32_t( fragment_num ) << 1 ) | final );
+    return len;
+  }
+
+  uint64_t id_net = htobe64( id );
+  memcpy( buf, &id_net, sizeof( id_net ) );
+
   uint16_t combined_fragment_num = ( final << 15 ) | fragment_num;
-  ret += network_order_string( combined_fragment_num );
+  uint16_t combined_net = htobe16( combined_fragment_num );
+  memcpy( buf + sizeof( id_net ), &combined_net, sizeof( combined_net ) );
+
+  static_assert( sizeof( id_net ) + sizeof( combined_net ) == frag_header_len, "fragment header layout" );
+  return frag_header_len;
+}
 
-  assert( ret.size() == frag_header_len );
+std::string Fragment::tostring( void )
+{
+  char header[ compact_header_max ]; /* the longer */
+  const size_t len = write_header( header );
 
+  std::string ret( header, len );
   ret += contents;
 
   return ret;
 }
 
-Fragment::Fragment( const std::string &x )
+Fragment::Fragment( const std::string &x, bool s_compact )
   : id( -1 ), fragment_num( -1 ), final( false ), initialized( true ),
-    contents()
+    contents(), compact( s_compact )
 {
+  if ( compact ) {
+    size_t pos = 0;
+    id = get_varint( x, pos );
+    const uint64_t combined = get_varint( x, pos );
+    fatal_assert( combined <= 0xFFFF );
+    final = combined & 1;
+    fragment_num = combined >> 1;
+    contents = std::string( x.begin() + pos, x.end() );
+    return;
+  }
+
   fatal_assert( x.size() >= frag_header_len );
   contents = std::string( x.begin() + frag_header_len, x.end() );
 
@@ -88,29 +148,121 @@ Fragment::Fragment( const std::string &x )
   fragment_num &= 0x7FFF;
 }
 
+void Network::compact_instruction( Instruction &inst )
+{
+  if ( inst.protocol_version() == MOSH_PROTOCOL_VERSION ) {
+    inst.clear_protocol_version();
+  }
+
+  const uint64_t new_distance = inst.new_num() - inst.old_num();
+  const uint64_t throwaway_distance = inst.old_num() - inst.throwaway_num();
+  inst.clear_new_num();
+  inst.clear_throwaway_num();
+  if ( new_distance ) {
+    inst.set_new_num( new_distance );
+  }
+  if ( throwaway_distance ) {
+    inst.set_throwaway_num( throwaway_distance );
+  }
+}
+
+void Network::expand_instruction( Instruction &inst )
+{
+  if ( !inst.has_protocol_version() ) {
+    inst.set_protocol_version( MOSH_PROTOCOL_VERSION );
+  }
+
+  inst.set_new_num( inst.old_num() + inst.new_num() );
+  inst.set_throwaway_num( inst.old_num() - inst.throwaway_num() );
+}
+
 bool FragmentAssembly::add_fragment( Fragment &frag )
 {
-  /* see if this is a totally new packet */
-  if ( current_id != frag.id ) {
-    fragments.clear();
-    fragments.resize( frag.fragment_num + 1 );
-    fragments.at( frag.fragment_num ) = frag;
-    fragments_arrived = 1;
-    fragments_total = -1; /* unknown */
-    current_id = frag.id;
- } else { /* not a new packet */
-    /* see if we already have this fragment */
-    if ( (fragments.size() > frag.fragment_num)
-	 && (fragments.at( frag.fragment_num ).initialized) ) {
-      /* make sure new version is same as what we already have */
-      assert( fragments.at( frag.fragment_num ) == frag );
+  const uint64_t now = timestamp();
+  expire( now );
+
+  assemblies_type::iterator i = assemblies.find( frag.id );
+  if ( i == assemblies.end() ) { /* a totally new packet */
+    i = assemblies.insert( std::make_pair( frag.id, Assembly( frag.id ) ) ).first;
+  }
+
+  i->second.last_arrival = now;
+  if ( i->second.add_fragment( frag ) ) {
+    completed_id = frag.id;
+    return true;
+  }
+
+  /* keep the window bounded */
+  size_t bytes = 0;
+  for ( i = assemblies.begin(); i != assemblies.end(); i++ ) {
+    bytes += i->second.bytes;
+  }
+  while ( (assemblies.size() > MAX_ASSEMBLIES) || (bytes > MAX_ASSEMBLY_BYTES) ) {
+    bytes -= assemblies.begin()->second.bytes;
+    assemblies.erase( assemblies.begin() );
+  }
+
+  return false;
+}
+
+/* Forget instructions no fragment has arrived for in a while */
+void FragmentAssembly::expire( uint64_t now )
+{
+  for ( assemblies_type::iterator i = assemblies.begin(); i != assemblies.end(); ) {
+    if ( i->second.last_arrival + ASSEMBLY_TIMEOUT < now ) {
+      assemblies.erase( i++ );
     } else {
-      if ( (int)fragments.size() < frag.fragment_num + 1 ) {
-	fragments.resize( frag.fragment_num + 1 );
-      }
-      fragments.at( frag.fragment_num ) = frag;
-      fragments_arrived++;
+      i++;
+    }
+  }
+}
+
+Instruction FragmentAssembly::get_assembly( void )
+{
+  assemblies_type::iterator i = assemblies.find( completed_id );
+  assert( i != assemblies.end() );
+  const Assembly &assembly = i->second;
+  assert( assembly.fragments_arrived == assembly.fragments_total );
+
+  std::string encoded;
+
+  for ( int j = 0; j < assembly.fragments_total; j++ ) {
+    assert( assembly.fragments.at( j ).initialized );
+    encoded += assembly.fragments.at( j ).contents;
+  }
+
+  const bool compact = assembly.fragments.front().compact;
+  assemblies.erase( i );
+
+  Instruction ret;
+  if ( compact ) {
+    if ( !encoded.empty() && (encoded[ 0 ] == '\0') ) {
+      encoded = get_compressor().uncompress_str( encoded.substr( 1 ) );
+    }
+    fatal_assert( ret.ParseFromString( encoded ) );
+    expand_instruction( ret );
+  } else {
+    fatal_assert( ret.ParseFromString( get_compressor().uncompress_str( encoded ) ) );
+  }
+
+  return ret;
+}
+
+bool FragmentAssembly::Assembly::add_fragment( Fragment &frag )
+{
+  if ( frag.fragment_num == Fragment::parity_fragment_num ) {
+    add_parity( frag );
+  } else if ( (fragments.size() > frag.fragment_num)
+	      && (fragments.at( frag.fragment_num ).initialized) ) {
+    /* make sure new version is same as what we already have */
+    assert( fragments.at( frag.fragment_num ) == frag );
+  } else {
+    if ( (int)fragments.size() < frag.fragment_num + 1 ) {
+      fragments.resize( frag.fragment_num + 1 );
     }
+    fragments.at( frag.fragment_num ) = frag;
+    fragments_arrived++;
+    bytes += frag.contents.size();
   }
 
   if ( frag.final ) {
@@ -123,59 +275,125 @@ bool FragmentAssembly::add_fragment( Fragment &frag )
     assert( fragments_arrived <= fragments_total );
   }
 
+  /* one fragment short can be made up from parity */
+  if ( parity.initialized && (fragments_arrived == fragments_total - 1) ) {
+    recover_missing();
+  }
+
   /* see if we're done */
   return fragments_arrived == fragments_total;
 }
 
-Instruction FragmentAssembly::get_assembly( void )
+void FragmentAssembly::Assembly::add_parity( const Fragment &frag )
 {
-  assert( fragments_arrived == fragments_total );
+  fatal_assert( frag.contents.size() >= Fragment::parity_header_len );
+
+  uint16_t header[ 2 ];
+  memcpy( header, frag.contents.data(), sizeof( header ) );
+  const int total = be16toh( header[ 0 ] );
+  const size_t final_len = be16toh( header[ 1 ] );
+
+  fatal_assert( (total > 1) && (total < Fragment::parity_fragment_num) );
+  fatal_assert( final_len <= frag.contents.size() - Fragment::parity_header_len );
+  fatal_assert( (fragments_total == -1) || (fragments_total == total) );
+  fatal_assert( (int)fragments.size() <= total );
+
+  fragments_total = total;
+  fragments.resize( fragments_total );
+  if ( !parity.initialized ) {
+    bytes += frag.contents.size();
+  }
+  parity = frag;
+}
 
-  std::string encoded;
+void FragmentAssembly::Assembly::recover_missing( void )
+{
+  std::string contents( parity.contents, Fragment::parity_header_len );
+  int missing = -1;
 
   for ( int i = 0; i < fragments_total; i++ ) {
-    assert( fragments.at( i ).initialized );
-    encoded += fragments.at( i ).contents;
+    if ( !fragments.at( i ).initialized ) {
+      missing = i;
+      continue;
+    }
+    const std::string &x = fragments.at( i ).contents;
+    fatal_assert( x.size() <= contents.size() );
+    for ( size_t j = 0; j < x.size(); j++ ) {
+      contents[ j ] ^= x[ j ];
+    }
   }
+  assert( missing != -1 );
 
-  Instruction ret;
-  fatal_assert( ret.ParseFromString( get_compressor().uncompress_str( encoded ) ) );
-
-  fragments.clear();
-  fragments_arrived = 0;
-  fragments_total = -1;
+  const bool final = ( missing == fragments_total - 1 );
+  if ( final ) {
+    uint16_t final_len;
+    memcpy( &final_len, parity.contents.data() + sizeof( uint16_t ), sizeof( final_len ) );
+    contents.resize( be16toh( final_len ) );
+  }
 
-  return ret;
+  fragments.at( missing ) = Fragment( id, missing, final, contents, parity.compact );
+  fragments_arrived++;
 }
 
 bool Fragment::operator==( const Fragment &x ) const
 {
   return ( id == x.id ) && ( fragment_num == x.fragment_num ) && ( final == x.final )
-    && ( initialized == x.initialized ) && ( contents == x.contents );
+    && ( initialized == x.initialized ) && ( contents == x.contents ) && ( compact == x.compact );
 }
 
-std::vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, size_t MTU )
+std::vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, size_t MTU, bool with_parity, bool compact )
 {
-  MTU -= Fragment::frag_header_len;
-  if ( (inst.old_num() != last_instruction.old_num())
+  if ( with_parity ) {
+    MTU -= Fragment::parity_header_len; /* so the parity fragment fits too */
+  }
+  if ( (compact != last_compact) /* the receiver must not mix forms */
+       || (inst.old_num() != last_instruction.old_num())
        || (inst.new_num() != last_instruction.new_num())
        || (inst.ack_num() != last_instruction.ack_num())
        || (inst.throwaway_num() != last_instruction.throwaway_num())
        || (inst.chaff() != last_instruction.chaff())
        || (inst.protocol_version() != last_instruction.protocol_version())
+       || (inst.diff_encoding() != last_instruction.diff_encoding())
+       || (inst.diff_encodings_accepted() != last_instruction.diff_encodings_accepted())
+       || (inst.fragment_parity_accepted() != last_instruction.fragment_parity_accepted())
+       || (inst.mtu_probe() != last_instruction.mtu_probe())
+       || (inst.mtu_probe_ack() != last_instruction.mtu_probe_ack())
+       || (inst.diff_formats_accepted() != last_instruction.diff_formats_accepted())
+       || (inst.compact_header_accepted() != last_instruction.compact_header_accepted())
+       || (inst.dictionary_formats() != last_instruction.dictionary_formats())
        || (last_MTU != MTU) ) {
     next_instruction_id++;
   }
 
   if ( (inst.old_num() == last_instruction.old_num())
-       && (inst.new_num() == last_instruction.new_num()) ) {
+       && (inst.new_num() == last_instruction.new_num())
+       && (inst.diff_encoding() == last_instruction.diff_encoding())
+       && (inst.dictionary_formats() == last_instruction.dictionary_formats()) ) {
     assert( inst.diff() == last_instruction.diff() );
   }
 
   last_instruction = inst;
   last_MTU = MTU;
-
-  std::string payload = get_compressor().compress_str( inst.SerializeAsString() );
+  last_compact = compact;
+
+  MTU -= compact ? Fragment::compact_header_len( next_instruction_id, Fragment::parity_fragment_num )
+    : Fragment::frag_header_len;
+
+  std::string payload;
+  if ( compact ) {
+    Instruction compact_inst( inst );
+    compact_instruction( compact_inst );
+    payload = compact_inst.SerializeAsString();
+    /* an encoded diff is deflated already, and small ones do not shrink */
+    if ( (inst.diff_encoding() == DIFF_RAW) && (payload.size() >= Fragment::compact_deflate_min) ) {
+      std::string deflated = get_compressor().compress_str( payload );
+      if ( deflated.size() + 1 < payload.size() ) {
+	payload = std::string( 1, '\0' ) + deflated;
+      }
+    }
+  } else {
+    payload = get_compressor().compress_str( inst.SerializeAsString() );
+  }
   uint16_t fragment_num = 0;
   std::vector<Fragment> ret;
 
@@ -192,7 +410,22 @@ std::vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, size_
       final = true;
     }
 
-    ret.push_back( Fragment( next_instruction_id, fragment_num++, final, this_fragment ) );
+    ret.push_back( Fragment( next_instruction_id, fragment_num++, final, this_fragment, compact ) );
+  }
+
+  if ( with_parity && (ret.size() > 1) ) {
+    fatal_assert( ret.size() < Fragment::parity_fragment_num );
+
+    std::string parity( ret.front().contents.size(), 0 );
+    for ( std::vector<Fragment>::const_iterator i = ret.begin(); i != ret.end(); i++ ) {
+      for ( size_t j = 0; j < i->contents.size(); j++ ) {
+	parity[ j ] ^= i->contents[ j ];
+      }
+    }
+
+    uint16_t header[ 2 ] = { htobe16( uint16_t( ret.size() ) ), htobe16( uint16_t( ret.back().contents.size() ) ) };
+    parity.insert( 0, reinterpret_cast<char *>( header ), sizeof( header ) );
+    ret.push_back( Fragment( next_instruction_id, Fragment::parity_fragment_num, false, parity, compact ) );
   }
 
   return ret;
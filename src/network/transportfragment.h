@@ -34,6 +34,7 @@
 #define TRANSPORT_FRAGMENT_HPP
 
 #include <cstdint>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -42,11 +43,33 @@
 namespace Network {
   using namespace TransportBuffers;
 
+  /* encodings of Instruction.diff, and bits of diff_encodings_accepted */
+  const unsigned int DIFF_RAW = 0;
+  const unsigned int DIFF_DEFLATE = 1; /* built-in dictionary */
+  const unsigned int DIFF_DEFLATE_STATE = 2; /* also the base state's dictionary */
+
   class Fragment
   {
   public:
     static const size_t frag_header_len = sizeof( uint64_t ) + sizeof( uint16_t );
 
+    /* A parity fragment is the XOR of the other fragments of its
+       instruction, after a header giving their number and the length
+       of the final one.  It restores any one that goes missing. */
+    static const uint16_t parity_fragment_num = 0x7FFF;
+    static const size_t parity_header_len = 2 * sizeof( uint16_t );
+
+    /* A compact fragment, sent in a compact packet, has a header of
+       varints instead (the id, then the number shifted left past the
+       final bit), and holds its instruction in compact form: the
+       protocol version implied, and new_num and throwaway_num given
+       as distances from old_num.  It is deflated only when it carries
+       a raw diff of some size, and is then marked by a leading zero
+       byte, which no serialized instruction begins with. */
+    static const size_t compact_header_max = 10 + 3;
+    static const size_t compact_deflate_min = 128; /* bytes of instruction */
+    static size_t compact_header_len( uint64_t id, uint16_t fragment_num );
+
     uint64_t id;
     uint16_t fragment_num;
     bool final;
@@ -55,32 +78,75 @@ namespace Network {
 
     std::string contents;
 
+    bool compact;
+
     Fragment()
-      : id( -1 ), fragment_num( -1 ), final( false ), initialized( false ), contents()
+      : id( -1 ), fragment_num( -1 ), final( false ), initialized( false ), contents(),
+	compact( false )
     {}
 
-    Fragment( uint64_t s_id, uint16_t s_fragment_num, bool s_final, const std::string & s_contents )
+    Fragment( uint64_t s_id, uint16_t s_fragment_num, bool s_final, const std::string & s_contents,
+	      bool s_compact )
       : id( s_id ), fragment_num( s_fragment_num ), final( s_final ), initialized( true ),
-	contents( s_contents )
+	contents( s_contents ), compact( s_compact )
     {}
 
-    Fragment( const std::string &x );
+    Fragment( const std::string &x, bool s_compact );
 
     std::string tostring( void );
+    /* the header that precedes contents on the wire, at most
+       frag_header_len or compact_header_max bytes; returns its length */
+    size_t write_header( char *buf ) const;
+    size_t header_len( void ) const;
 
     bool operator==( const Fragment &x ) const;
   };
 
+  /* An instruction as a compact fragment carries it, and back */
+  void compact_instruction( Instruction &inst );
+  void expand_instruction( Instruction &inst );
+
   class FragmentAssembly
   {
   private:
-    std::vector<Fragment> fragments;
-    uint64_t current_id;
-    int fragments_arrived, fragments_total;
+    /* the fragments of one instruction received so far */
+    class Assembly
+    {
+    private:
+      void add_parity( const Fragment &frag );
+      void recover_missing( void );
+
+    public:
+      uint64_t id;
+      std::vector<Fragment> fragments;
+      Fragment parity;
+      int fragments_arrived, fragments_total;
+      size_t bytes;
+      uint64_t last_arrival;
+
+      Assembly( uint64_t s_id )
+	: id( s_id ), fragments(), parity(), fragments_arrived( 0 ), fragments_total( -1 ),
+	  bytes( 0 ), last_arrival( 0 )
+      {}
+      bool add_fragment( Fragment &frag );
+    };
+
+    /* Several instructions can be in progress at once, so reordering
+       between them loses neither.  The oldest are given up first. */
+    static const size_t MAX_ASSEMBLIES = 8;
+    static const size_t MAX_ASSEMBLY_BYTES = 2048 * 2048; /* as Compressor's buffer */
+    static const uint64_t ASSEMBLY_TIMEOUT = 2000; /* ms since last fragment */
+
+    typedef std::map<uint64_t, Assembly> assemblies_type;
+    assemblies_type assemblies;
+    uint64_t completed_id;
+
+    void expire( uint64_t now );
 
   public:
-    FragmentAssembly() : fragments(), current_id( -1 ), fragments_arrived( 0 ), fragments_total( -1 ) {}
-    bool add_fragment( Fragment &inst );
+    FragmentAssembly() : assemblies(), completed_id( -1 ) {}
+    /* true when frag completes its instruction */
+    bool add_fragment( Fragment &frag );
     Instruction get_assembly( void );
   };
 
@@ -90,14 +156,16 @@ namespace Network {
     uint64_t next_instruction_id;
     Instruction last_instruction;
     size_t last_MTU;
+    bool last_compact;
 
   public:
-    Fragmenter() : next_instruction_id( 0 ), last_instruction(), last_MTU( -1 )
+    Fragmenter() : next_instruction_id( 0 ), last_instruction(), last_MTU( -1 ), last_compact( false )
     {
       last_instruction.set_old_num( -1 );
       last_instruction.set_new_num( -1 );
     }
-    std::vector<Fragment> make_fragments( const Instruction &inst, size_t MTU );
+    /* with_parity adds a parity fragment to instructions of more than one */
+    std::vector<Fragment> make_fragments( const Instruction &inst, size_t MTU, bool with_parity, bool compact );
     uint64_t last_ack_sent( void ) const { return last_instruction.ack_num(); }
   };
   
@@ -63,7 +63,22 @@ TransportSender<MyState>::TransportSender( Connection *s_connection, MyState &in
     SEND_MINDELAY( 8 ),
     last_heard( 0 ),
     prng(),
-    mindelay_clock( -1 )
+    mindelay_clock( -1 ),
+    send_rate( INITIAL_SEND_RATE ),
+    rate_updated( timestamp() ),
+    last_frame_bytes( 0 ),
+    paced_fragments(),
+    pace_clock( 0 ),
+    diff_encodings_accepted( DIFF_DEFLATE | DIFF_DEFLATE_STATE ),
+    peer_diff_encodings( 0 ),
+    peer_accepts_parity( false ),
+    peer_accepts_compact( false ),
+    peer_diff_formats( 0 ),
+    diff_formats_accepted( 0 ),
+    mtu_probe_received( 0 ),
+    diff_cache(),
+    empty_diff_num( 0 ),
+    empty_diff_state( initial_state )
 {
 }
 
@@ -72,6 +87,13 @@ template <class MyState>
 unsigned int TransportSender<MyState>::send_interval( void ) const
 {
   int SEND_INTERVAL = lrint( ceil( connection->get_SRTT() / 2.0 ) );
+
+  /* and no faster than the path carries the last frame */
+  const int drain_time = lrint( ceil( last_frame_bytes / send_rate ) );
+  if ( SEND_INTERVAL < drain_time ) {
+    SEND_INTERVAL = drain_time;
+  }
+
   if ( SEND_INTERVAL < SEND_INTERVAL_MIN ) {
     SEND_INTERVAL = SEND_INTERVAL_MIN;
   } else if ( SEND_INTERVAL > SEND_INTERVAL_MAX ) {
@@ -97,20 +119,20 @@ void TransportSender<MyState>::calculate_timers( void )
     next_ack_time = now + ACK_DELAY;
   }
 
-  if ( !(current_state == sent_states.back().state) ) {
+  if ( !renders_current( sent_states.back() ) ) {
     if ( mindelay_clock == uint64_t( -1 ) ) {
       mindelay_clock = now;
     }
 
     next_send_time = std::max( mindelay_clock + SEND_MINDELAY,
 			       sent_states.back().timestamp + send_interval() );
-  } else if ( !(current_state == assumed_receiver_state->state)
+  } else if ( !renders_current( *assumed_receiver_state )
 	      && (last_heard + ACTIVE_RETRY_TIMEOUT > now) ) {
     next_send_time = sent_states.back().timestamp + send_interval();
     if ( mindelay_clock != uint64_t( -1 ) ) {
       next_send_time = std::max( next_send_time, mindelay_clock + SEND_MINDELAY );
     }
-  } else if ( !(current_state == sent_states.front().state )
+  } else if ( !renders_current( sent_states.front() )
 	      && (last_heard + ACTIVE_RETRY_TIMEOUT > now) ) {
     next_send_time = sent_states.back().timestamp + connection->timeout() + ACK_DELAY;
   } else {
@@ -123,6 +145,14 @@ void TransportSender<MyState>::calculate_timers( void )
   }
 }
 
+/* Whether the receiver, at state sent, shows the current state */
+template <class MyState>
+bool TransportSender<MyState>::renders_current( const TimestampedState<MyState> &sent ) const
+{
+  return (current_state == sent.state)
+    || ((sent.num == empty_diff_num) && (current_state == empty_diff_state));
+}
+
 /* How many ms to wait until next event */
 template <class MyState>
 int TransportSender<MyState>::wait_time( void )
@@ -133,6 +163,9 @@ int TransportSender<MyState>::wait_time( void )
   if ( next_send_time < next_wakeup ) {
     next_wakeup = next_send_time;
   }
+  if ( !paced_fragments.empty() && (pace_clock < next_wakeup) ) {
+    next_wakeup = ceil( pace_clock );
+  }
 
   uint64_t now = timestamp();
 
@@ -159,6 +192,23 @@ void TransportSender<MyState>::tick( void )
 
   uint64_t now = timestamp();
 
+  update_send_rate( now );
+
+  /* finish the frame being paced out before starting another */
+  if ( !paced_fragments.empty() ) {
+    send_paced( now );
+    if ( !paced_fragments.empty() ) {
+      return;
+    }
+  }
+
+  int probe_size;
+  uint32_t probe_id;
+  if ( !shutdown_in_progress && (ack_num != uint64_t(-1))
+       && connection->mtu_probe_due( probe_size, probe_id ) ) {
+    send_mtu_probe( probe_size, probe_id );
+  }
+
   if ( (now < next_ack_time)
        && (now < next_send_time) ) {
     return;
@@ -166,9 +216,9 @@ void TransportSender<MyState>::tick( void )
 
   /* Determine if a new diff or empty ack needs to be sent */
     
-  std::string diff = current_state.diff_from( assumed_receiver_state->state );
+  choose_base();
 
-  attempt_prospective_resend_optimization( diff );
+  std::string diff = diff_from( *assumed_receiver_state );
 
   if ( verbose ) {
     /* verify diff has round-trip identity (modulo Unicode fallback rendering) */
@@ -185,7 +235,15 @@ void TransportSender<MyState>::tick( void )
     }
   }
 
-  if ( diff.empty() ) {
+  /* From an earlier base, an empty diff still goes out as a new state,
+     or the receiver could end up at a later one that renders
+     differently. */
+  const bool base_is_last = (assumed_receiver_state->num == sent_states.back().num);
+
+  if ( diff.empty() && base_is_last ) {
+    empty_diff_num = assumed_receiver_state->num;
+    empty_diff_state = current_state;
+
     if ( (now >= next_ack_time) ) {
       send_empty_ack();
       mindelay_clock = uint64_t( -1 );
@@ -325,34 +383,178 @@ void TransportSender<MyState>::send_in_fragments( const std::string & diff, uint
   inst.set_new_num( new_num );
   inst.set_ack_num( ack_num );
   inst.set_throwaway_num( sent_states.front().num );
-  inst.set_diff( diff );
+  set_diff( inst, diff );
+  inst.set_diff_encodings_accepted( diff_encodings_accepted );
+  inst.set_fragment_parity_accepted( true );
+  inst.set_compact_header_accepted( true );
+  if ( diff_formats_accepted ) {
+    inst.set_diff_formats_accepted( diff_formats_accepted );
+  }
+  if ( mtu_probe_received ) {
+    inst.set_mtu_probe_ack( mtu_probe_received );
+  }
   inst.set_chaff( make_chaff() );
 
   if ( new_num == uint64_t(-1) ) {
     shutdown_tries++;
   }
 
+  /* on a lossy path, let a frame survive the loss of any one fragment */
+  const bool with_parity = peer_accepts_parity && (connection->get_loss_rate() >= PARITY_LOSS_RATE);
+
   std::vector<Fragment> fragments = fragmenter.make_fragments( inst, connection->get_MTU()
 							       - Network::Connection::ADDED_BYTES
-							       - Crypto::Session::ADDED_BYTES );
+							       - Crypto::Session::ADDED_BYTES,
+							       with_parity, peer_accepts_compact );
+  last_frame_bytes = 0;
   for ( std::vector<Fragment>::iterator i = fragments.begin();
         i != fragments.end();
         i++ ) {
-    connection->send( i->tostring() );
+    last_frame_bytes += i->header_len() + i->contents.size();
 
     if ( verbose ) {
-      fprintf( stderr, "[%u] Sent [%d=>%d] id %d, frag %d ack=%d, throwaway=%d, len=%d, frame rate=%.2f, timeout=%d, srtt=%.1f\n",
+      fprintf( stderr, "[%u] Sent [%d=>%d] id %d, frag %d ack=%d, throwaway=%d, len=%d, frame rate=%.2f, timeout=%d, srtt=%.1f, rate=%.1f\n",
 	       (unsigned int)(timestamp() % 100000), (int)inst.old_num(), (int)inst.new_num(), (int)i->id, (int)i->fragment_num,
 	       (int)inst.ack_num(), (int)inst.throwaway_num(), (int)i->contents.size(),
 	       1000.0 / (double)send_interval(),
-	       (int)connection->timeout(), connection->get_SRTT() );
+	       (int)connection->timeout(), connection->get_SRTT(), send_rate );
     }
+  }
 
+  paced_fragments.insert( paced_fragments.end(), fragments.begin(), fragments.end() );
+  const uint64_t now = timestamp();
+  if ( pace_clock < now ) {
+    pace_clock = now;
   }
+  send_paced( now );
 
   pending_data_ack = false;
 }
 
+/* Compress the diff against a preset dictionary when the receiver
+   decodes that and it comes out shorter */
+template <class MyState>
+void TransportSender<MyState>::set_diff( Instruction &inst, const std::string &diff )
+{
+  unsigned int encoding = DIFF_RAW;
+  if ( peer_diff_encodings & DIFF_DEFLATE_STATE ) {
+    encoding = DIFF_DEFLATE_STATE;
+  } else if ( peer_diff_encodings & DIFF_DEFLATE ) {
+    encoding = DIFF_DEFLATE;
+  }
+
+  if ( (encoding != DIFF_RAW) && !diff.empty() ) {
+    std::string encoded = get_compressor().compress_str( diff, diff_dictionary( encoding, peer_diff_formats,
+										 *assumed_receiver_state ) );
+    if ( encoded.size() < diff.size() ) {
+      inst.set_diff_encoding( encoding );
+      if ( (encoding == DIFF_DEFLATE_STATE) && peer_diff_formats ) {
+	inst.set_dictionary_formats( peer_diff_formats );
+      }
+      inst.set_diff( encoded );
+      return;
+    }
+  }
+
+  inst.set_diff_encoding( DIFF_RAW );
+  inst.set_diff( diff );
+}
+
+/* Probe the path MTU with a datagram of size bytes: an instruction
+   padded with chaff, from and to the known receiver state so that it
+   changes nothing there but is acknowledged */
+template <class MyState>
+void TransportSender<MyState>::send_mtu_probe( int size, uint32_t probe_id )
+{
+  Instruction inst;
+
+  inst.set_protocol_version( MOSH_PROTOCOL_VERSION );
+  inst.set_old_num( sent_states.front().num );
+  inst.set_new_num( sent_states.front().num );
+  inst.set_ack_num( ack_num );
+  inst.set_throwaway_num( sent_states.front().num );
+  inst.set_mtu_probe( probe_id );
+
+  /* of the fragment, header and all */
+  const size_t target = size - Network::Connection::ADDED_BYTES - Crypto::Session::ADDED_BYTES;
+
+  /* random chaff does not compress, so it lengthens the fragment one
+     for one; a few tries settle the framing around it */
+  size_t chaff_len = 0;
+  std::vector<Fragment> fragments;
+  for ( int tries = 0; tries < 4; tries++ ) {
+    std::string chaff( chaff_len, 0 );
+    prng.fill( &chaff[ 0 ], chaff_len );
+    inst.set_chaff( chaff );
+
+    fragments = fragmenter.make_fragments( inst, Crypto::Session::RECEIVE_MTU, false, peer_accepts_compact );
+    const size_t len = fragments.front().header_len() + fragments.front().contents.size();
+    if ( len == target ) {
+      break;
+    }
+    chaff_len = (chaff_len + target > len) ? chaff_len + target - len : 0;
+  }
+
+  /* a byte off the target still probes; the connection notes the size sent */
+  assert( fragments.size() == 1 );
+
+  char header[ Fragment::compact_header_max ];
+  const size_t header_len = fragments.front().write_header( header );
+  connection->send_mtu_probe( header, header_len, fragments.front().contents, fragments.front().compact );
+
+  if ( verbose ) {
+    fprintf( stderr, "[%u] Sent MTU probe %d of %d bytes, MTU=%d\n",
+	     (unsigned int)(timestamp() % 100000), (int)probe_id, size, connection->get_MTU() );
+  }
+}
+
+/* Send the queued fragments whose time has come */
+template <class MyState>
+void TransportSender<MyState>::send_paced( uint64_t now )
+{
+  /* whatever is due goes out in one batch */
+  const size_t max_batch = Network::Connection::SEND_BATCH;
+  char headers[ max_batch ][ Fragment::compact_header_max ]; /* the longer */
+  Network::Connection::OutgoingDatagram batch[ max_batch ];
+
+  while ( !paced_fragments.empty() && (pace_clock <= now) ) {
+    size_t count = 0;
+    for ( std::deque<Fragment>::const_iterator i = paced_fragments.begin();
+	  (i != paced_fragments.end()) && (count < max_batch) && (pace_clock <= now);
+	  i++ ) {
+      batch[ count ].header = headers[ count ];
+      batch[ count ].header_len = i->write_header( headers[ count ] );
+      batch[ count ].payload = &i->contents;
+      batch[ count ].compact = i->compact;
+
+      pace_clock += (batch[ count ].header_len + i->contents.size()) / send_rate;
+      count++;
+    }
+
+    connection->send( batch, count );
+    paced_fragments.erase( paced_fragments.begin(), paced_fragments.begin() + count );
+  }
+}
+
+/* Move the rate up while the path's queues hold less than the target
+   delay and down while they hold more, faster the further off. */
+template <class MyState>
+void TransportSender<MyState>::update_send_rate( uint64_t now )
+{
+  const double SRTT = std::max( connection->get_SRTT(), 1.0 );
+  const double elapsed = std::min( double( now - rate_updated ), SRTT );
+  rate_updated = now;
+
+  double off_target = (QUEUE_DELAY_TARGET - connection->get_queue_delay()) / QUEUE_DELAY_TARGET;
+  off_target = std::max( off_target, -1.0 );
+  if ( (off_target > 0) && paced_fragments.empty() ) {
+    return; /* the rate held nothing back, so no sign the path takes more */
+  }
+
+  send_rate *= exp( RATE_GAIN * off_target * elapsed / SRTT );
+  send_rate = std::min( std::max( send_rate, MIN_SEND_RATE ), MAX_SEND_RATE );
+}
+
 template <class MyState>
 void TransportSender<MyState>::process_acknowledgment_through( uint64_t ack_num )
 {
@@ -400,27 +602,76 @@ void TransportSender<MyState>::set_ack_num( uint64_t s_ack_num )
   ack_num = s_ack_num;
 }
 
-/* Investigate diff against known receiver state instead */
-/* Mutates proposed_diff */
 template <class MyState>
-void TransportSender<MyState>::attempt_prospective_resend_optimization( std::string &proposed_diff )
+std::string TransportSender<MyState>::diff_from( const TimestampedState<MyState> &base )
+{
+  for ( typename std::list<CachedDiff>::const_iterator i = diff_cache.begin();
+	i != diff_cache.end();
+	i++ ) {
+    if ( (i->base_num == base.num)
+	 && (i->current == current_state)
+	 && (i->base == base.state) ) {
+      return i->diff;
+    }
+  }
+
+  std::string diff = current_state.diff_from( base.state, peer_diff_formats );
+  if ( diff_cache.size() >= DIFF_CACHE_SIZE ) {
+    diff_cache.pop_front();
+  }
+  diff_cache.push_back( CachedDiff( base.num, base.state, current_state, diff ) );
+  return diff;
+}
+
+/* Chance that the receiver has an unacknowledged state sent age ms ago */
+template <class MyState>
+double TransportSender<MyState>::delivery_probability( uint64_t age ) const
+{
+  double p = 1 - connection->get_loss_rate();
+
+  /* Silence means nothing until an ack could have come back, and
+     means loss once the state is presumed lost. */
+  const double ack_due = connection->get_SRTT() + ACK_DELAY;
+  const double presumed_lost = connection->timeout() + ACK_DELAY;
+  if ( age >= presumed_lost ) {
+    return 0;
+  } else if ( age > ack_due ) {
+    p *= (presumed_lost - age) / (presumed_lost - ack_due);
+  }
+
+  return p;
+}
+
+/* Choose the state to diff from, among the known receiver state and
+   the later ones the receiver is assumed to have.  A diff from a state
+   the receiver lacks is dropped and has to be repeated from the known
+   state, so each base costs its estimated diff size plus, weighted by
+   the chance it is missing, the size of that repeat. */
+template <class MyState>
+void TransportSender<MyState>::choose_base( void )
 {
   if ( assumed_receiver_state == sent_states.begin() ) {
     return;
   }
 
-  std::string resend_diff = current_state.diff_from( sent_states.front().state );
+  const uint64_t now = timestamp();
+  const double known_size = current_state.diff_size_estimate( sent_states.front().state );
 
-  /* We do a prophylactic resend if it would make the diff shorter,
-     or if it would lengthen it by no more than 100 bytes and still be
-     less than 1000 bytes. */
+  typename sent_states_type::iterator best = sent_states.begin();
+  double best_cost = known_size;
 
-  if ( (resend_diff.size() <= proposed_diff.size())
-       || ( (resend_diff.size() < 1000)
-	    && (resend_diff.size() - proposed_diff.size() < 100) ) ) {
-    assumed_receiver_state = sent_states.begin();
-    proposed_diff = resend_diff;
+  typename sent_states_type::iterator end = assumed_receiver_state;
+  end++;
+  for ( typename sent_states_type::iterator i = ++sent_states.begin(); i != end; i++ ) {
+    double cost = current_state.diff_size_estimate( i->state )
+      + (1 - delivery_probability( now - i->timestamp )) * known_size;
+    if ( cost <= best_cost ) { /* prefer newer */
+      best = i;
+      best_cost = cost;
+    }
   }
+
+  assumed_receiver_state = best;
 }
 
 #endif
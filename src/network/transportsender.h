@@ -36,11 +36,13 @@
 
 #include <string>
 #include <list>
+#include <deque>
 
 #include "src/network/network.h"
 #include "src/protobufs/transportinstruction.pb.h"
 #include "transportstate.h"
 #include "transportfragment.h"
+#include "compressor.h"
 #include "src/crypto/prng.h"
 
 namespace Network {
@@ -54,17 +56,51 @@ namespace Network {
   const int SHUTDOWN_RETRIES = 16; /* number of shutdown packets to send before giving up */
   const int ACTIVE_RETRY_TIMEOUT = 10000; /* attempt to resend at frame rate */
 
+  /* rate control, after LEDBAT: aim for this much queueing on the path */
+  const double QUEUE_DELAY_TARGET = 50; /* ms */
+  const double RATE_GAIN = 0.5; /* most the log of the rate moves per RTT */
+  const double INITIAL_SEND_RATE = 125; /* bytes per ms */
+  const double MIN_SEND_RATE = 2; /* bytes per ms */
+  const double MAX_SEND_RATE = 125000; /* bytes per ms */
+
+  const double PARITY_LOSS_RATE = 0.01; /* loss at which frames get a parity fragment */
+
+  /* The preset dictionary for a diff from base.  The receiver already
+     holds the base, so it rebuilds the same one whatever was lost.
+     A state's own dictionary is costly to build, so it is kept with
+     the state (subtract() must leave it unchanged).  It is drawn in
+     the diff formats the diff itself uses, named in the instruction. */
+  template <class State>
+  const std::string &diff_dictionary( unsigned int encoding, unsigned int formats,
+				      TimestampedState<State> &base )
+  {
+    if ( encoding != DIFF_DEFLATE_STATE ) {
+      return builtin_dictionary();
+    }
+    if ( !base.has_dictionary || (base.dictionary_formats != formats) ) {
+      base.dictionary = builtin_dictionary() + base.state.compression_dictionary( formats );
+      base.has_dictionary = true;
+      base.dictionary_formats = formats;
+    }
+    return base.dictionary;
+  }
+
   template <class MyState>
   class TransportSender
   {
   private:
     /* helper methods for tick() */
     void update_assumed_receiver_state( void );
-    void attempt_prospective_resend_optimization( std::string &proposed_diff );
+    double delivery_probability( uint64_t age ) const;
+    void choose_base( void );
     void rationalize_states( void );
     void send_to_receiver( const std::string & diff );
     void send_empty_ack( void );
     void send_in_fragments( const std::string & diff, uint64_t new_num );
+    void send_mtu_probe( int size, uint32_t probe_id );
+    void set_diff( Instruction &inst, const std::string &diff );
+    void update_send_rate( uint64_t now );
+    void send_paced( uint64_t now );
     void add_sent_state( uint64_t the_timestamp, uint64_t num, MyState &state );
 
     /* state of sender */
@@ -108,6 +144,51 @@ namespace Network {
 
     uint64_t mindelay_clock; /* time of first pending change to current state */
 
+    /* Fragments go out no faster than send_rate, so a large frame
+       does not fill the path's queues ahead of the next keystroke. */
+    double send_rate; /* bytes per ms the path is thought to carry */
+    uint64_t rate_updated;
+    size_t last_frame_bytes;
+    std::deque<Fragment> paced_fragments; /* of the frame being sent */
+    double pace_clock; /* when the next of them may go */
+
+    /* diff encodings we can decode, and those the receiver can */
+    unsigned int diff_encodings_accepted;
+    unsigned int peer_diff_encodings;
+    bool peer_accepts_parity;
+    bool peer_accepts_compact; /* packets, fragments and instructions */
+
+    /* state diff formats (MyState::DIFF_FORMATS) the receiver takes,
+       and those our receiver takes */
+    unsigned int peer_diff_formats;
+    unsigned int diff_formats_accepted;
+
+    uint32_t mtu_probe_received; /* the last probe's number, echoed back */
+
+    /* Diffs recently computed from current_state, reused (e.g. by
+       retransmissions) while neither end of the diff has changed.
+       Snapshots of the states are cheap to keep and to compare. */
+    class CachedDiff {
+    public:
+      uint64_t base_num;
+      MyState base, current;
+      std::string diff;
+
+      CachedDiff( uint64_t s_base_num, const MyState &s_base, const MyState &s_current, const std::string &s_diff )
+	: base_num( s_base_num ), base( s_base ), current( s_current ), diff( s_diff )
+      {}
+    };
+    static const size_t DIFF_CACHE_SIZE = 2;
+    std::list<CachedDiff> diff_cache;
+    std::string diff_from( const TimestampedState<MyState> &base );
+
+    /* A current state whose diff from the sent state empty_diff_num
+       was empty, though the two may not compare equal (e.g. rows
+       rewritten unchanged).  Nothing is left to send for it. */
+    uint64_t empty_diff_num;
+    MyState empty_diff_state;
+    bool renders_current( const TimestampedState<MyState> &sent ) const;
+
   public:
     /* constructor */
     TransportSender( Connection *s_connection, MyState &initial_state );
@@ -127,6 +208,26 @@ namespace Network {
     /* Accelerate reply ack */
     void set_data_ack( void ) { pending_data_ack = true; }
 
+    /* Diff encodings the receiver says it decodes */
+    void set_peer_diff_encodings( unsigned int s_encodings ) { peer_diff_encodings = s_encodings; }
+
+    /* Stop asking the receiver for an encoding we failed to decode */
+    void refuse_diff_encoding( unsigned int encoding ) { diff_encodings_accepted &= ~encoding; }
+
+    void set_peer_accepts_parity( bool s_accepts ) { peer_accepts_parity = s_accepts; }
+    void set_peer_accepts_compact( bool s_accepts ) { peer_accepts_compact = s_accepts; }
+
+    void set_peer_diff_formats( unsigned int s_formats )
+    {
+      if ( s_formats != peer_diff_formats ) {
+	peer_diff_formats = s_formats;
+	diff_cache.clear(); /* diffs in the old formats */
+      }
+    }
+    void set_diff_formats_accepted( unsigned int s_formats ) { diff_formats_accepted = s_formats; }
+
+    void set_mtu_probe_received( uint32_t probe_id ) { mtu_probe_received = probe_id; }
+
     /* Received something */
     void remote_heard( uint64_t ts ) { last_heard = ts; }
 
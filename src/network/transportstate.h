@@ -33,6 +33,8 @@
 #ifndef TRANSPORT_STATE_HPP
 #define TRANSPORT_STATE_HPP
 
+#include <string>
+
 namespace Network {
   template <class State>
   class TimestampedState
@@ -41,9 +43,17 @@ namespace Network {
     uint64_t timestamp;
     uint64_t num;
     State state;
+
+    /* the preset dictionary of diffs from this state under
+       DIFF_DEFLATE_STATE, built on first use by diff_dictionary()
+       for the diff formats in dictionary_formats */
+    std::string dictionary;
+    bool has_dictionary;
+    unsigned int dictionary_formats;
     
     TimestampedState( uint64_t s_timestamp, uint64_t s_num, const State &s_state )
-      : timestamp( s_timestamp ), num( s_num ), state( s_state )
+      : timestamp( s_timestamp ), num( s_num ), state( s_state ),
+	dictionary(), has_dictionary( false ), dictionary_formats( 0 )
     {}
   };
 }
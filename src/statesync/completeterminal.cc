@@ -31,10 +31,10 @@
 */
 
 #include <climits>
+#include <map>
 
 #include "src/protobufs/hostinput.pb.h"
 #include "src/statesync/completeterminal.h"
-#include "src/util/fatal_assert.h"
 
 using namespace std;
 using namespace Parser;
@@ -43,32 +43,55 @@ using namespace HostBuffers;
 
 string Complete::act( const string &str )
 {
-  for ( unsigned int i = 0; i < str.size(); i++ ) {
+  if ( str.empty() ) {
+    return string();
+  }
+
+  const char *data = str.data();
+  const size_t len = str.size();
+  Emulator &emulator = get_mutable_terminal();
+
+  for ( size_t i = 0; i < len; i++ ) {
+    /* hand runs of plain text straight to the terminal */
+    const size_t run = parser.printable_run( data + i, len - i );
+    if ( run > 0 ) {
+      emulator.print_ascii_run( data + i, run );
+      i += run - 1;
+      continue;
+    }
+
     /* parse octet into up to three actions */
-    parser.input( str[ i ], actions );
+    parser.input( str[ i ], tokens );
     
-    /* apply actions to terminal and delete them */
-    for ( Actions::iterator it = actions.begin();
-	  it != actions.end();
+    /* apply actions to terminal and forget them */
+    for ( Tokens::const_iterator it = tokens.begin();
+	  it != tokens.end();
 	  it++ ) {
-      Action &act = **it;
-      act.act_on_terminal( &terminal );
+      it->act_on_terminal( &emulator );
     }
-    actions.clear();
+    tokens.clear();
   }
 
-  return terminal.read_octets_to_host();
+  return emulator.read_octets_to_host();
 }
 
 string Complete::act( const Action &act )
 {
+  /* Most keystrokes go straight to the host and leave the emulator
+     as it is, so they need not unshare it from the saved states. */
+  string to_host;
+  if ( act.act_on_const_terminal( terminal.get(), to_host ) ) {
+    return to_host;
+  }
+
   /* apply action to terminal */
-  act.act_on_terminal( &terminal );
-  return terminal.read_octets_to_host();
+  Emulator &emulator = get_mutable_terminal();
+  act.act_on_terminal( &emulator );
+  return emulator.read_octets_to_host();
 }
 
 /* interface for Network::Transport */
-string Complete::diff_from( const Complete &existing ) const
+string Complete::diff_from( const Complete &existing, unsigned int formats ) const
 {
   HostBuffers::HostMessage output;
 
@@ -79,51 +102,451 @@ string Complete::diff_from( const Complete &existing ) const
   }
 
   if ( !(existing.get_fb() == get_fb()) ) {
-    if ( (existing.get_fb().ds.get_width() != terminal.get_fb().ds.get_width())
-	 || (existing.get_fb().ds.get_height() != terminal.get_fb().ds.get_height()) ) {
+    if ( (existing.get_fb().ds.get_width() != get_fb().ds.get_width())
+	 || (existing.get_fb().ds.get_height() != get_fb().ds.get_height()) ) {
       Instruction *new_res = output.add_instruction();
-      new_res->MutableExtension( resize )->set_width( terminal.get_fb().ds.get_width() );
-      new_res->MutableExtension( resize )->set_height( terminal.get_fb().ds.get_height() );
+      new_res->MutableExtension( resize )->set_width( get_fb().ds.get_width() );
+      new_res->MutableExtension( resize )->set_height( get_fb().ds.get_height() );
     }
-    string update = display.new_frame( true, existing.get_fb(), terminal.get_fb() );
-    if ( !update.empty() ) {
-      Instruction *new_inst = output.add_instruction();
-      new_inst->MutableExtension( hostbytes )->set_hoststring( update );
+    if ( formats & FRAME_PATCH ) {
+      FramePatch patch;
+      make_patch( existing.get_fb(), patch );
+      if ( patch.ByteSizeLong() > 0 ) {
+	output.add_instruction()->MutableExtension( framepatch )->Swap( &patch );
+      }
+    } else {
+      string update = display.new_frame( true, existing.get_fb(), get_fb() );
+      if ( !update.empty() ) {
+	Instruction *new_inst = output.add_instruction();
+	new_inst->MutableExtension( hostbytes )->set_hoststring( update );
+      }
     }
   }
   
   return output.SerializeAsString();
 }
 
+/*
+ * A FramePatch carries the cells of a changed span of a row as runs
+ * of cells in one rendition: the rendition's index, the run's length,
+ * then the cells.  A cell is one byte,
+ *
+ *   0x00                empty,
+ *   0x20 to 0x7e        that ASCII character,
+ *
+ * either narrow and without flags; or 0x80 | CELL_* flags, a length
+ * and that many bytes of UTF-8 contents; or CELL_REPEAT and a count
+ * of further copies of the cell before it.
+ */
+static const unsigned int CELL_WIDE = 1, CELL_FALLBACK = 2, CELL_WRAP = 4, CELL_LONG = 0x80;
+static const unsigned int CELL_REPEAT = 1;
+static const int MIN_REPEAT = 3; /* copies worth a CELL_REPEAT */
+
+/* bits of FramePatch.modes */
+static const unsigned int MODE_CURSOR_VISIBLE = 1, MODE_REVERSE_VIDEO = 2,
+  MODE_BRACKETED_PASTE = 4, MODE_MOUSE_FOCUS_EVENT = 8, MODE_TITLE_INITIALIZED = 16;
+
+static void put_varint( string &out, uint64_t val )
+{
+  while ( val >= 0x80 ) {
+    out.push_back( static_cast<char>( val | 0x80 ) );
+    val >>= 7;
+  }
+  out.push_back( static_cast<char>( val ) );
+}
+
+static bool get_varint( const string &in, size_t &pos, uint64_t &val )
+{
+  val = 0;
+  for ( int shift = 0; (pos < in.size()) && (shift < 64); shift += 7 ) {
+    const uint8_t byte = in[ pos++ ];
+    val |= uint64_t( byte & 0x7f ) << shift;
+    if ( !(byte & 0x80) ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void put_cell( string &out, const Cell &cell )
+{
+  const char *data;
+  size_t len;
+  cell.get_contents( data, len );
+  const unsigned int flags = ( cell.get_wide() ? CELL_WIDE : 0 )
+    | ( cell.get_fallback() ? CELL_FALLBACK : 0 )
+    | ( cell.get_wrap() ? CELL_WRAP : 0 );
+
+  if ( !flags && len == 0 ) {
+    out.push_back( 0 );
+  } else if ( !flags && len == 1 && data[ 0 ] >= 0x20 && data[ 0 ] < 0x7f ) {
+    out.push_back( data[ 0 ] );
+  } else {
+    out.push_back( static_cast<char>( CELL_LONG | flags ) );
+    put_varint( out, len );
+    out.append( data, len );
+  }
+}
+
+static bool get_cell( const string &in, size_t &pos, Cell &cell )
+{
+  if ( pos >= in.size() ) {
+    return false;
+  }
+  const uint8_t byte = in[ pos++ ];
+  unsigned int flags = 0;
+
+  if ( byte == 0 ) {
+    cell.clear();
+  } else if ( byte >= 0x20 && byte < 0x7f ) {
+    cell.set_contents( &in[ pos - 1 ], 1 );
+  } else {
+    uint64_t len;
+    if ( !(byte & CELL_LONG) || !get_varint( in, pos, len ) || (len > in.size() - pos) ) {
+      return false;
+    }
+    flags = byte;
+    cell.set_contents( in.data() + pos, len );
+    pos += len;
+  }
+
+  cell.set_wide( flags & CELL_WIDE );
+  cell.set_fallback( flags & CELL_FALLBACK );
+  cell.set_wrap( flags & CELL_WRAP );
+  return true;
+}
+
+static unsigned int get_modes( const Framebuffer &fb )
+{
+  return ( fb.ds.cursor_visible ? MODE_CURSOR_VISIBLE : 0 )
+    | ( fb.ds.reverse_video ? MODE_REVERSE_VIDEO : 0 )
+    | ( fb.ds.bracketed_paste ? MODE_BRACKETED_PASTE : 0 )
+    | ( fb.ds.mouse_focus_event ? MODE_MOUSE_FOCUS_EVENT : 0 )
+    | ( fb.is_title_initialized() ? MODE_TITLE_INITIALIZED : 0 );
+}
+
+static void put_title( HostBuffers::Title &out, const Framebuffer::title_type &title )
+{
+  for ( Framebuffer::title_type::const_iterator i = title.begin(); i != title.end(); i++ ) {
+    out.add_chars( *i );
+  }
+}
+
+static Framebuffer::title_type get_title( const HostBuffers::Title &in )
+{
+  return Framebuffer::title_type( in.chars().begin(), in.chars().end() );
+}
+
+/* The patch that turns existing into our framebuffer: the block move
+   Display::new_frame() would scroll, then the spans of rows that still
+   differ.  After a resize (sent before the patch) every row is sent
+   whole, as new_frame() repaints the screen. */
+void Complete::make_patch( const Framebuffer &existing, FramePatch &patch ) const
+{
+  const Framebuffer &fb = get_fb();
+  const int width = fb.ds.get_width(), height = fb.ds.get_height();
+
+  /* replay what the client does to existing */
+  Framebuffer replica( existing );
+  const bool resized = (replica.ds.get_width() != width) || (replica.ds.get_height() != height);
+  if ( resized ) {
+    replica.resize( width, height );
+  }
+
+  int top, bottom, shift;
+  if ( !resized && display.find_scroll( replica.get_rows(), fb, top, bottom, shift ) ) {
+    replica.move_rows( top, bottom, shift );
+    patch.set_move_top( top );
+    patch.set_move_bottom( bottom );
+    patch.set_move_shift( shift );
+  }
+
+  std::map<uint64_t, unsigned int> palette;
+  for ( int y = 0; y < height; y++ ) {
+    const Row &row = *fb.get_row( y ), &old_row = *replica.get_row( y );
+    int first = 0, last = width - 1;
+    if ( !resized ) {
+      if ( &row == &old_row || row == old_row ) {
+	continue;
+      }
+      row.differing_span( old_row, width, first, last );
+      if ( first >= width ) {
+	continue;
+      }
+    }
+
+    RowPatch *row_patch = patch.add_row();
+    row_patch->set_row( y );
+    row_patch->set_first_col( first );
+    string &cells = *row_patch->mutable_cells();
+    for ( int x = first; x <= last; ) {
+      const uint64_t renditions = row.cells[ x ].get_renditions().get_bits();
+      int run_end = x + 1;
+      while ( run_end <= last && row.cells[ run_end ].get_renditions().get_bits() == renditions ) {
+	run_end++;
+      }
+
+      std::map<uint64_t, unsigned int>::const_iterator entry = palette.find( renditions );
+      if ( entry == palette.end() ) {
+	entry = palette.insert( std::make_pair( renditions, palette.size() ) ).first;
+	patch.add_renditions( renditions );
+      }
+      put_varint( cells, entry->second );
+      put_varint( cells, run_end - x );
+      while ( x < run_end ) {
+	put_cell( cells, row.cells[ x ] );
+	int copies = 0;
+	while ( x + 1 + copies < run_end && row.cells[ x + 1 + copies ] == row.cells[ x ] ) {
+	  copies++;
+	}
+	if ( copies >= MIN_REPEAT ) {
+	  cells.push_back( CELL_REPEAT );
+	  put_varint( cells, copies );
+	  x += copies;
+	}
+	x++;
+      }
+    }
+  }
+
+  /* the rest only where it changed */
+  if ( fb.ds.get_cursor_row() != existing.ds.get_cursor_row() ) {
+    patch.set_cursor_row( fb.ds.get_cursor_row() );
+  }
+  if ( fb.ds.get_cursor_col() != existing.ds.get_cursor_col() ) {
+    patch.set_cursor_col( fb.ds.get_cursor_col() );
+  }
+  if ( !(fb.ds.get_renditions() == existing.ds.get_renditions()) ) {
+    patch.set_pen( fb.ds.get_renditions().get_bits() );
+  }
+  const unsigned int modes = get_modes( fb );
+  if ( modes != get_modes( existing ) ) {
+    patch.set_modes( modes );
+  }
+  if ( fb.ds.mouse_reporting_mode != existing.ds.mouse_reporting_mode ) {
+    patch.set_mouse_reporting_mode( fb.ds.mouse_reporting_mode );
+  }
+  if ( fb.ds.mouse_encoding_mode != existing.ds.mouse_encoding_mode ) {
+    patch.set_mouse_encoding_mode( fb.ds.mouse_encoding_mode );
+  }
+
+  if ( fb.get_bell_count() != existing.get_bell_count() ) {
+    patch.set_bell( true );
+  }
+  if ( fb.get_icon_name() != existing.get_icon_name() ) {
+    put_title( *patch.mutable_icon_name(), fb.get_icon_name() );
+  }
+  if ( fb.get_window_title() != existing.get_window_title() ) {
+    put_title( *patch.mutable_window_title(), fb.get_window_title() );
+  }
+  if ( fb.get_clipboard() != existing.get_clipboard() ) {
+    put_title( *patch.mutable_clipboard(), fb.get_clipboard() );
+  }
+}
+
+/* Returns false, with the framebuffer partly patched, if the patch
+   does not fit it or is malformed */
+bool Complete::apply_patch( const FramePatch &patch )
+{
+  Framebuffer &fb = get_mutable_terminal().get_mutable_fb();
+  const int width = fb.ds.get_width(), height = fb.ds.get_height();
+
+  if ( patch.has_move_shift() ) {
+    const int top = patch.move_top(), bottom = patch.move_bottom(), shift = patch.move_shift();
+    if ( shift == 0 || top < 0 || top > bottom || bottom >= height
+	 || top + shift < 0 || bottom + shift >= height ) {
+      return false;
+    }
+    fb.move_rows( top, bottom, shift );
+  }
+
+  for ( int i = 0; i < patch.row_size(); i++ ) {
+    const RowPatch &row_patch = patch.row( i );
+    if ( row_patch.row() < 0 || row_patch.row() >= height
+	 || row_patch.first_col() < 0 || row_patch.first_col() >= width ) {
+      return false;
+    }
+
+    Row *row = fb.get_mutable_row( row_patch.row() );
+    const string &cells = row_patch.cells();
+    size_t pos = 0;
+    int x = row_patch.first_col();
+    while ( pos < cells.size() ) {
+      uint64_t index, run;
+      if ( !get_varint( cells, pos, index ) || index >= static_cast<uint64_t>( patch.renditions_size() )
+	   || !get_varint( cells, pos, run ) || run > static_cast<uint64_t>( width - x ) ) {
+	return false;
+      }
+      Renditions renditions( 0 );
+      renditions.set_bits( patch.renditions( index ) );
+
+      const int run_start = x, run_end = x + run;
+      while ( x < run_end ) {
+	if ( pos >= cells.size() ) {
+	  return false;
+	}
+	if ( static_cast<uint8_t>( cells[ pos ] ) == CELL_REPEAT ) {
+	  pos++;
+	  uint64_t copies;
+	  if ( x == run_start || !get_varint( cells, pos, copies )
+	       || copies > static_cast<uint64_t>( run_end - x ) ) {
+	    return false;
+	  }
+	  for ( uint64_t j = 0; j < copies; j++, x++ ) {
+	    row->cells[ x ] = row->cells[ x - 1 ];
+	  }
+	  continue;
+	}
+	Cell &cell = row->cells[ x ];
+	cell.set_renditions( renditions );
+	if ( !get_cell( cells, pos, cell ) ) {
+	  return false;
+	}
+	x++;
+      }
+    }
+    row->mark_dirty( row_patch.first_col(), x - 1 );
+  }
+
+  if ( patch.has_cursor_row() ) {
+    fb.ds.move_row( patch.cursor_row() );
+  }
+  if ( patch.has_cursor_col() ) {
+    fb.ds.move_col( patch.cursor_col() );
+  }
+  if ( patch.has_pen() ) {
+    fb.ds.get_renditions().set_bits( patch.pen() );
+  }
+  if ( patch.has_modes() ) {
+    fb.ds.cursor_visible = patch.modes() & MODE_CURSOR_VISIBLE;
+    fb.ds.reverse_video = patch.modes() & MODE_REVERSE_VIDEO;
+    fb.ds.bracketed_paste = patch.modes() & MODE_BRACKETED_PASTE;
+    fb.ds.mouse_focus_event = patch.modes() & MODE_MOUSE_FOCUS_EVENT;
+    if ( patch.modes() & MODE_TITLE_INITIALIZED ) {
+      fb.set_title_initialized();
+    }
+  }
+  if ( patch.has_mouse_reporting_mode() ) {
+    fb.ds.mouse_reporting_mode = static_cast<DrawState::MouseReportingMode>( patch.mouse_reporting_mode() );
+  }
+  if ( patch.has_mouse_encoding_mode() ) {
+    fb.ds.mouse_encoding_mode = static_cast<DrawState::MouseEncodingMode>( patch.mouse_encoding_mode() );
+  }
+
+  if ( patch.bell() ) {
+    fb.ring_bell();
+  }
+  if ( patch.has_icon_name() ) {
+    fb.set_icon_name( get_title( patch.icon_name() ) );
+  }
+  if ( patch.has_window_title() ) {
+    fb.set_window_title( get_title( patch.window_title() ) );
+  }
+  if ( patch.has_clipboard() ) {
+    fb.set_clipboard( get_title( patch.clipboard() ) );
+  }
+
+  return true;
+}
+
+/* Roughly the size of diff_from( existing ), cheap enough to find for
+   many bases: the changed span of each changed row plus a cursor move.
+   Scrolls are not looked for, so a scrolled screen is overestimated. */
+size_t Complete::diff_size_estimate( const Complete &existing ) const
+{
+  const size_t ECHOACK_SIZE = 8, ROW_OVERHEAD = 8;
+
+  if ( version == existing.version ) {
+    return 0;
+  }
+
+  size_t estimate = ( echo_ack == existing.echo_ack ) ? 0 : ECHOACK_SIZE;
+
+  const Framebuffer &fb = get_fb(), &old_fb = existing.get_fb();
+  const int width = fb.ds.get_width();
+  if ( (width != old_fb.ds.get_width())
+       || (fb.ds.get_height() != old_fb.ds.get_height()) ) {
+    return estimate + size_t( width ) * (fb.ds.get_height() + ROW_OVERHEAD);
+  }
+
+  const Framebuffer::rows_type &rows = fb.get_rows(), &old_rows = old_fb.get_rows();
+  for ( size_t i = 0; i < rows.size(); i++ ) {
+    if ( rows[ i ] == old_rows[ i ] ) {
+      continue;
+    }
+    int first, last;
+    rows[ i ]->differing_span( *old_rows[ i ], width, first, last );
+    if ( first < width ) {
+      estimate += last - first + 1 + ROW_OVERHEAD;
+    }
+  }
+
+  if ( fb.get_window_title() != old_fb.get_window_title() ) {
+    estimate += fb.get_window_title().size() + ROW_OVERHEAD;
+  }
+  if ( fb.get_icon_name() != old_fb.get_icon_name() ) {
+    estimate += fb.get_icon_name().size() + ROW_OVERHEAD;
+  }
+
+  return estimate;
+}
+
 string Complete::init_diff( void ) const
 {
   return diff_from( Complete( get_fb().ds.get_width(), get_fb().ds.get_height() ));
 }
 
-void Complete::apply_string( const string & diff )
+/* What a diff in these formats repeats from this state: the screen
+   drawn from blank, as escape sequences or as a FramePatch */
+string Complete::compression_dictionary( unsigned int formats ) const
+{
+  return diff_from( Complete( get_fb().ds.get_width(), get_fb().ds.get_height() ), formats );
+}
+
+bool Complete::apply_string( const string & diff )
 {
   HostBuffers::HostMessage input;
-  fatal_assert( input.ParseFromString( diff ) );
+  if ( !input.ParseFromString( diff ) ) {
+    return false;
+  }
 
   for ( int i = 0; i < input.instruction_size(); i++ ) {
     if ( input.instruction( i ).HasExtension( hostbytes ) ) {
       string terminal_to_host = act( input.instruction( i ).GetExtension( hostbytes ).hoststring() );
       assert( terminal_to_host.empty() ); /* server never interrogates client terminal */
+    } else if ( input.instruction( i ).HasExtension( framepatch ) ) {
+      if ( !apply_patch( input.instruction( i ).GetExtension( framepatch ) ) ) {
+	return false;
+      }
     } else if ( input.instruction( i ).HasExtension( resize ) ) {
       act( Resize( input.instruction( i ).GetExtension( resize ).width(),
 				      input.instruction( i ).GetExtension( resize ).height() ) );
     } else if ( input.instruction( i ).HasExtension( echoack ) ) {
       uint64_t inst_echo_ack_num = input.instruction( i ).GetExtension( echoack ).echo_ack_num();
       assert( inst_echo_ack_num >= echo_ack );
+      if ( echo_ack != inst_echo_ack_num ) {
+	version = new_version();
+      }
       echo_ack = inst_echo_ack_num;
     }
   }
+
+  return true;
+}
+
+uint64_t Complete::new_version( void )
+{
+  static uint64_t version_counter = 0;
+  return ++version_counter;
 }
 
 bool Complete::operator==( Complete const &x ) const
 {
   //  assert( parser == x.parser ); /* parser state is irrelevant for us */
-  return (terminal == x.terminal) && (echo_ack == x.echo_ack);
+  if ( version == x.version ) {
+    return true;
+  }
+  return ( (terminal == x.terminal) || (*terminal == *x.terminal) ) && (echo_ack == x.echo_ack);
 }
 
 bool Complete::set_echo_ack( uint64_t now )
@@ -131,26 +554,36 @@ bool Complete::set_echo_ack( uint64_t now )
   bool ret = false;
   uint64_t newest_echo_ack = 0;
 
-  for ( input_history_type::const_iterator i = input_history.begin();
-        i != input_history.end();
+  bool expired = false;
+  for ( input_history_type::const_iterator i = input_history->begin();
+        i != input_history->end();
         i++ ) {
     if ( i->second <= now - ECHO_TIMEOUT ) {
       newest_echo_ack = i->first;
     }
   }
+  for ( input_history_type::const_iterator i = input_history->begin();
+        i != input_history->end();
+        i++ ) {
+    expired |= i->first < newest_echo_ack;
+  }
 
-  for ( input_history_type::iterator i = input_history.begin();
-	i != input_history.end(); ) {
-    input_history_type::iterator i_next = i;
-    i_next++;
-    if ( i->first < newest_echo_ack ) {
-      input_history.erase( i );
+  if ( expired ) {
+    input_history_type &history = get_mutable_input_history();
+    for ( input_history_type::iterator i = history.begin();
+	  i != history.end(); ) {
+      input_history_type::iterator i_next = i;
+      i_next++;
+      if ( i->first < newest_echo_ack ) {
+	history.erase( i );
+      }
+      i = i_next;
     }
-    i = i_next;
   }
 
   if ( echo_ack != newest_echo_ack ) {
     ret = true;
+    version = new_version();
   }
 
   echo_ack = newest_echo_ack;
@@ -160,16 +593,16 @@ bool Complete::set_echo_ack( uint64_t now )
 
 void Complete::register_input_frame( uint64_t n, uint64_t now )
 {
-  input_history.push_back( std::make_pair( n, now ) );
+  get_mutable_input_history().push_back( std::make_pair( n, now ) );
 }
 
 int Complete::wait_time( uint64_t now ) const
 {
-  if ( input_history.size() < 2 ) {
+  if ( input_history->size() < 2 ) {
     return INT_MAX;
   }
 
-  input_history_type::const_iterator it = input_history.begin();
+  input_history_type::const_iterator it = input_history->begin();
   it++;
 
   uint64_t next_echo_ack_time = it->second + ECHO_TIMEOUT;
@@ -182,8 +615,8 @@ int Complete::wait_time( uint64_t now ) const
 bool Complete::compare( const Complete &other ) const
 {
   bool ret = false;
-  const Framebuffer &fb = terminal.get_fb();
-  const Framebuffer &other_fb = other.terminal.get_fb();
+  const Framebuffer &fb = get_fb();
+  const Framebuffer &other_fb = other.get_fb();
   const int height = fb.ds.get_height();
   const int other_height = other_fb.ds.get_height();
   const int width = fb.ds.get_width();
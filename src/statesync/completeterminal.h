@@ -35,49 +35,91 @@
 
 #include <cstdint>
 #include <list>
+#include <memory>
 
 #include "src/terminal/parser.h"
 #include "src/terminal/terminal.h"
 
-/* This class represents the complete terminal -- a UTF8Parser feeding Actions to an Emulator. */
+namespace HostBuffers {
+  class FramePatch;
+}
+
+/* This class represents the complete terminal -- a UTF8Parser feeding Tokens to an Emulator. */
 
 namespace Terminal {
   class Complete {
   private:
     Parser::UTF8Parser parser;
-    Terminal::Emulator terminal;
+    // Copies of a Complete (the transport keeps a history of them)
+    // share the emulator and input history; the first change after a
+    // copy clones the shared part, as Framebuffer does for its rows.
+    std::shared_ptr<Terminal::Emulator> terminal;
     Terminal::Display display;
 
     // Only used locally by act(), but kept here as a performance optimization,
     // to avoid construction/destruction.  It must always be empty
     // outside calls to act() to keep horrible things from happening.
-    Parser::Actions actions;
+    Parser::Tokens tokens;
 
     using input_history_type = std::list<std::pair<uint64_t, uint64_t>>;
-    input_history_type input_history;
+    std::shared_ptr<input_history_type> input_history;
     uint64_t echo_ack;
 
     static const int ECHO_TIMEOUT = 50; /* for late ack */
 
+    // version names what operator== compares: copies share it, and
+    // anything that may change the emulator or echo_ack takes a fresh
+    // one, so states with equal versions are equal.
+    uint64_t version;
+    static uint64_t new_version( void );
+
+    Terminal::Emulator &get_mutable_terminal( void )
+    {
+      version = new_version();
+      if ( terminal.use_count() != 1 ) {
+	terminal = std::make_shared<Terminal::Emulator>( *terminal );
+      }
+      return *terminal;
+    }
+
+    void make_patch( const Framebuffer &existing, HostBuffers::FramePatch &patch ) const;
+    bool apply_patch( const HostBuffers::FramePatch &patch );
+
+    input_history_type &get_mutable_input_history( void )
+    {
+      if ( input_history.use_count() != 1 ) {
+	input_history = std::make_shared<input_history_type>( *input_history );
+      }
+      return *input_history;
+    }
+
   public:
-    Complete( size_t width, size_t height ) : parser(), terminal( width, height ), display( false ),
-					      actions(), input_history(), echo_ack( 0 ) {}
+    Complete( size_t width, size_t height ) : parser(), terminal( std::make_shared<Terminal::Emulator>( width, height ) ),
+					      display( false ), tokens(),
+					      input_history( std::make_shared<input_history_type>() ), echo_ack( 0 ),
+					      version( new_version() ) {}
     
     std::string act( const std::string &str );
     std::string act( const Parser::Action &act );
 
-    const Framebuffer & get_fb( void ) const { return terminal.get_fb(); }
+    const Framebuffer & get_fb( void ) const { return terminal->get_fb(); }
     void reset_input( void ) { parser.reset_input(); }
     uint64_t get_echo_ack( void ) const { return echo_ack; }
     bool set_echo_ack( uint64_t now );
     void register_input_frame( uint64_t n, uint64_t now );
     int wait_time( uint64_t now ) const;
 
+    /* Diff formats apply_string() takes besides terminal output */
+    static const unsigned int FRAME_PATCH = 1; /* HostBuffers::FramePatch */
+    static const unsigned int DIFF_FORMATS = FRAME_PATCH;
+
     /* interface for Network::Transport */
     void subtract( const Complete * ) const {}
-    std::string diff_from( const Complete &existing ) const;
+    std::string diff_from( const Complete &existing, unsigned int formats = 0 ) const;
+    size_t diff_size_estimate( const Complete &existing ) const;
     std::string init_diff( void ) const;
-    void apply_string( const std::string & diff );
+    std::string compression_dictionary( unsigned int formats ) const;
+    bool apply_string( const std::string & diff ); /* false if malformed */
     bool operator==( const Complete &x ) const;
 
     bool compare( const Complete &other ) const;
@@ -34,7 +34,6 @@
 #include <typeinfo>
 
 #include "src/statesync/user.h"
-#include "src/util/fatal_assert.h"
 #include "src/protobufs/userinput.pb.h"
 
 using namespace Parser;
@@ -58,7 +57,7 @@ void UserStream::subtract( const UserStream *prefix )
   }
 }
 
-std::string UserStream::diff_from( const UserStream &existing ) const
+std::string UserStream::diff_from( const UserStream &existing, unsigned int ) const
 {
   std::deque<UserEvent>::const_iterator my_it = actions.begin();
 
@@ -105,10 +104,12 @@ std::string UserStream::diff_from( const UserStream &existing ) const
   return output.SerializeAsString();
 }
 
-void UserStream::apply_string( const std::string &diff )
+bool UserStream::apply_string( const std::string &diff )
 {
   ClientBuffers::UserMessage input;
-  fatal_assert( input.ParseFromString( diff ) );
+  if ( !input.ParseFromString( diff ) ) {
+    return false;
+  }
 
   for ( int i = 0; i < input.instruction_size(); i++ ) {
     if ( input.instruction( i ).HasExtension( keystroke ) ) {
@@ -121,6 +122,8 @@ void UserStream::apply_string( const std::string &diff )
 					    input.instruction( i ).GetExtension( resize ).height() ) ) );
     }
   }
+
+  return true;
 }
 
 const Parser::Action &UserStream::get_action( unsigned int i ) const
@@ -80,9 +80,18 @@ namespace Network {
     
     /* interface for Network::Transport */
     void subtract( const UserStream *prefix );
-    std::string diff_from( const UserStream &existing ) const;
+    static const unsigned int DIFF_FORMATS = 0; /* only the one */
+    std::string diff_from( const UserStream &existing, unsigned int formats = 0 ) const;
+    /* about one byte per keystroke */
+    size_t diff_size_estimate( const UserStream &existing ) const
+    {
+      /* existing can be the longer one after subtract() or out of order */
+      return ( actions.size() > existing.actions.size() ) ? actions.size() - existing.actions.size() : 0;
+    }
     std::string init_diff( void ) const { return diff_from( UserStream() ); };
-    void apply_string( const std::string &diff );
+    /* sender and receiver trim the queue differently */
+    std::string compression_dictionary( unsigned int ) const { return std::string(); }
+    bool apply_string( const std::string &diff );
     bool operator==( const UserStream &x ) const { return actions == x.actions; }
 
     bool compare( const UserStream & ) { return false; }
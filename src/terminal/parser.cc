@@ -34,38 +34,81 @@
 #include <cerrno>
 #include <cstdint>
 #include <cwchar>
-#include <typeinfo>
+#include <memory>
 
 #include "src/terminal/parser.h"
 
-const Parser::StateFamily Parser::family;
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
-static void append_or_delete( Parser::ActionPointer act,
-			      Parser::Actions &vec )
+static void append_token( Parser::Action_Type type, wchar_t ch, bool char_present,
+			  Parser::Tokens &vec )
 {
-  assert( act );
+  if ( type != Parser::IGNORE ) {
+    Parser::Token tok = { type, ch, char_present };
+    vec.push_back( tok );
+  }
+}
 
-  if ( !act->ignore() ) {
-    vec.push_back( act );
+static Parser::ActionPointer make_action( const Parser::Token &tok )
+{
+  Parser::ActionPointer act;
+
+  switch ( tok.type ) {
+  case Parser::PRINT:        act = std::make_shared<Parser::Print>();        break;
+  case Parser::EXECUTE:      act = std::make_shared<Parser::Execute>();      break;
+  case Parser::CLEAR:        act = std::make_shared<Parser::Clear>();        break;
+  case Parser::COLLECT:      act = std::make_shared<Parser::Collect>();      break;
+  case Parser::PARAM:        act = std::make_shared<Parser::Param>();        break;
+  case Parser::ESC_DISPATCH: act = std::make_shared<Parser::Esc_Dispatch>(); break;
+  case Parser::CSI_DISPATCH: act = std::make_shared<Parser::CSI_Dispatch>(); break;
+  case Parser::HOOK:         act = std::make_shared<Parser::Hook>();         break;
+  case Parser::PUT:          act = std::make_shared<Parser::Put>();          break;
+  case Parser::UNHOOK:       act = std::make_shared<Parser::Unhook>();       break;
+  case Parser::OSC_START:    act = std::make_shared<Parser::OSC_Start>();    break;
+  case Parser::OSC_PUT:      act = std::make_shared<Parser::OSC_Put>();      break;
+  case Parser::OSC_END:      act = std::make_shared<Parser::OSC_End>();      break;
+  default:                   act = std::make_shared<Parser::Ignore>();       break;
   }
+
+  act->ch = tok.ch;
+  act->char_present = tok.char_present;
+  return act;
 }
 
-void Parser::Parser::input( wchar_t ch, Actions &ret )
+static void append_actions( const Parser::Tokens &tokens, Parser::Actions &vec )
 {
-  Transition tx = state->input( ch );
+  for ( Parser::Tokens::const_iterator i = tokens.begin();
+	i != tokens.end();
+	i++ ) {
+    vec.push_back( make_action( *i ) );
+  }
+}
 
-  if ( tx.next_state != NULL ) {
-    append_or_delete( state->exit(), ret );
+void Parser::Parser::input( wchar_t ch, Tokens &ret )
+{
+  const Transition &tx = StateFamily::input( state, ch );
+
+  if ( tx.next_state != NO_STATE ) {
+    append_token( StateFamily::exit( state ), -1, false, ret );
   }
 
-  append_or_delete( tx.action, ret );
+  append_token( tx.action, ch, true, ret );
 
-  if ( tx.next_state != NULL ) {
-    append_or_delete( tx.next_state->enter(), ret );
+  if ( tx.next_state != NO_STATE ) {
+    append_token( StateFamily::enter( tx.next_state ), -1, false, ret );
     state = tx.next_state;
   }
 }
 
+void Parser::Parser::input( wchar_t ch, Actions &ret )
+{
+  Tokens tokens;
+  input( ch, tokens );
+  append_actions( tokens, ret );
+}
+
 Parser::UTF8Parser::UTF8Parser()
   : parser(), buf_len( 0 )
 {
@@ -74,6 +117,13 @@ Parser::UTF8Parser::UTF8Parser()
 }
 
 void Parser::UTF8Parser::input( char c, Actions &ret )
+{
+  Tokens tokens;
+  input( c, tokens );
+  append_actions( tokens, ret );
+}
+
+void Parser::UTF8Parser::input( char c, Tokens &ret )
 {
   assert( buf_len < BUF_SIZE );
 
@@ -155,6 +205,36 @@ void Parser::UTF8Parser::input( char c, Actions &ret )
   }
 }
 
+size_t Parser::UTF8Parser::printable_run( const char *str, size_t len ) const
+{
+  if ( buf_len != 0 || !parser.in_ground_state() ) {
+    return 0;
+  }
+
+  size_t i = 0;
+
+#if __SSE2__
+  /* classify 16 bytes at a time: 0x20 <= c < 0x7f, as signed chars */
+  const __m128i lo = _mm_set1_epi8( 0x1f );
+  const __m128i hi = _mm_set1_epi8( 0x7f );
+  while ( i + 16 <= len ) {
+    const __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i *>( str + i ) );
+    const __m128i ok = _mm_and_si128( _mm_cmpgt_epi8( v, lo ), _mm_cmplt_epi8( v, hi ) );
+    const unsigned int mask = _mm_movemask_epi8( ok );
+    if ( mask != 0xffff ) {
+      return i + __builtin_ctz( ~mask );
+    }
+    i += 16;
+  }
+#endif
+
+  while ( i < len && str[ i ] >= 0x20 && str[ i ] < 0x7f ) {
+    i++;
+  }
+
+  return i;
+}
+
 Parser::Parser::Parser( const Parser &other )
   : state( other.state )
 {}
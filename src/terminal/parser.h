@@ -39,32 +39,32 @@
 #include <cstring>
 #include <cwchar>
 
-#include "parsertransition.h"
 #include "src/terminal/parseraction.h"
 #include "parserstate.h"
 #include "parserstatefamily.h"
 
 namespace Parser {
-  extern const StateFamily family;
-
   class Parser {
   private:
-    State const *state;
+    State_Id state;
 
   public:
-    Parser() : state( &family.s_Ground ) {}
+    Parser() : state( STATE_GROUND ) {}
 
     Parser( const Parser &other );
     Parser & operator=( const Parser & );
     ~Parser() {}
 
+    void input( wchar_t ch, Tokens &tokens );
     void input( wchar_t ch, Actions &actions );
 
     void reset_input( void )
     {
-      state = &family.s_Ground;
+      state = STATE_GROUND;
     }
 
+    bool in_ground_state( void ) const { return state == STATE_GROUND; }
+
   };
 
   static const size_t BUF_SIZE = 8;
@@ -79,8 +79,14 @@ namespace Parser {
   public:
     UTF8Parser();
 
+    void input( char c, Tokens &tokens );
     void input( char c, Actions &actions );
 
+    /* Length of the run of printable ASCII at the start of str that
+       would parse to nothing but Print actions, or 0 if the parser is
+       not idle in the ground state. */
+    size_t printable_run( const char *str, size_t len ) const;
+
     void reset_input( void )
     {
       parser.reset_input();
@@ -30,6 +30,7 @@
     also delete it here.
 */
 
+#include <cassert>
 #include <cstdio>
 #include <cwctype>
 
@@ -38,54 +39,78 @@
 
 using namespace Parser;
 
+void Token::act_on_terminal( Terminal::Emulator *emu ) const
+{
+  switch ( type ) {
+  case PRINT:        emu->print( ch );                  break;
+  case EXECUTE:      emu->execute( ch );                break;
+  case CLEAR:        emu->dispatch.clear();             break;
+  case PARAM:        emu->dispatch.newparamchar( ch );  break;
+  case COLLECT:      emu->dispatch.collect( ch );       break;
+  case CSI_DISPATCH: emu->CSI_dispatch( ch );           break;
+  case ESC_DISPATCH: emu->Esc_dispatch( ch );           break;
+  case OSC_PUT:      emu->dispatch.OSC_put( ch );       break;
+  case OSC_START:    emu->dispatch.OSC_start();         break;
+  case OSC_END:      emu->OSC_end();                    break;
+  default: /* Ignore, Hook, Put, Unhook */              break;
+  }
+}
+
 void Print::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->print( this );
+  assert( char_present );
+  emu->print( ch );
 }
 
 void Execute::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->execute( this );
+  assert( char_present );
+  emu->execute( ch );
 }
 
 void Clear::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->dispatch.clear( this );
+  emu->dispatch.clear();
 }
 
 void Param::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->dispatch.newparamchar( this );
+  assert( char_present );
+  emu->dispatch.newparamchar( ch );
 }
 
 void Collect::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->dispatch.collect( this );
+  assert( char_present );
+  emu->dispatch.collect( ch );
 }
 
 void CSI_Dispatch::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->CSI_dispatch( this );
+  assert( char_present );
+  emu->CSI_dispatch( ch );
 }
 
 void Esc_Dispatch::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->Esc_dispatch( this );
+  assert( char_present );
+  emu->Esc_dispatch( ch );
 }
 
 void OSC_Put::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->dispatch.OSC_put( this );
+  assert( char_present );
+  emu->dispatch.OSC_put( ch );
 }
 
 void OSC_Start::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->dispatch.OSC_start( this );
+  emu->dispatch.OSC_start();
 }
 
 void OSC_End::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->OSC_end( this );
+  emu->OSC_end();
 }
 
 void UserByte::act_on_terminal( Terminal::Emulator *emu ) const
@@ -94,6 +119,15 @@ void UserByte::act_on_terminal( Terminal::Emulator *emu ) const
 							  emu->fb.ds.application_mode_cursor_keys ) );
 }
 
+bool UserByte::act_on_const_terminal( const Terminal::Emulator *emu, std::string &to_host ) const
+{
+  if ( !emu->user.passes_through( this ) ) {
+    return false;
+  }
+  to_host.assign( &c, 1 );
+  return true;
+}
+
 void Resize::act_on_terminal( Terminal::Emulator *emu ) const
 {
   emu->resize( width, height );
@@ -42,6 +42,27 @@ namespace Terminal {
 }
 
 namespace Parser {
+  /* The host-source actions of the X.364 state machine, as plain values.
+     The parser emits these into a caller-owned Tokens vector, so that
+     (once the vector has grown) parsing allocates nothing per byte. */
+  enum Action_Type : unsigned char {
+    IGNORE, PRINT, EXECUTE, CLEAR, COLLECT, PARAM,
+    ESC_DISPATCH, CSI_DISPATCH, HOOK, PUT, UNHOOK,
+    OSC_START, OSC_PUT, OSC_END
+  };
+
+  struct Token {
+    Action_Type type;
+    wchar_t ch;
+    bool char_present;
+
+    void act_on_terminal( Terminal::Emulator *emu ) const;
+  };
+
+  using Tokens = std::vector<Token>;
+
+  /* The Action class hierarchy remains as an adapter over Tokens
+     for users that want named, heap-allocated actions. */
   class Action
   {
   public:
@@ -51,6 +72,9 @@ namespace Parser {
     virtual std::string name( void ) = 0;
 
     virtual void act_on_terminal( Terminal::Emulator * ) const {};
+    /* Acts without changing the emulator, if this action can: sets the
+       octets for the host and returns true, else returns false. */
+    virtual bool act_on_const_terminal( const Terminal::Emulator *, std::string & ) const { return false; }
 
     virtual bool ignore() const { return false; }
 
@@ -133,6 +157,7 @@ namespace Parser {
 
     std::string name( void ) { return std::string( "UserByte" ); }
     void act_on_terminal( Terminal::Emulator *emu ) const;
+    bool act_on_const_terminal( const Terminal::Emulator *emu, std::string &to_host ) const;
 
     UserByte( int s_c ) : c( s_c ) {}
 
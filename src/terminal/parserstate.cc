@@ -30,93 +30,68 @@
     also delete it here.
 */
 
-#include <memory>
-
-#include "parserstate.h"
 #include "parserstatefamily.h"
 
 using namespace Parser;
 
-Transition State::anywhere_rule( wchar_t ch ) const
+static constexpr Transition anywhere_rule( wchar_t ch )
 {
   if ( (ch == 0x18) || (ch == 0x1A)
        || ((0x80 <= ch) && (ch <= 0x8F))
        || ((0x91 <= ch) && (ch <= 0x97))
        || (ch == 0x99) || (ch == 0x9A) ) {
-    return Transition( std::make_shared<Execute>(), &family->s_Ground );
+    return Transition( EXECUTE, STATE_GROUND );
   } else if ( ch == 0x9C ) {
-    return Transition( &family->s_Ground );
+    return Transition( STATE_GROUND );
   } else if ( ch == 0x1B ) {
-    return Transition( &family->s_Escape );
+    return Transition( STATE_ESCAPE );
   } else if ( (ch == 0x98) || (ch == 0x9E) || (ch == 0x9F) ) {
-    return Transition( &family->s_SOS_PM_APC_String );
+    return Transition( STATE_SOS_PM_APC_STRING );
   } else if ( ch == 0x90 ) {
-    return Transition( &family->s_DCS_Entry );
+    return Transition( STATE_DCS_ENTRY );
   } else if ( ch == 0x9D ) {
-    return Transition( &family->s_OSC_String );
+    return Transition( STATE_OSC_STRING );
   } else if ( ch == 0x9B ) {
-    return Transition( &family->s_CSI_Entry );
+    return Transition( STATE_CSI_ENTRY );
   }
 
-  return Transition(( State * )NULL, ActionPointer() ); /* don't allocate an Ignore action */
-}
-
-Transition State::input( wchar_t ch ) const
-{
-  /* Check for immediate transitions. */
-  Transition anywhere = anywhere_rule( ch );
-  if ( anywhere.next_state ) {
-    anywhere.action->char_present = true;
-    anywhere.action->ch = ch;
-    return anywhere;
-  }
-  /* Normal X.364 state machine. */
-  /* Parse high Unicode codepoints like 'A'. */
-  Transition ret = this->input_state_rule( ch >= 0xA0 ? 0x41 : ch );
-  ret.action->char_present = true;
-  ret.action->ch = ch;
-  return ret;
+  return Transition();
 }
 
-static bool C0_prime( wchar_t ch )
+static constexpr bool C0_prime( wchar_t ch )
 {
   return (ch <= 0x17)
     || (ch == 0x19)
     || ( (0x1C <= ch) && (ch <= 0x1F) );
 }
 
-static bool GLGR ( wchar_t ch )
+static constexpr bool GLGR ( wchar_t ch )
 {
   return ( (0x20 <= ch) && (ch <= 0x7F) ) /* GL area */
     || ( (0xA0 <= ch) && (ch <= 0xFF) ); /* GR area */
 }
 
-Transition Ground::input_state_rule( wchar_t ch ) const
+static constexpr Transition ground_rule( wchar_t ch )
 {
   if ( C0_prime( ch ) ) {
-    return Transition( std::make_shared<Execute>() );
+    return Transition( EXECUTE );
   }
 
   if ( GLGR( ch ) ) {
-    return Transition( std::make_shared<Print>() );
+    return Transition( PRINT );
   }
 
   return Transition();
 }
 
-ActionPointer Escape::enter( void ) const
-{
-  return std::make_shared<Clear>();
-}
-
-Transition Escape::input_state_rule( wchar_t ch ) const
+static constexpr Transition escape_rule( wchar_t ch )
 {
   if ( C0_prime( ch ) ) {
-    return Transition( std::make_shared<Execute>() );
+    return Transition( EXECUTE );
   }
 
   if ( (0x20 <= ch) && (ch <= 0x2F) ) {
-    return Transition( std::make_shared<Collect>(), &family->s_Escape_Intermediate );
+    return Transition( COLLECT, STATE_ESCAPE_INTERMEDIATE );
   }
 
   if ( ( (0x30 <= ch) && (ch <= 0x4F) )
@@ -125,267 +100,316 @@ Transition Escape::input_state_rule( wchar_t ch ) const
        || ( ch == 0x5A )
        || ( ch == 0x5C )
        || ( (0x60 <= ch) && (ch <= 0x7E) ) ) {
-    return Transition( std::make_shared<Esc_Dispatch>(), &family->s_Ground );
+    return Transition( ESC_DISPATCH, STATE_GROUND );
   }
 
   if ( ch == 0x5B ) {
-    return Transition( &family->s_CSI_Entry );
+    return Transition( STATE_CSI_ENTRY );
   }
 
   if ( ch == 0x5D ) {
-    return Transition( &family->s_OSC_String );
+    return Transition( STATE_OSC_STRING );
   }
 
   if ( ch == 0x50 ) {
-    return Transition( &family->s_DCS_Entry );
+    return Transition( STATE_DCS_ENTRY );
   }
 
   if ( (ch == 0x58) || (ch == 0x5E) || (ch == 0x5F) ) {
-    return Transition( &family->s_SOS_PM_APC_String );
+    return Transition( STATE_SOS_PM_APC_STRING );
   }
 
   return Transition();
 }
 
-Transition Escape_Intermediate::input_state_rule( wchar_t ch ) const
+static constexpr Transition escape_intermediate_rule( wchar_t ch )
 {
   if ( C0_prime( ch ) ) {
-    return Transition( std::make_shared<Execute>() );
+    return Transition( EXECUTE );
   }
 
   if ( (0x20 <= ch) && (ch <= 0x2F) ) {
-    return Transition( std::make_shared<Collect>() );
+    return Transition( COLLECT );
   }
 
   if ( (0x30 <= ch) && (ch <= 0x7E) ) {
-    return Transition( std::make_shared<Esc_Dispatch>(), &family->s_Ground );
+    return Transition( ESC_DISPATCH, STATE_GROUND );
   }
 
   return Transition();
 }
 
-ActionPointer CSI_Entry::enter( void ) const
-{
-  return std::make_shared<Clear>();
-}
-
-Transition CSI_Entry::input_state_rule( wchar_t ch ) const
+static constexpr Transition csi_entry_rule( wchar_t ch )
 {
   if ( C0_prime( ch ) ) {
-    return Transition( std::make_shared<Execute>() );
+    return Transition( EXECUTE );
   }
 
   if ( (0x40 <= ch) && (ch <= 0x7E) ) {
-    return Transition( std::make_shared<CSI_Dispatch>(), &family->s_Ground );
+    return Transition( CSI_DISPATCH, STATE_GROUND );
   }
 
   if ( ( (0x30 <= ch) && (ch <= 0x39) )
        || ( ch == 0x3B ) ) {
-    return Transition( std::make_shared<Param>(), &family->s_CSI_Param );
+    return Transition( PARAM, STATE_CSI_PARAM );
   }
 
   if ( (0x3C <= ch) && (ch <= 0x3F) ) {
-    return Transition( std::make_shared<Collect>(), &family->s_CSI_Param );
+    return Transition( COLLECT, STATE_CSI_PARAM );
   }
 
   if ( ch == 0x3A ) {
-    return Transition( &family->s_CSI_Ignore );
+    return Transition( STATE_CSI_IGNORE );
   }
 
   if ( (0x20 <= ch) && (ch <= 0x2F) ) {
-    return Transition( std::make_shared<Collect>(), &family->s_CSI_Intermediate );
+    return Transition( COLLECT, STATE_CSI_INTERMEDIATE );
   }
 
   return Transition();
 }
 
-Transition CSI_Param::input_state_rule( wchar_t ch ) const
+static constexpr Transition csi_param_rule( wchar_t ch )
 {
   if ( C0_prime( ch ) ) {
-    return Transition( std::make_shared<Execute>() );
+    return Transition( EXECUTE );
   }
 
   if ( ( (0x30 <= ch) && (ch <= 0x39) ) || ( ch == 0x3B ) ) {
-    return Transition( std::make_shared<Param>() );
+    return Transition( PARAM );
   }
 
   if ( ( ch == 0x3A ) || ( (0x3C <= ch) && (ch <= 0x3F) ) ) {
-    return Transition( &family->s_CSI_Ignore );
+    return Transition( STATE_CSI_IGNORE );
   }
 
   if ( (0x20 <= ch) && (ch <= 0x2F) ) {
-    return Transition( std::make_shared<Collect>(), &family->s_CSI_Intermediate );
+    return Transition( COLLECT, STATE_CSI_INTERMEDIATE );
   }
 
   if ( (0x40 <= ch) && (ch <= 0x7E) ) {
-    return Transition( std::make_shared<CSI_Dispatch>(), &family->s_Ground );
+    return Transition( CSI_DISPATCH, STATE_GROUND );
   }
 
   return Transition();
 }
 
-Transition CSI_Intermediate::input_state_rule( wchar_t ch ) const
+static constexpr Transition csi_intermediate_rule( wchar_t ch )
 {
   if ( C0_prime( ch ) ) {
-    return Transition( std::make_shared<Execute>() );
+    return Transition( EXECUTE );
   }
 
   if ( (0x20 <= ch) && (ch <= 0x2F) ) {
-    return Transition( std::make_shared<Collect>() );
+    return Transition( COLLECT );
   }
 
   if ( (0x40 <= ch) && (ch <= 0x7E) ) {
-    return Transition( std::make_shared<CSI_Dispatch>(), &family->s_Ground );
+    return Transition( CSI_DISPATCH, STATE_GROUND );
   }
 
   if ( (0x30 <= ch) && (ch <= 0x3F) ) {
-    return Transition( &family->s_CSI_Ignore );
+    return Transition( STATE_CSI_IGNORE );
   }
 
   return Transition();
 }
 
-Transition CSI_Ignore::input_state_rule( wchar_t ch ) const
+static constexpr Transition csi_ignore_rule( wchar_t ch )
 {
   if ( C0_prime( ch ) ) {
-    return Transition( std::make_shared<Execute>() );
+    return Transition( EXECUTE );
   }
 
   if ( (0x40 <= ch) && (ch <= 0x7E) ) {
-    return Transition( &family->s_Ground );
+    return Transition( STATE_GROUND );
   }
 
   return Transition();
 }
 
-ActionPointer DCS_Entry::enter( void ) const
-{
-  return std::make_shared<Clear>();
-}
-
-Transition DCS_Entry::input_state_rule( wchar_t ch ) const
+static constexpr Transition dcs_entry_rule( wchar_t ch )
 {
   if ( (0x20 <= ch) && (ch <= 0x2F) ) {
-    return Transition( std::make_shared<Collect>(), &family->s_DCS_Intermediate );
+    return Transition( COLLECT, STATE_DCS_INTERMEDIATE );
   }
 
   if ( ch == 0x3A ) {
-    return Transition( &family->s_DCS_Ignore );
+    return Transition( STATE_DCS_IGNORE );
   }
 
   if ( ( (0x30 <= ch) && (ch <= 0x39) ) || ( ch == 0x3B ) ) {
-    return Transition( std::make_shared<Param>(), &family->s_DCS_Param );
+    return Transition( PARAM, STATE_DCS_PARAM );
   }
 
   if ( (0x3C <= ch) && (ch <= 0x3F) ) {
-    return Transition( std::make_shared<Collect>(), &family->s_DCS_Param );
+    return Transition( COLLECT, STATE_DCS_PARAM );
   }
 
   if ( (0x40 <= ch) && (ch <= 0x7E) ) {
-    return Transition( &family->s_DCS_Passthrough );
+    return Transition( STATE_DCS_PASSTHROUGH );
   }
 
   return Transition();
 }
 
-Transition DCS_Param::input_state_rule( wchar_t ch ) const
+static constexpr Transition dcs_param_rule( wchar_t ch )
 {
   if ( ( (0x30 <= ch) && (ch <= 0x39) ) || ( ch == 0x3B ) ) {
-    return Transition( std::make_shared<Param>() );
+    return Transition( PARAM );
   }
 
   if ( ( ch == 0x3A ) || ( (0x3C <= ch) && (ch <= 0x3F) ) ) {
-    return Transition( &family->s_DCS_Ignore );
+    return Transition( STATE_DCS_IGNORE );
   }
 
   if ( (0x20 <= ch) && (ch <= 0x2F) ) {
-    return Transition( std::make_shared<Collect>(), &family->s_DCS_Intermediate );
+    return Transition( COLLECT, STATE_DCS_INTERMEDIATE );
   }
 
   if ( (0x40 <= ch) && (ch <= 0x7E) ) {
-    return Transition( &family->s_DCS_Passthrough );
+    return Transition( STATE_DCS_PASSTHROUGH );
   }
 
   return Transition();
 }
 
-Transition DCS_Intermediate::input_state_rule( wchar_t ch ) const
+static constexpr Transition dcs_intermediate_rule( wchar_t ch )
 {
   if ( (0x20 <= ch) && (ch <= 0x2F) ) {
-    return Transition( std::make_shared<Collect>() );
+    return Transition( COLLECT );
   }
 
   if ( (0x40 <= ch) && (ch <= 0x7E) ) {
-    return Transition( &family->s_DCS_Passthrough );
+    return Transition( STATE_DCS_PASSTHROUGH );
   }
 
   if ( (0x30 <= ch) && (ch <= 0x3F) ) {
-    return Transition( &family->s_DCS_Ignore );
+    return Transition( STATE_DCS_IGNORE );
   }
 
   return Transition();
 }
 
-ActionPointer DCS_Passthrough::enter( void ) const
+static constexpr Transition dcs_passthrough_rule( wchar_t ch )
 {
-  return std::make_shared<Hook>();
+  if ( C0_prime( ch ) || ( (0x20 <= ch) && (ch <= 0x7E) ) ) {
+    return Transition( PUT );
+  }
+
+  if ( ch == 0x9C ) {
+    return Transition( STATE_GROUND );
+  }
+
+  return Transition();
 }
 
-ActionPointer DCS_Passthrough::exit( void ) const
+static constexpr Transition dcs_ignore_rule( wchar_t ch )
 {
-  return std::make_shared<Unhook>();
+  if ( ch == 0x9C ) {
+    return Transition( STATE_GROUND );
+  }
+
+  return Transition();
 }
 
-Transition DCS_Passthrough::input_state_rule( wchar_t ch ) const
+static constexpr Transition osc_string_rule( wchar_t ch )
 {
-  if ( C0_prime( ch ) || ( (0x20 <= ch) && (ch <= 0x7E) ) ) {
-    return Transition( std::make_shared<Put>() );
+  if ( (0x20 <= ch) && (ch <= 0x7F) ) {
+    return Transition( OSC_PUT );
   }
 
-  if ( ch == 0x9C ) {
-    return Transition( &family->s_Ground );
+  if ( (ch == 0x9C) || (ch == 0x07) ) { /* 0x07 is xterm non-ANSI variant */
+    return Transition( STATE_GROUND );
   }
 
   return Transition();
 }
 
-Transition DCS_Ignore::input_state_rule( wchar_t ch ) const
+static constexpr Transition sos_pm_apc_string_rule( wchar_t ch )
 {
   if ( ch == 0x9C ) {
-    return Transition( &family->s_Ground );
+    return Transition( STATE_GROUND );
   }
 
   return Transition();
 }
 
-ActionPointer OSC_String::enter( void ) const
+static constexpr Transition state_rule( State_Id state, wchar_t ch )
 {
-  return std::make_shared<OSC_Start>();
+  /* Check for immediate transitions. */
+  const Transition anywhere = anywhere_rule( ch );
+  if ( anywhere.next_state != NO_STATE ) {
+    return anywhere;
+  }
+
+  /* Normal X.364 state machine. */
+  switch ( state ) {
+  case STATE_GROUND:               return ground_rule( ch );
+  case STATE_ESCAPE:               return escape_rule( ch );
+  case STATE_ESCAPE_INTERMEDIATE:  return escape_intermediate_rule( ch );
+  case STATE_CSI_ENTRY:            return csi_entry_rule( ch );
+  case STATE_CSI_PARAM:            return csi_param_rule( ch );
+  case STATE_CSI_INTERMEDIATE:     return csi_intermediate_rule( ch );
+  case STATE_CSI_IGNORE:           return csi_ignore_rule( ch );
+  case STATE_DCS_ENTRY:            return dcs_entry_rule( ch );
+  case STATE_DCS_PARAM:            return dcs_param_rule( ch );
+  case STATE_DCS_INTERMEDIATE:     return dcs_intermediate_rule( ch );
+  case STATE_DCS_PASSTHROUGH:      return dcs_passthrough_rule( ch );
+  case STATE_DCS_IGNORE:           return dcs_ignore_rule( ch );
+  case STATE_OSC_STRING:           return osc_string_rule( ch );
+  case STATE_SOS_PM_APC_STRING:    return sos_pm_apc_string_rule( ch );
+  default:                         return Transition();
+  }
 }
 
-ActionPointer OSC_String::exit( void ) const
+static constexpr StateFamily::table_type make_table( void )
 {
-  return std::make_shared<OSC_End>();
+  StateFamily::table_type table {};
+
+  for ( size_t state = 0; state < NUM_STATES; state++ ) {
+    for ( size_t ch = 0; ch < StateFamily::NUM_INPUT_CLASSES; ch++ ) {
+      table[ state ][ ch ] = state_rule( static_cast<State_Id>( state ), ch );
+    }
+  }
+
+  return table;
 }
 
-Transition OSC_String::input_state_rule( wchar_t ch ) const
+static constexpr StateFamily::state_actions_type make_entry_actions( void )
 {
-  if ( (0x20 <= ch) && (ch <= 0x7F) ) {
-    return Transition( std::make_shared<OSC_Put>() );
-  }
+  StateFamily::state_actions_type actions {};
 
-  if ( (ch == 0x9C) || (ch == 0x07) ) { /* 0x07 is xterm non-ANSI variant */
-    return Transition( &family->s_Ground );
+  for ( size_t state = 0; state < NUM_STATES; state++ ) {
+    actions[ state ] = IGNORE;
   }
+  actions[ STATE_ESCAPE ] = CLEAR;
+  actions[ STATE_CSI_ENTRY ] = CLEAR;
+  actions[ STATE_DCS_ENTRY ] = CLEAR;
+  actions[ STATE_DCS_PASSTHROUGH ] = HOOK;
+  actions[ STATE_OSC_STRING ] = OSC_START;
 
-  return Transition();
+  return actions;
 }
 
-Transition SOS_PM_APC_String::input_state_rule( wchar_t ch ) const
+static constexpr StateFamily::state_actions_type make_exit_actions( void )
 {
-  if ( ch == 0x9C ) {
-    return Transition( &family->s_Ground );
+  StateFamily::state_actions_type actions {};
+
+  for ( size_t state = 0; state < NUM_STATES; state++ ) {
+    actions[ state ] = IGNORE;
   }
+  actions[ STATE_DCS_PASSTHROUGH ] = UNHOOK;
+  actions[ STATE_OSC_STRING ] = OSC_END;
 
-  return Transition();
+  return actions;
 }
+
+/* constexpr copies guarantee the tables are built by the compiler */
+static constexpr StateFamily::table_type built_table = make_table();
+static constexpr StateFamily::state_actions_type built_entry_actions = make_entry_actions();
+static constexpr StateFamily::state_actions_type built_exit_actions = make_exit_actions();
+
+const StateFamily::table_type StateFamily::table = built_table;
+const StateFamily::state_actions_type StateFamily::entry_actions = built_entry_actions;
+const StateFamily::state_actions_type StateFamily::exit_actions = built_exit_actions;
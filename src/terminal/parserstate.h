@@ -30,89 +30,36 @@
     also delete it here.
 */
 
+
 #ifndef PARSERSTATE_HPP
 #define PARSERSTATE_HPP
 
-#include "parsertransition.h"
-
 namespace Parser {
-  class StateFamily;
-
-  class State
-  {
-  protected:
-    virtual Transition input_state_rule( wchar_t ch ) const = 0;
-    StateFamily *family;
-
-  private:
-    Transition anywhere_rule( wchar_t ch ) const;
-
-  public:
-    void setfamily( StateFamily *s_family ) { family = s_family; }
-    Transition input( wchar_t ch ) const;
-    virtual ActionPointer enter( void ) const { return std::make_shared<Ignore>(); }
-    virtual ActionPointer exit( void ) const { return std::make_shared<Ignore>(); }
-
-    State() : family( NULL ) {};
-    virtual ~State() {};
-
-    State( const State & );
-    State & operator=( const State & );
-  };
-
-  class Ground : public State {
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-
-  class Escape : public State {
-    ActionPointer enter( void ) const;
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-
-  class Escape_Intermediate : public State {
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-
-  class CSI_Entry : public State {
-    ActionPointer enter( void ) const;
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-  class CSI_Param : public State {
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-  class CSI_Intermediate : public State {
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-  class CSI_Ignore : public State {
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-  
-  class DCS_Entry : public State {
-    ActionPointer enter( void ) const;
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-  class DCS_Param : public State {
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-  class DCS_Intermediate : public State {
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-  class DCS_Passthrough : public State {
-    ActionPointer enter( void ) const;
-    Transition input_state_rule( wchar_t ch ) const;
-    ActionPointer exit( void ) const;
-  };
-  class DCS_Ignore : public State {
-    Transition input_state_rule( wchar_t ch ) const;
-  };
-
-  class OSC_String : public State {
-    ActionPointer enter( void ) const;
-    Transition input_state_rule( wchar_t ch ) const;
-    ActionPointer exit( void ) const;
-  };
-  class SOS_PM_APC_String : public State {
-    Transition input_state_rule( wchar_t ch ) const;
+  /* The states of Paul Williams's DEC/ANSI parser. The rules for
+     each state live in parserstate.cc, where they are expanded at
+     compile time into the transition table held by StateFamily. */
+  enum State_Id : unsigned char {
+    STATE_GROUND,
+
+    STATE_ESCAPE,
+    STATE_ESCAPE_INTERMEDIATE,
+
+    STATE_CSI_ENTRY,
+    STATE_CSI_PARAM,
+    STATE_CSI_INTERMEDIATE,
+    STATE_CSI_IGNORE,
+
+    STATE_DCS_ENTRY,
+    STATE_DCS_PARAM,
+    STATE_DCS_INTERMEDIATE,
+    STATE_DCS_PASSTHROUGH,
+    STATE_DCS_IGNORE,
+
+    STATE_OSC_STRING,
+    STATE_SOS_PM_APC_STRING,
+
+    NUM_STATES,
+    NO_STATE = NUM_STATES /* transition stays in the current state */
   };
 }
 
@@ -33,53 +33,38 @@
 #ifndef PARSERSTATEFAMILY_HPP
 #define PARSERSTATEFAMILY_HPP
 
-#include "parserstate.h"
+#include <array>
+#include <cstdint>
+
+#include "parsertransition.h"
 
 namespace Parser {
+  /* The whole state machine as flat arrays, generated at compile time
+     in parserstate.cc. */
   class StateFamily
   {
   public:
-    Ground s_Ground;
-
-    Escape s_Escape;
-    Escape_Intermediate s_Escape_Intermediate;
-
-    CSI_Entry s_CSI_Entry;
-    CSI_Param s_CSI_Param;
-    CSI_Intermediate s_CSI_Intermediate;
-    CSI_Ignore s_CSI_Ignore;
+    /* Codepoints from 0xA0 up parse like 'A', so the table only
+       needs to cover C0, GL and C1. */
+    static const size_t NUM_INPUT_CLASSES = 0xA0;
 
-    DCS_Entry s_DCS_Entry;
-    DCS_Param s_DCS_Param;
-    DCS_Intermediate s_DCS_Intermediate;
-    DCS_Passthrough s_DCS_Passthrough;
-    DCS_Ignore s_DCS_Ignore;
+    using table_type = std::array<std::array<Transition, NUM_INPUT_CLASSES>, NUM_STATES>;
+    using state_actions_type = std::array<Action_Type, NUM_STATES>;
 
-    OSC_String s_OSC_String;
-    SOS_PM_APC_String s_SOS_PM_APC_String;
+  private:
+    static const table_type table;
+    static const state_actions_type entry_actions;
+    static const state_actions_type exit_actions;
 
-    StateFamily()
-      : s_Ground(), s_Escape(), s_Escape_Intermediate(),
-	s_CSI_Entry(), s_CSI_Param(), s_CSI_Intermediate(), s_CSI_Ignore(),
-	s_DCS_Entry(), s_DCS_Param(), s_DCS_Intermediate(),
-	s_DCS_Passthrough(), s_DCS_Ignore(),
-	s_OSC_String(), s_SOS_PM_APC_String()
+  public:
+    static const Transition &input( State_Id state, wchar_t ch )
     {
-      s_Ground.setfamily( this );
-      s_Escape.setfamily( this );
-      s_Escape_Intermediate.setfamily( this );
-      s_CSI_Entry.setfamily( this );
-      s_CSI_Param.setfamily( this );
-      s_CSI_Intermediate.setfamily( this );
-      s_CSI_Ignore.setfamily( this );
-      s_DCS_Entry.setfamily( this );
-      s_DCS_Param.setfamily( this );
-      s_DCS_Intermediate.setfamily( this );
-      s_DCS_Passthrough.setfamily( this );
-      s_DCS_Ignore.setfamily( this );
-      s_OSC_String.setfamily( this );
-      s_SOS_PM_APC_String.setfamily( this );
+      const uint32_t c = ch;
+      return table[ state ][ c < NUM_INPUT_CLASSES ? c : 0x41 ];
     }
+
+    static Action_Type enter( State_Id state ) { return entry_actions[ state ]; }
+    static Action_Type exit( State_Id state ) { return exit_actions[ state ]; }
   };
 }
 
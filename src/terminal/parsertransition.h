@@ -33,39 +33,21 @@
 #ifndef PARSERTRANSITION_HPP
 #define PARSERTRANSITION_HPP
 
-#include <cstdlib>
-
 #include "src/terminal/parseraction.h"
+#include "parserstate.h"
 
 namespace Parser {
-  class State;
-
   class Transition
   {
   public:
-    // Transition is only a courier for an Action; it should
-    // never create/delete one on its own.
-    ActionPointer action;
-    State *next_state;
-
-    Transition( const Transition &x )
-      : action( x.action ),
-	next_state( x.next_state ) {}
-    Transition & operator=( const Transition &t )
-    {
-      action = t.action;
-      next_state = t.next_state;
+    Action_Type action;
+    State_Id next_state;
 
-      return *this;
-    }
-    Transition( ActionPointer s_action = std::make_shared<Ignore>(), State *s_next_state=NULL )
+    constexpr Transition( Action_Type s_action = IGNORE, State_Id s_next_state = NO_STATE )
       : action( s_action ), next_state( s_next_state )
     {}
 
-    // This is only ever used in the 1-argument form;
-    // we use this instead of an initializer to
-    // tell Coverity the object never owns *action.
-    Transition( State *s_next_state, ActionPointer s_action = std::make_shared<Ignore>() )
+    constexpr Transition( State_Id s_next_state, Action_Type s_action = IGNORE )
       : action( s_action ), next_state( s_next_state )
     {}
   };
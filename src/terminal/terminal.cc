@@ -52,17 +52,13 @@ std::string Emulator::read_octets_to_host( void )
   return ret;
 }
 
-void Emulator::execute( const Parser::Execute *act )
+void Emulator::execute( wchar_t ch )
 {
-  dispatch.dispatch( CONTROL, act, &fb );
+  dispatch.dispatch( CONTROL, ch, &fb );
 }
 
-void Emulator::print( const Parser::Print *act )
+void Emulator::print( wchar_t ch )
 {
-  assert( act->char_present );
-
-  const wchar_t ch = act->ch;
-
   /*
    * Check for printing ISO 8859-1 first, it's a cheap way to detect
    * some common narrow characters.
@@ -148,27 +144,68 @@ void Emulator::print( const Parser::Print *act )
   }
 }
 
-void Emulator::CSI_dispatch( const Parser::CSI_Dispatch *act )
+void Emulator::print_ascii_run( const char *str, size_t len )
+{
+  while ( len > 0 ) {
+    if ( fb.ds.insert_mode ) {
+      print( static_cast<unsigned char>( *str ) );
+      str++;
+      len--;
+      continue;
+    }
+
+    if ( fb.ds.auto_wrap_mode && fb.ds.next_print_will_wrap ) {
+      fb.get_mutable_row( -1 )->set_wrap( true );
+      fb.ds.move_col( 0 );
+      fb.move_rows_autoscroll( 1 );
+    }
+
+    /* fill as much of the current row as the run covers, with one
+       copy-on-write of the row */
+    const int col = fb.ds.get_cursor_col();
+    const size_t room = fb.ds.get_width() - col;
+    const size_t count = len < room ? len : room;
+    const color_type background = fb.ds.get_background_rendition();
+    const Renditions &renditions = fb.ds.get_renditions();
+
+    Row *row = fb.get_mutable_row( -1 );
+    row->mark_dirty( col, col + count - 1 );
+    Row::cells_type &cells = row->cells;
+    for ( size_t i = 0; i < count; i++ ) {
+      Cell &cell = cells[ col + i ];
+      cell.reset( background );
+      cell.append( str[ i ] );
+      cell.set_renditions( renditions );
+    }
+
+    /* leave the cursor as count single-column prints would */
+    fb.ds.move_col( col + count - 1 );
+    fb.ds.move_col( 1, true, true );
+
+    str += count;
+    len -= count;
+  }
+}
+
+void Emulator::CSI_dispatch( wchar_t ch )
 {
-  dispatch.dispatch( CSI, act, &fb );
+  dispatch.dispatch( CSI, ch, &fb );
 }
 
-void Emulator::OSC_end( const Parser::OSC_End *act )
+void Emulator::OSC_end( void )
 {
-  dispatch.OSC_dispatch( act, &fb );
+  dispatch.OSC_dispatch( &fb );
 }
 
-void Emulator::Esc_dispatch( const Parser::Esc_Dispatch *act )
+void Emulator::Esc_dispatch( wchar_t ch )
 {
   /* handle 7-bit ESC-encoding of C1 control characters */
   if ( (dispatch.get_dispatch_chars().size() == 0)
-       && (0x40 <= act->ch)
-       && (act->ch <= 0x5F) ) {
-    Parser::Esc_Dispatch act2 = *act;
-    act2.ch += 0x40;
-    dispatch.dispatch( CONTROL, &act2, &fb );
+       && (0x40 <= ch)
+       && (ch <= 0x5F) ) {
+    dispatch.dispatch( CONTROL, ch + 0x40, &fb );
   } else {
-    dispatch.dispatch( ESCAPE, act, &fb );
+    dispatch.dispatch( ESCAPE, ch, &fb );
   }
 }
 
@@ -46,6 +46,7 @@
 
 namespace Terminal {
   class Emulator {
+    friend void Parser::Token::act_on_terminal( Emulator * ) const;
     friend void Parser::Print::act_on_terminal( Emulator * ) const;
     friend void Parser::Execute::act_on_terminal( Emulator * ) const;
     friend void Parser::Clear::act_on_terminal( Emulator * ) const;
@@ -58,6 +59,7 @@ namespace Terminal {
     friend void Parser::OSC_End::act_on_terminal( Emulator * ) const;
 
     friend void Parser::UserByte::act_on_terminal( Emulator * ) const;
+    friend bool Parser::UserByte::act_on_const_terminal( const Emulator *, std::string & ) const;
     friend void Parser::Resize::act_on_terminal( Emulator * ) const;
 
   private:
@@ -66,11 +68,11 @@ namespace Terminal {
     UserInput user;
 
     /* action methods */
-    void print( const Parser::Print *act );
-    void execute( const Parser::Execute *act );
-    void CSI_dispatch( const Parser::CSI_Dispatch *act );
-    void Esc_dispatch( const Parser::Esc_Dispatch *act );
-    void OSC_end( const Parser::OSC_End *act );
+    void print( wchar_t ch );
+    void execute( wchar_t ch );
+    void CSI_dispatch( wchar_t ch );
+    void Esc_dispatch( wchar_t ch );
+    void OSC_end( void );
     void resize( size_t s_width, size_t s_height );
 
   public:
@@ -78,7 +80,12 @@ namespace Terminal {
 
     std::string read_octets_to_host( void );
 
+    /* equivalent to a Print action for each byte of a run of printable ASCII */
+    void print_ascii_run( const char *str, size_t len );
+
     const Framebuffer & get_fb( void ) const { return fb; }
+    /* for changes that bypass the parser, e.g. a FramePatch */
+    Framebuffer & get_mutable_fb( void ) { return fb; }
 
     bool operator==( Emulator const &x ) const;
   };
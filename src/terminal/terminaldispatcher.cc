@@ -30,14 +30,13 @@
     also delete it here.
 */
 
+#include <algorithm>
 #include <cassert>
-#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include "terminaldispatcher.h"
-#include "src/terminal/parseraction.h"
 #include "src/terminal/terminalframebuffer.h"
 
 using namespace Terminal;
@@ -45,31 +44,28 @@ using namespace Terminal;
 static const size_t MAXIMUM_CLIPBOARD_SIZE = 16*1024;
 
 Dispatcher::Dispatcher()
-  : params(), parsed_params(), parsed( false ), dispatch_chars(),
+  : params(), parsed_params(), parsed_param_count( 0 ), parsed( false ), dispatch_chars(),
     OSC_string(), terminal_to_host()
 {}
 
-void Dispatcher::newparamchar( const Parser::Param *act )
+void Dispatcher::newparamchar( wchar_t ch )
 {
-  assert( act->char_present );
-  assert( (act->ch == ';') || ( (act->ch >= '0') && (act->ch <= '9') ) );
-  if ( params.length() < 100 ) {
-    /* enough for 16 five-char params plus 15 semicolons */
-    params.push_back( act->ch );
+  assert( (ch == ';') || ( (ch >= '0') && (ch <= '9') ) );
+  if ( params.length() < PARAMS_MAX_LENGTH ) {
+    params.push_back( ch );
   }
   parsed = false;
 }
 
-void Dispatcher::collect( const Parser::Collect *act )
+void Dispatcher::collect( wchar_t ch )
 {
-  assert( act->char_present );
   if ( ( dispatch_chars.length() < 8 ) /* never should need more than 2 */
-       && ( act->ch <= 255 ) ) {  /* ignore non-8-bit */    
-    dispatch_chars.push_back( act->ch );
+       && ( ch <= 255 ) ) {  /* ignore non-8-bit */    
+    dispatch_chars.push_back( ch );
   }
 }
 
-void Dispatcher::clear( const Parser::Clear *act __attribute((unused)) )
+void Dispatcher::clear( void )
 {
   params.clear();
   dispatch_chars.clear();
@@ -82,51 +78,30 @@ void Dispatcher::parse_params( void )
     return;
   }
 
-  parsed_params.clear();
-  const char *str = params.c_str();
-  const char *segment_begin = str;
+  /* params holds only digits and semicolons (see newparamchar), so
+     each segment is either empty (-1), a number, or too big (-1) */
+  parsed_param_count = 0;
+  long val = -1;
 
-  while ( 1 ) {
-    const char *segment_end = strchr( segment_begin, ';' );
-    if ( segment_end == NULL ) {
-      break;
-    }
-
-    errno = 0;
-    char *endptr;
-    long val = strtol( segment_begin, &endptr, 10 );
-    if ( endptr == segment_begin ) {
+  for ( std::string::const_iterator i = params.begin();
+	i != params.end();
+	i++ ) {
+    if ( *i == ';' ) {
+      parsed_params[ parsed_param_count++ ] = val > PARAM_MAX ? -1 : val;
       val = -1;
+      continue;
     }
 
-    if ( val > PARAM_MAX || errno == ERANGE ) {
-      val = -1;
-      errno = 0;
+    if ( val < 0 ) {
+      val = 0;
     }
-
-    if ( errno == 0 || segment_begin == endptr ) {
-      parsed_params.push_back( val );
+    if ( val <= PARAM_MAX ) {
+      val = val * 10 + (*i - '0');
     }
-
-    segment_begin = segment_end + 1;
   }
 
   /* get last param */
-  errno = 0;
-  char *endptr;
-  long val = strtol( segment_begin, &endptr, 10 );
-  if ( endptr == segment_begin ) {
-    val = -1;
-  }
-
-  if ( val > PARAM_MAX || errno == ERANGE ) {
-    val = -1;
-    errno = 0;
-  }
-
-  if ( errno == 0 || segment_begin == endptr ) {
-    parsed_params.push_back( val );
-  }
+  parsed_params[ parsed_param_count++ ] = val > PARAM_MAX ? -1 : val;
 
   parsed = true;
 }
@@ -138,7 +113,7 @@ int Dispatcher::getparam( size_t N, int defaultval )
     parse_params();
   }
 
-  if ( parsed_params.size() > N ) {
+  if ( parsed_param_count > N ) {
     ret = parsed_params[ N ];
   }
 
@@ -153,7 +128,7 @@ int Dispatcher::param_count( void )
     parse_params();
   }
 
-  return parsed_params.size();
+  return parsed_param_count;
 }
 
 std::string Dispatcher::str( void )
@@ -171,19 +146,61 @@ DispatchRegistry & Terminal::get_global_dispatch_registry( void )
   return global_dispatch_registry;
 }
 
+int DispatchTable::key( const std::string &dispatch_chars )
+{
+  int prefix;
+  unsigned char final;
+
+  switch ( dispatch_chars.size() ) {
+  case 1:
+    prefix = 0;
+    final = dispatch_chars[ 0 ];
+    break;
+  case 2:
+    {
+      const unsigned char c = dispatch_chars[ 0 ];
+      if ( (0x20 <= c) && (c <= 0x2F) ) {
+	prefix = 1 + c - 0x20;
+      } else if ( (0x3C <= c) && (c <= 0x3F) ) {
+	prefix = 17 + c - 0x3C;
+      } else {
+	return -1;
+      }
+      final = dispatch_chars[ 1 ];
+    }
+    break;
+  default:
+    return -1;
+  }
+
+  return prefix * NUM_FINALS + final;
+}
+
+void DispatchTable::insert( int key, const Function &f )
+{
+  assert( key >= 0 );
+  if ( slots[ key ] != 0 ) {
+    return; /* first registration wins */
+  }
+  functions.push_back( f );
+  assert( functions.size() <= 255 );
+  slots[ key ] = functions.size();
+}
+
 static void register_function( Function_Type type,
 			       const std::string & dispatch_chars,
 			       Function f )
 {
   switch ( type ) {
   case ESCAPE:
-    get_global_dispatch_registry().escape.insert( dispatch_map_t::value_type( dispatch_chars, f ) );
+    get_global_dispatch_registry().escape.insert( DispatchTable::key( dispatch_chars ), f );
     break;
   case CSI:
-    get_global_dispatch_registry().CSI.insert( dispatch_map_t::value_type( dispatch_chars, f ) );
+    get_global_dispatch_registry().CSI.insert( DispatchTable::key( dispatch_chars ), f );
     break;
   case CONTROL:
-    get_global_dispatch_registry().control.insert( dispatch_map_t::value_type( dispatch_chars, f ) );
+    assert( dispatch_chars.size() == 1 );
+    get_global_dispatch_registry().control.insert( DispatchTable::key( (unsigned char)dispatch_chars[ 0 ] ), f );
     break;
   }
 }
@@ -196,52 +213,43 @@ Function::Function( Function_Type type, const std::string & dispatch_chars,
   register_function( type, dispatch_chars, *this );
 }
 
-void Dispatcher::dispatch( Function_Type type, const Parser::Action *act, Framebuffer *fb )
+void Dispatcher::dispatch( Function_Type type, wchar_t ch, Framebuffer *fb )
 {
-  /* add final char to dispatch key */
-  if ( (type == ESCAPE) || (type == CSI) ) {
-    assert( act->char_present );
-    Parser::Collect act2;
-    act2.char_present = true;
-    act2.ch = act->ch;
-    collect( &act2 ); 
-  }
+  const Function *func = NULL;
+  DispatchRegistry &registry = get_global_dispatch_registry();
 
-  dispatch_map_t *map = NULL;
   switch ( type ) {
-  case ESCAPE:  map = &get_global_dispatch_registry().escape;  break;
-  case CSI:     map = &get_global_dispatch_registry().CSI;     break;
-  case CONTROL: map = &get_global_dispatch_registry().control; break;
-  }
-
-  std::string key = dispatch_chars;
-  if ( type == CONTROL ) {
-    assert( act->ch <= 255 );
-    char ctrlstr[ 2 ] = { (char)act->ch, 0 };
-    key = std::string( ctrlstr, 1 );
+  case ESCAPE:
+  case CSI:
+    /* add final char to dispatch key */
+    collect( ch );
+    func = ( type == ESCAPE ? registry.escape : registry.CSI ).find( DispatchTable::key( dispatch_chars ) );
+    break;
+  case CONTROL:
+    assert( ch <= 255 );
+    func = registry.control.find( DispatchTable::key( ch ) );
+    break;
   }
 
-  dispatch_map_t::const_iterator i = map->find( key );
-  if ( i == map->end() ) {
+  if ( func == NULL ) {
     /* unknown function */
     fb->ds.next_print_will_wrap = false;
     return;
   }
-  if ( i->second.clears_wrap_state ) {
+  if ( func->clears_wrap_state ) {
     fb->ds.next_print_will_wrap = false;
   }
-  i->second.function( fb, this );
+  func->function( fb, this );
 }
 
-void Dispatcher::OSC_put( const Parser::OSC_Put *act )
+void Dispatcher::OSC_put( wchar_t ch )
 {
-  assert( act->char_present );
   if ( OSC_string.size() < MAXIMUM_CLIPBOARD_SIZE) {
-    OSC_string.push_back( act->ch );
+    OSC_string.push_back( ch );
   }
 }
 
-void Dispatcher::OSC_start( const Parser::OSC_Start *act __attribute((unused)) )
+void Dispatcher::OSC_start( void )
 {
   OSC_string.clear();
 }
@@ -249,7 +257,8 @@ void Dispatcher::OSC_start( const Parser::OSC_Start *act __attribute((unused)) )
 bool Dispatcher::operator==( const Dispatcher &x ) const
 {
   return ( params == x.params )
-    && ( parsed_params == x.parsed_params )
+    && ( parsed_param_count == x.parsed_param_count )
+    && std::equal( parsed_params, parsed_params + parsed_param_count, x.parsed_params )
     && ( parsed == x.parsed )
     && ( dispatch_chars == x.dispatch_chars )
     && ( OSC_string == x.OSC_string )
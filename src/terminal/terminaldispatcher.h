@@ -33,22 +33,9 @@
 #ifndef TERMINALDISPATCHER_HPP
 #define TERMINALDISPATCHER_HPP
 
-#include <vector>
+#include <cstdint>
 #include <string>
-#include <map>
-
-namespace Parser {
-  class Action;
-  class Param;
-  class Collect;
-  class Clear;
-  class Esc_Dispatch;
-  class CSI_Dispatch;
-  class Execute;
-  class OSC_Start;
-  class OSC_Put;
-  class OSC_End;
-}
+#include <vector>
 
 namespace Terminal {
   class Framebuffer;
@@ -66,13 +53,42 @@ namespace Terminal {
     bool clears_wrap_state;
   };
 
-  using dispatch_map_t = std::map<std::string, Function>;
+  /* Dense table of functions, indexed by final byte and by at most
+     one collected (private marker or intermediate) character. */
+  class DispatchTable {
+  public:
+    static const int NUM_PREFIXES = 21; /* none, 0x20-0x2F, 0x3C-0x3F */
+    static const int NUM_FINALS = 256;
+
+  private:
+    std::vector<Function> functions;
+    std::vector<unsigned char> slots; /* 0 = unknown, else 1 + index into functions */
+
+  public:
+    DispatchTable() : functions(), slots( NUM_PREFIXES * NUM_FINALS, 0 ) {}
+
+    /* returns -1 for sequences no function can be registered under */
+    static int key( const std::string &dispatch_chars );
+    static int key( wchar_t control )
+    {
+      return ( static_cast<uint32_t>( control ) < NUM_FINALS ) ? control : -1;
+    }
+
+    void insert( int key, const Function &f );
+    const Function *find( int key ) const
+    {
+      if ( key < 0 || slots[ key ] == 0 ) {
+	return NULL;
+      }
+      return &functions[ slots[ key ] - 1 ];
+    }
+  };
 
   class DispatchRegistry {
   public:
-    dispatch_map_t escape;
-    dispatch_map_t CSI;
-    dispatch_map_t control;
+    DispatchTable escape;
+    DispatchTable CSI;
+    DispatchTable control;
 
     DispatchRegistry() : escape(), CSI(), control() {}
   };
@@ -80,9 +96,17 @@ namespace Terminal {
   DispatchRegistry & get_global_dispatch_registry( void );
 
   class Dispatcher {
+  public:
+    static const int PARAM_MAX = 65535;
+    /* prevent evil escape sequences from causing long loops */
+
+    static const size_t PARAMS_MAX_LENGTH = 100;
+    /* enough for 16 five-char params plus 15 semicolons */
+
   private:
     std::string params;
-    std::vector<int> parsed_params;
+    int parsed_params[ PARAMS_MAX_LENGTH + 1 ];
+    size_t parsed_param_count;
     bool parsed;
 
     std::string dispatch_chars;
@@ -91,28 +115,25 @@ namespace Terminal {
     void parse_params( void );
 
   public:
-    static const int PARAM_MAX = 65535;
-    /* prevent evil escape sequences from causing long loops */
-
     std::string terminal_to_host; /* this is the reply string */
 
     Dispatcher();
     int getparam( size_t N, int defaultval );
     int param_count( void );
 
-    void newparamchar( const Parser::Param *act );
-    void collect( const Parser::Collect *act );
-    void clear( const Parser::Clear *act );
+    void newparamchar( wchar_t ch );
+    void collect( wchar_t ch );
+    void clear( void );
     
     std::string str( void );
 
-    void dispatch( Function_Type type, const Parser::Action *act, Framebuffer *fb );
+    void dispatch( Function_Type type, wchar_t ch, Framebuffer *fb );
     std::string get_dispatch_chars( void ) const { return dispatch_chars; }
     std::vector<wchar_t> get_OSC_string( void ) const { return OSC_string; }
 
-    void OSC_put( const Parser::OSC_Put *act );
-    void OSC_start( const Parser::OSC_Start *act );
-    void OSC_dispatch( const Parser::OSC_End *act, Framebuffer *fb );
+    void OSC_put( wchar_t ch );
+    void OSC_start( void );
+    void OSC_dispatch( Framebuffer *fb );
 
     bool operator==( const Dispatcher &x ) const;
   };
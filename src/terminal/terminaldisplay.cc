@@ -30,7 +30,12 @@
     also delete it here.
 */
 
+#include <algorithm>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
+#include <utility>
+#include <vector>
 
 #include "terminaldisplay.h"
 #include "src/terminal/terminalframebuffer.h"
@@ -154,7 +159,6 @@ std::string Display::new_frame( bool initialized, const Framebuffer &last, const
     frame.append( "\033[?25l" );
   }
 
-  int frame_y = 0;
   Framebuffer::row_pointer blank_row;
   Framebuffer::rows_type rows( frame.last_frame.get_rows() );
   /* Extend rows if we've gotten a resize and new is wider than old */
@@ -162,6 +166,7 @@ std::string Display::new_frame( bool initialized, const Framebuffer &last, const
     for ( Framebuffer::rows_type::iterator p = rows.begin(); p != rows.end(); p++ ) {
       *p = std::make_shared<Row>( **p );
       (*p)->cells.resize( f.ds.get_width(), Cell( f.ds.get_background_rendition() ) );
+      (*p)->mark_dirty();
     }
   }
   /* Add rows if we've gotten a resize and new is taller than old */
@@ -173,99 +178,74 @@ std::string Display::new_frame( bool initialized, const Framebuffer &last, const
     rows.resize( f.ds.get_height(), blank_row );
   }
 
-  /* shortcut -- has display moved up by a certain number of lines? */
-  if ( initialized ) {
-    int lines_scrolled = 0;
-    int scroll_height = 0;
+  /* shortcut -- has a block of lines moved up or down? */
+  int top, bottom, shift;
+  if ( initialized && find_scroll( rows, f, top, bottom, shift ) ) {
+    /* Now we need a proper blank row. */
+    if ( blank_row.get() == NULL ) {
+      const size_t w = f.ds.get_width();
+      const color_type c = 0;
+      blank_row = std::make_shared<Row>( w, c );
+    }
+    frame.update_rendition( initial_rendition(), true );
+
+    /* the scrolling region spans the moved rows and those they uncover */
+    int top_margin = ( shift > 0 ) ? top : top + shift;
+    int bottom_margin = ( shift > 0 ) ? bottom + shift : bottom;
+    int lines_scrolled = abs( shift );
+
+    assert( top_margin >= 0 );
+    assert( bottom_margin < f.ds.get_height() );
+
+    /* Common case:  if we're already on the bottom line and we're scrolling the whole
+     * screen, just do a CR and LFs.
+     */
+    if ( shift > 0
+	 && top_margin == 0
+	 && bottom_margin + 1 == f.ds.get_height()
+	 && frame.cursor_y + 1 == f.ds.get_height() ) {
+      frame.append( '\r' );
+      frame.append( lines_scrolled, '\n' );
+      frame.cursor_x = 0;
+    } else {
+      /* set scrolling region */
+      snprintf( tmp, 64, "\033[%d;%dr",
+		top_margin + 1, bottom_margin + 1);
+      frame.append( tmp );
 
-    for ( int row = 0; row < f.ds.get_height(); row++ ) {
-      const Row *new_row = f.get_row( 0 );
-      const Row *old_row = &*rows.at( row );
-      if ( ! ( new_row == old_row || *new_row == *old_row ) ) {
-	continue;
-      }
-      /* if row 0, we're looking at ourselves and probably didn't scroll */
-      if ( row == 0 ) {
-	break;
-      }
-      /* found a scroll */
-      lines_scrolled = row;
-      scroll_height = 1;
-
-      /* how big is the region that was scrolled? */
-      for ( int region_height = 1;
-	    lines_scrolled + region_height < f.ds.get_height();
-	    region_height++ ) {
-	if ( *f.get_row( region_height )
-	     == *rows.at( lines_scrolled + region_height ) ) {
-	  scroll_height = region_height + 1;
-	} else {
-	  break;
-	}
+      frame.cursor_x = frame.cursor_y = -1;
+      if ( shift > 0 ) {
+	/* go to bottom of scrolling region and scroll */
+	frame.append_silent_move( bottom_margin, 0 );
+	frame.append( lines_scrolled, '\n' );
+      } else {
+	/* go to top of scrolling region and insert lines */
+	frame.append_silent_move( top_margin, 0 );
+	snprintf( tmp, 64, "\033[%dL", lines_scrolled );
+	frame.append( tmp );
       }
 
-      break;
+      /* reset scrolling region */
+      frame.append( "\033[r" );
+      /* invalidate cursor position after unsetting scrolling region */
+      frame.cursor_x = frame.cursor_y = -1;
     }
 
-    if ( scroll_height ) {
-      frame_y = scroll_height;
-
-      if ( lines_scrolled ) {
-	/* Now we need a proper blank row. */
-	if ( blank_row.get() == NULL ) {
-	  const size_t w = f.ds.get_width();
-	  const color_type c = 0;
-	  blank_row = std::make_shared<Row>( w, c );
-	}
-	frame.update_rendition( initial_rendition(), true );
-
-	int top_margin = 0;
-	int bottom_margin = top_margin + lines_scrolled + scroll_height - 1;
-
-	assert( bottom_margin < f.ds.get_height() );
-
-	/* Common case:  if we're already on the bottom line and we're scrolling the whole
-	 * screen, just do a CR and LFs.
-	 */
-	if ( scroll_height + lines_scrolled == f.ds.get_height()
-	     && frame.cursor_y + 1 == f.ds.get_height() ) {
-	  frame.append( '\r' );
-	  frame.append( lines_scrolled, '\n' );
-	  frame.cursor_x = 0;
-	} else {
-	  /* set scrolling region */
-	  snprintf( tmp, 64, "\033[%d;%dr",
-		    top_margin + 1, bottom_margin + 1);
-	  frame.append( tmp );
-
-	  /* go to bottom of scrolling region */
-	  frame.cursor_x = frame.cursor_y = -1;
-	  frame.append_silent_move( bottom_margin, 0 );
-
-	  /* scroll */
-	  frame.append( lines_scrolled, '\n' );
-
-	  /* reset scrolling region */
-	  frame.append( "\033[r" );
-	  /* invalidate cursor position after unsetting scrolling region */
-	  frame.cursor_x = frame.cursor_y = -1;
-	}
-
-	/* do the move in our local index */
-	for ( int i = top_margin; i <= bottom_margin; i++ ) {
-	  if ( i + lines_scrolled <= bottom_margin ) {
-	    rows.at( i ) = rows.at( i + lines_scrolled );
-	  } else {
-	    rows.at( i ) = blank_row;
-	  }
-	}
+    /* do the move in our local index */
+    if ( shift > 0 ) {
+      for ( int i = top_margin; i <= bottom_margin; i++ ) {
+	rows.at( i ) = ( i + shift <= bottom_margin ) ? rows.at( i + shift ) : blank_row;
+      }
+    } else {
+      for ( int i = bottom_margin; i >= top_margin; i-- ) {
+	rows.at( i ) = ( i + shift >= top_margin ) ? rows.at( i + shift ) : blank_row;
       }
     }
   }
 
   /* Now update the display, row by row */
   bool wrap = false;
-  for ( ; frame_y < f.ds.get_height(); frame_y++ ) {
+  for ( int frame_y = 0; frame_y < f.ds.get_height(); frame_y++ ) {
     wrap = put_row( initialized, frame, f, frame_y, *rows.at( frame_y ), wrap );
   }
 
@@ -339,6 +319,106 @@ std::string Display::new_frame( bool initialized, const Framebuffer &last, const
   return frame.str;
 }
 
+/* Look for the vertical move of a block of lines that saves the most
+   repainting: new rows [top, bottom] are old rows [top + shift,
+   bottom + shift].  Rows are matched by content hash along each
+   diagonal of the old-by-new grid, then checked cell by cell. */
+bool Display::find_scroll( const Framebuffer::rows_type &old_rows, const Framebuffer &f,
+			   int &top, int &bottom, int &shift ) const
+{
+  const int height = f.ds.get_height();
+
+  /* A move blanks at least one row, so it can only pay off when two
+     or more rows have changed; the common single-row update stops here. */
+  int changed = 0;
+  for ( int i = 0; i < height && changed < 2; i++ ) {
+    const Row *new_row = f.get_row( i );
+    const Row *old_row = &*old_rows.at( i );
+    if ( ! ( new_row == old_row || *new_row == *old_row ) ) {
+      changed++;
+    }
+  }
+  if ( changed < 2 ) {
+    return false;
+  }
+
+  /* in_place[ i ] counts rows above i that are already right */
+  std::vector<int> in_place( height + 1, 0 );
+  std::vector<uint64_t> old_hash( height ), new_hash( height );
+  for ( int i = 0; i < height; i++ ) {
+    const Row &new_row = *f.get_row( i );
+    const Row &old_row = *old_rows.at( i );
+    const bool same = ( &new_row == &old_row ) || ( new_row == old_row )
+      || new_row.same_contents( old_row );
+    in_place[ i + 1 ] = in_place[ i ] + same;
+    old_hash[ i ] = old_row.hash();
+    new_hash[ i ] = new_row.hash();
+  }
+
+  /* Only a shift that carries some changed row onto its old copy can
+     gain, so collect those shifts by looking each changed row up
+     among the sorted old hashes. */
+  std::vector<std::pair<uint64_t, int> > old_index( height );
+  for ( int i = 0; i < height; i++ ) {
+    old_index[ i ] = std::make_pair( old_hash[ i ], i );
+  }
+  std::sort( old_index.begin(), old_index.end() );
+  std::vector<bool> candidate( 2 * height, false );
+  for ( int i = 0; i < height; i++ ) {
+    if ( in_place[ i + 1 ] != in_place[ i ] ) {
+      continue;
+    }
+    for ( std::vector<std::pair<uint64_t, int> >::const_iterator j
+	    = std::lower_bound( old_index.begin(), old_index.end(), std::make_pair( new_hash[ i ], INT_MIN ) );
+	  j != old_index.end() && j->first == new_hash[ i ];
+	  j++ ) {
+      candidate[ j->second - i + height ] = true;
+    }
+  }
+
+  int best_gain = 0;
+  for ( int s = 1 - height; s < height; s++ ) {
+    if ( s == 0 || !candidate[ s + height ] ) {
+      continue;
+    }
+    const int first = std::max( 0, -s ), last = std::min( height, height - s ) - 1;
+    for ( int i = first; i <= last; ) {
+      if ( new_hash[ i ] != old_hash[ i + s ] ) {
+	i++;
+	continue;
+      }
+      int j = i;
+      while ( j < last && new_hash[ j + 1 ] == old_hash[ j + 1 + s ] ) {
+	j++;
+      }
+      /* rows fixed by the move, less rows already right that the
+	 move would blank */
+      const int uncover_lo = ( s > 0 ) ? j + 1 : i + s;
+      const int uncover_hi = ( s > 0 ) ? j + s : i - 1;
+      const int gain = ( j - i + 1 ) - ( in_place[ j + 1 ] - in_place[ i ] )
+	- ( in_place[ uncover_hi + 1 ] - in_place[ uncover_lo ] );
+      if ( gain > best_gain ) {
+	best_gain = gain;
+	top = i;
+	bottom = j;
+	shift = s;
+      }
+      i = j + 1;
+    }
+  }
+  if ( best_gain == 0 ) {
+    return false;
+  }
+
+  /* hashes can collide */
+  for ( int i = top; i <= bottom; i++ ) {
+    if ( !f.get_row( i )->same_contents( *old_rows.at( i + shift ) ) ) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool Display::put_row( bool initialized, FrameState &frame, const Framebuffer &f, int frame_y, const Row &old_row, bool wrap ) const
 {
   char tmp[ 64 ];
@@ -368,9 +448,27 @@ bool Display::put_row( bool initialized, FrameState &frame, const Framebuffer &f
   bool wrote_last_cell = false;
   Renditions blank_renditions = initial_rendition();
 
+  /* Only the span between the first and last changed cells can need
+     drawing; find it without walking the row cell by cell. */
+  int first_change = 0, last_change = row_width - 1;
+  if ( initialized ) {
+    row.differing_span( old_row, row_width, first_change, last_change );
+    if ( first_change == row_width ) {
+      return false;
+    }
+    while ( frame_x < first_change ) {
+      frame_x += cells[ frame_x ].get_width();
+    }
+  }
+
   /* iterate for every cell */
   while ( frame_x < row_width ) {
 
+    /* Past the last change with nothing pending, the rest is unchanged. */
+    if ( initialized && !clear_count && frame_x > last_change ) {
+      break;
+    }
+
     const Cell &cell = cells.at( frame_x );
 
     /* Does cell need to be drawn?  Skip all this. */
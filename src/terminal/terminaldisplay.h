@@ -75,6 +75,11 @@ namespace Terminal {
     bool put_row( bool initialized, FrameState &frame, const Framebuffer &f, int frame_y, const Row &old_row, bool wrap ) const;
 
   public:
+    /* The block of rows to move so that old_rows need the least
+       repainting to become f's (see Framebuffer::move_rows()) */
+    bool find_scroll( const Framebuffer::rows_type &old_rows, const Framebuffer &f,
+		      int &top, int &bottom, int &shift ) const;
+
     std::string open() const;
     std::string close() const;
 
@@ -33,28 +33,168 @@
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
+#include <type_traits>
+#include <unordered_map>
 
 #include "src/terminal/terminalframebuffer.h"
 
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace Terminal;
 
+static_assert( sizeof( Cell ) == 16, "Cell should pack into 16 bytes" );
+static_assert( std::is_trivially_copyable<Cell>::value, "Rows are copied bytewise" );
+
+/* An id names a slot in the table and the generation of the entry in
+   it, so an id left behind when its entry was freed names nothing
+   rather than whatever cluster took the slot next (until the slot's
+   generation wraps, 65536 reuses later). */
+static const unsigned int SLOT_BITS = 16;
+static_assert( GraphemeTable::MAX_ENTRIES <= ( 1u << SLOT_BITS ), "slot must fit in an id" );
+
+static uint32_t slot_of( uint32_t id ) { return id & ( ( 1u << SLOT_BITS ) - 1 ); }
+static uint32_t generation_of( uint32_t id ) { return id >> SLOT_BITS; }
+
+struct GraphemeTable::Store {
+  std::vector<std::string> entries;
+  std::vector<uint16_t> generations; /* of each slot's entry */
+  std::unordered_map<std::string, uint32_t> ids;
+  std::vector<uint32_t> free_slots;
+  size_t sweep_delay; /* misses to wait before sweeping again */
+
+  Store() : entries(), generations(), ids(), free_slots(), sweep_delay( 0 ) {}
+};
+
+/* construct on first use to avoid static initialization order crash */
+GraphemeTable::Store &GraphemeTable::store( void )
+{
+  static Store s;
+  return s;
+}
+
+static Row *live_rows = NULL;
+
+void GraphemeTable::sweep( Store &s )
+{
+  std::vector<bool> used( s.entries.size() );
+  for ( const Row *row = live_rows; row; row = row->next_live ) {
+    for ( Row::cells_type::const_iterator i = row->cells.begin(); i != row->cells.end(); i++ ) {
+      if ( i->contents_length == Cell::SPILLED ) {
+        used[ slot_of( i->spilled_id() ) ] = true;
+      }
+    }
+  }
+
+  s.free_slots.clear();
+  for ( uint32_t slot = 0; slot < s.entries.size(); slot++ ) {
+    if ( !used[ slot ] ) {
+      s.ids.erase( s.entries[ slot ] );
+      std::string().swap( s.entries[ slot ] );
+      s.generations[ slot ]++;
+      s.free_slots.push_back( slot );
+    }
+  }
+
+  /* if little came back, most entries are live; don't rescan the
+     screen for every combining character that follows */
+  s.sweep_delay = s.free_slots.size() < MAX_ENTRIES / 8 ? MAX_ENTRIES / 8 : 0;
+}
+
+bool GraphemeTable::intern( const std::string &contents, uint32_t &id )
+{
+  Store &s = store();
+
+  std::unordered_map<std::string, uint32_t>::const_iterator i = s.ids.find( contents );
+  if ( i != s.ids.end() ) {
+    id = i->second;
+    return true;
+  }
+
+  if ( s.free_slots.empty() ) {
+    if ( s.entries.size() < MAX_ENTRIES ) {
+      s.free_slots.push_back( s.entries.size() );
+      s.entries.push_back( std::string() );
+      s.generations.push_back( 0 );
+    } else if ( s.sweep_delay > 0 ) {
+      s.sweep_delay--;
+      return false;
+    } else {
+      sweep( s );
+      if ( s.free_slots.empty() ) {
+        return false;
+      }
+    }
+  }
+
+  const uint32_t slot = s.free_slots.back();
+  s.free_slots.pop_back();
+  s.entries[ slot ] = contents;
+  id = slot | ( uint32_t( s.generations[ slot ] ) << SLOT_BITS );
+  s.ids.insert( std::make_pair( contents, id ) );
+  return true;
+}
+
+const std::string &GraphemeTable::lookup( uint32_t id )
+{
+  static const std::string freed;
+  const Store &s = store();
+  const uint32_t slot = slot_of( id );
+  if ( s.generations.at( slot ) != generation_of( id ) ) {
+    return freed;
+  }
+  return s.entries[ slot ];
+}
+
+size_t GraphemeTable::live_entries( void )
+{
+  return store().ids.size();
+}
+
 Cell::Cell( color_type background_color )
-  : contents(),
-    renditions( background_color ),
+  : renditions( background_color ),
+    contents(),
+    contents_length( 0 ),
     wide( false ),
     fallback( false ),
-    wrap( false )
+    wrap( false ),
+    reserved( 0 )
 {}
 
 void Cell::reset( color_type background_color )
 {
-  contents.clear();
+  clear();
   renditions = Renditions( background_color );
   wide = false;
   fallback = false;
   wrap = false;
 }
 
+void Cell::append_bytes( const char *s, size_t len )
+{
+  if ( contents_length != SPILLED && contents_length + len <= INLINE_CAPACITY ) {
+    memcpy( contents + contents_length, s, len );
+    contents_length += len;
+    return;
+  }
+
+  const char *data;
+  size_t old_len;
+  get_contents( data, old_len );
+  std::string grapheme( data, old_len );
+  grapheme.append( s, len );
+
+  uint32_t id;
+  if ( !GraphemeTable::intern( grapheme, id ) ) {
+    return; /* out of room; drop the combining character */
+  }
+
+  clear();
+  memcpy( contents, &id, sizeof( id ) );
+  contents_length = SPILLED;
+}
+
 void DrawState::reinitialize_tabs( unsigned int start )
 {
   assert( default_tabs );
@@ -189,6 +329,27 @@ void Framebuffer::move_rows_autoscroll( int rows )
   ds.move_row( rows, true );
 }
 
+void Framebuffer::move_rows( int top, int bottom, int shift )
+{
+  const int top_margin = ( shift > 0 ) ? top : top + shift;
+  const int bottom_margin = ( shift > 0 ) ? bottom + shift : bottom;
+  assert( 0 <= top_margin && top_margin <= bottom_margin );
+  assert( bottom_margin < static_cast<int>( rows.size() ) );
+
+  /* blank as Display::new_frame() leaves uncovered rows */
+  const row_pointer blank_row = std::make_shared<Row>( ds.get_width(), 0 );
+
+  if ( shift > 0 ) {
+    for ( int i = top_margin; i <= bottom_margin; i++ ) {
+      rows.at( i ) = ( i + shift <= bottom_margin ) ? rows.at( i + shift ) : blank_row;
+    }
+  } else {
+    for ( int i = bottom_margin; i >= top_margin; i-- ) {
+      rows.at( i ) = ( i + shift >= top_margin ) ? rows.at( i + shift ) : blank_row;
+    }
+  }
+}
+
 Cell *Framebuffer::get_combining_cell( void )
 {
   if ( (ds.get_combining_char_col() < 0)
@@ -346,8 +507,41 @@ void Framebuffer::delete_line( int row, int count )
 }
 
 Row::Row( const size_t s_width, const color_type background_color )
-  : cells( s_width, Cell( background_color ) ), gen( get_gen() )
-{}
+  : cells( s_width, Cell( background_color ) ), gen( get_gen() ),
+    id( get_gen() ), base_id( id ), dirty_first( INT_MAX ), dirty_last( -1 ),
+    hash_value( 0 ), hash_valid( false ), prev_live( NULL ), next_live( NULL )
+{
+  link_live();
+}
+
+Row::Row( const Row &other )
+  : cells( other.cells ), gen( other.gen ),
+    id( get_gen() ), base_id( other.id ), dirty_first( INT_MAX ), dirty_last( -1 ),
+    hash_value( other.hash_value ), hash_valid( other.hash_valid ), prev_live( NULL ), next_live( NULL )
+{
+  link_live();
+}
+
+Row::~Row()
+{
+  if ( prev_live ) {
+    prev_live->next_live = next_live;
+  } else {
+    live_rows = next_live;
+  }
+  if ( next_live ) {
+    next_live->prev_live = prev_live;
+  }
+}
+
+void Row::link_live( void )
+{
+  next_live = live_rows;
+  if ( live_rows ) {
+    live_rows->prev_live = this;
+  }
+  live_rows = this;
+}
 
 uint64_t Row::get_gen() const
 {
@@ -355,14 +549,93 @@ uint64_t Row::get_gen() const
   return gen_counter++;
 }
 
+/* FNV-1a over 64-bit words, one lane for each half of every Cell so
+   the two multiply chains overlap.  Every bit of a Cell is defined,
+   so equal cells hash equally. */
+uint64_t Row::compute_hash( void ) const
+{
+  static_assert( sizeof( Cell ) == 2 * sizeof( uint64_t ), "Cell is not two words" );
+  const unsigned char *data = reinterpret_cast<const unsigned char *>( cells.data() );
+
+  uint64_t h0 = 14695981039346656037ULL, h1 = h0 ^ cells.size();
+  for ( size_t i = 0; i < cells.size(); i++ ) {
+    uint64_t w0, w1;
+    memcpy( &w0, data + i * sizeof( Cell ), sizeof( w0 ) );
+    memcpy( &w1, data + i * sizeof( Cell ) + sizeof( w0 ), sizeof( w1 ) );
+    h0 = ( h0 ^ w0 ) * 1099511628211ULL;
+    h1 = ( h1 ^ w1 ) * 1099511628211ULL;
+    h0 ^= h0 >> 29;
+    h1 ^= h1 >> 29;
+  }
+  return ( h0 ^ ( h1 >> 32 ) ^ ( h1 << 32 ) ) * 1099511628211ULL;
+}
+
+/* Each Cell is exactly one 16-byte vector, so compare a cell per
+   SSE2 instruction where we can, and bytewise elsewhere. */
+static bool same_cell( const Cell &a, const Cell &b )
+{
+#if __SSE2__
+  const __m128i va = _mm_loadu_si128( reinterpret_cast<const __m128i *>( &a ) );
+  const __m128i vb = _mm_loadu_si128( reinterpret_cast<const __m128i *>( &b ) );
+  return _mm_movemask_epi8( _mm_cmpeq_epi8( va, vb ) ) == 0xffff;
+#else
+  return memcmp( &a, &b, sizeof( Cell ) ) == 0;
+#endif
+}
+
+void Row::comparable_span( const Row &x, int width, int &lo, int &hi ) const
+{
+  lo = 0;
+  hi = width - 1;
+
+  /* When one row is an unchanged-since copy of the other, only the
+     cells written to the copy can differ. */
+  const Row *copy = NULL;
+  if ( base_id == x.id ) {
+    copy = this;
+  } else if ( x.base_id == id ) {
+    copy = &x;
+  }
+  if ( copy ) {
+    lo = std::max( lo, copy->dirty_first );
+    hi = std::min( hi, copy->dirty_last );
+  }
+}
+
+void Row::differing_span( const Row &x, int width, int &first, int &last ) const
+{
+  assert( static_cast<int>( cells.size() ) >= width );
+  assert( static_cast<int>( x.cells.size() ) >= width );
+
+  int lo, hi;
+  comparable_span( x, width, lo, hi );
+
+  first = lo;
+  while ( first <= hi && same_cell( cells[ first ], x.cells[ first ] ) ) {
+    first++;
+  }
+  if ( first > hi ) {
+    first = width;
+    last = width - 1;
+    return;
+  }
+
+  last = hi;
+  while ( last > first && same_cell( cells[ last ], x.cells[ last ] ) ) {
+    last--;
+  }
+}
+
 void Row::insert_cell( int col, color_type background_color )
 {
+  mark_dirty( col, cells.size() - 1 );
   cells.insert( cells.begin() + col, Cell( background_color ) );
   cells.pop_back();
 }
 
 void Row::delete_cell( int col, color_type background_color )
 {
+  mark_dirty( col, cells.size() - 1 );
   cells.push_back( Cell( background_color ) );
   cells.erase( cells.begin() + col );
 }
@@ -420,6 +693,7 @@ void Framebuffer::resize( int s_width, int s_height )
     *i = std::make_shared<Row>( **i );
     (*i)->set_wrap( false );
     (*i)->cells.resize( s_width, Cell( ds.get_background_rendition() ) );
+    (*i)->mark_dirty();
   }
 }
 
@@ -455,7 +729,7 @@ void DrawState::resize( int s_width, int s_height )
 
 Renditions::Renditions( color_type s_background )
   : foreground_color( 0 ), background_color( s_background ),
-    attributes( 0 )
+    attributes( 0 ), reserved( 0 )
 {}
 
 /* This routine cannot be used to set a color beyond the 16-color set. */
@@ -578,6 +852,7 @@ std::string Renditions::sgr( void ) const
 void Row::reset( color_type background_color )
 {
   gen = get_gen();
+  mark_dirty();
   for ( cells_type::iterator i = cells.begin();
 	i != cells.end();
 	i++ ) {
@@ -596,7 +871,7 @@ void Framebuffer::prefix_window_title( const title_type &s )
 
 std::string Cell::debug_contents( void ) const
 {
-  if ( contents.empty() ) {
+  if ( empty() ) {
     return "'_' ()";
   }
   std::string chars( 1, '\'' );
@@ -604,11 +879,12 @@ std::string Cell::debug_contents( void ) const
   chars.append( "' [" );
   const char *lazycomma = "";
   char buf[64];
-  for ( content_type::const_iterator i = contents.begin();
-	i < contents.end();
-	i++ ) {
+  const char *data;
+  size_t len;
+  get_contents( data, len );
+  for ( size_t i = 0; i < len; i++ ) {
 
-    snprintf( buf, sizeof buf, "%s0x%02x", lazycomma, static_cast<uint8_t>(*i) );
+    snprintf( buf, sizeof buf, "%s0x%02x", lazycomma, static_cast<uint8_t>(data[ i ]) );
     chars.append( buf );
     lazycomma = ", ";
   }
@@ -635,9 +911,9 @@ bool Cell::compare( const Cell &other ) const
     // ret = true;
     fprintf( stderr, "Contents: %s (%ld) vs. %s (%ld)\n",
 	     debug_contents().c_str(),
-	     static_cast<long int>( contents.size() ),
+	     static_cast<long int>( contents_size() ),
 	     other.debug_contents().c_str(),
-	     static_cast<long int>( other.contents.size() ) );
+	     static_cast<long int>( other.contents_size() ) );
   }
 
   if ( fallback != other.fallback ) {
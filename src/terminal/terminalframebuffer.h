@@ -34,8 +34,11 @@
 #define TERMINALFB_HPP
 
 #include <cassert>
+#include <algorithm>
 #include <climits>
 #include <cstdint>
+#include <cstring>
+#include <cwchar>
 #include <deque>
 #include <list>
 #include <memory>
@@ -56,6 +59,7 @@ namespace Terminal {
     uint64_t foreground_color : 25;
     uint64_t background_color : 25;
     uint64_t attributes : 8;
+    uint64_t reserved : 6; /* always zero, so every bit of a Renditions is defined */
 
   public:
     Renditions( color_type s_background );
@@ -72,6 +76,18 @@ namespace Terminal {
       return (color & true_color_mask) != 0;
     }
 
+    /* all of it as one integer, to copy renditions between hosts */
+    uint64_t get_bits( void ) const
+    {
+      return foreground_color | ( uint64_t( background_color ) << 25 ) | ( uint64_t( attributes ) << 50 );
+    }
+    void set_bits( uint64_t bits )
+    {
+      foreground_color = bits & 0x1FFFFFF;
+      background_color = ( bits >> 25 ) & 0x1FFFFFF;
+      attributes = ( bits >> 50 ) & 0xFF;
+    }
+
     // unsigned int get_foreground_rendition() const { return foreground_color; }
     unsigned int get_background_rendition() const { return background_color; }
 
@@ -91,14 +107,62 @@ namespace Terminal {
     void clear_attributes() { attributes = 0; }
   };
 
+  /* Process-wide store for the rare grapheme clusters too long to
+     fit inside a Cell. Equal clusters get equal ids, so cells can
+     still be compared bytewise. Cells are copied bytewise and can't
+     hold references, so once the table fills, intern() sweeps it:
+     entries no live Row uses are freed and their slots reused. A Cell
+     kept outside any Row (e.g. a prediction) does not pin its entry,
+     but ids carry the entry's generation: once the entry is freed,
+     such a cell reads as empty and never equals a cell holding the
+     cluster that took its slot. */
+  class GraphemeTable {
+  private:
+    struct Store;
+    static Store &store( void );
+    static void sweep( Store &s );
+
+  public:
+    static const size_t MAX_ENTRIES = 65536; /* bound memory under hostile output */
+
+    /* returns false if the table is full of live entries */
+    static bool intern( const std::string &contents, uint32_t &id );
+    static const std::string &lookup( uint32_t id );
+    static size_t live_entries( void );
+  };
+
   class Cell {
   private:
-    typedef std::string content_type; /* can be std::string, std::vector<uint8_t>, or __gnu_cxx::__vstring */
-    content_type contents;
+    /* UTF-8 contents up to INLINE_CAPACITY bytes are stored in place,
+       zero-padded; longer ones are stored as a GraphemeTable id. This
+       keeps a Cell at 16 trivially copyable bytes. */
+    static const size_t INLINE_CAPACITY = 7;
+    static const unsigned int SPILLED = 15;
+
     Renditions renditions;
-    unsigned int wide : 1; /* 0 = narrow, 1 = wide */
-    unsigned int fallback : 1; /* first character is combining character */
-    unsigned int wrap : 1;
+    char contents[ INLINE_CAPACITY ];
+    uint8_t contents_length : 4; /* 0 to INLINE_CAPACITY, or SPILLED */
+    uint8_t wide : 1; /* 0 = narrow, 1 = wide */
+    uint8_t fallback : 1; /* first character is combining character */
+    uint8_t wrap : 1;
+    uint8_t reserved : 1;
+
+    uint32_t spilled_id( void ) const
+    {
+      uint32_t id;
+      memcpy( &id, contents, sizeof( id ) );
+      return id;
+    }
+
+    bool contents_equal( const Cell &x ) const
+    {
+      return ( contents_length == x.contents_length )
+	&& ( memcmp( contents, x.contents, INLINE_CAPACITY ) == 0 );
+    }
+
+    void append_bytes( const char *s, size_t len );
+
+    friend class GraphemeTable;
 
   private:
     Cell();
@@ -109,7 +173,7 @@ namespace Terminal {
 
     bool operator==( const Cell &x ) const
     {
-      return ( (contents == x.contents)
+      return ( contents_equal( x )
 	       && (fallback == x.fallback)
 	       && (wide == x.wide)
 	       && (renditions == x.renditions)
@@ -121,23 +185,50 @@ namespace Terminal {
     /* Accessors for contents field */
     std::string debug_contents( void ) const;
 
-    bool empty( void ) const { return contents.empty(); }
+    /* the UTF-8 contents, without print_grapheme()'s additions */
+    void get_contents( const char *&data, size_t &len ) const
+    {
+      if ( contents_length == SPILLED ) {
+	const std::string &str = GraphemeTable::lookup( spilled_id() );
+	data = str.data();
+	len = str.size();
+      } else {
+	data = contents;
+	len = contents_length;
+      }
+    }
+    void set_contents( const char *data, size_t len )
+    {
+      clear();
+      append_bytes( data, len );
+    }
+
+    size_t contents_size( void ) const
+    {
+      return contents_length == SPILLED ? GraphemeTable::lookup( spilled_id() ).size() : contents_length;
+    }
+
+    bool empty( void ) const { return contents_length == 0; }
     /* 32 seems like a reasonable limit on combining characters */
-    bool full( void ) const { return contents.size() >= 32; }
-    void clear( void ) { contents.clear(); }
+    bool full( void ) const { return contents_size() >= 32; }
+    void clear( void )
+    {
+      memset( contents, 0, INLINE_CAPACITY );
+      contents_length = 0;
+    }
 
     bool is_blank( void ) const
     {
       // XXX fix.
-      return ( contents.empty()
-	       || contents == " "
-	       || contents == "\xC2\xA0" );
+      return ( contents_length == 0
+	       || ( contents_length == 1 && contents[ 0 ] == ' ' )
+	       || ( contents_length == 2 && memcmp( contents, "\xC2\xA0", 2 ) == 0 ) );
     }
 
     bool contents_match ( const Cell &other ) const
     {
       return ( is_blank() && other.is_blank() )
-             || ( contents == other.contents );
+             || contents_equal( other );
     }
 
     bool compare( const Cell &other ) const;
@@ -166,8 +257,8 @@ namespace Terminal {
     void append( const wchar_t c )
     {
       /* ASCII?  Cheat. */
-      if ( static_cast<uint32_t>(c) <= 0x7f ) {
-	contents.push_back( static_cast<char>(c) );
+      if ( static_cast<uint32_t>(c) <= 0x7f && contents_length < INLINE_CAPACITY ) {
+	contents[ contents_length++ ] = static_cast<char>(c);
 	return;
       }
       static mbstate_t ps = mbstate_t();
@@ -175,12 +266,12 @@ namespace Terminal {
       size_t ignore = wcrtomb(NULL, 0, &ps);
       (void)ignore;
       size_t len = wcrtomb(tmp, c, &ps);
-      contents.insert( contents.end(), tmp, tmp+len );
+      append_bytes( tmp, len );
     }
 
     void print_grapheme( std::string &output ) const
     {
-      if ( contents.empty() ) {
+      if ( contents_length == 0 ) {
 	output.append( 1, ' ' );
 	return;
       }
@@ -191,7 +282,10 @@ namespace Terminal {
       if ( fallback ) {
 	output.append( "\xC2\xA0" );
       }
-      output.append( contents );
+      const char *data;
+      size_t len;
+      get_contents( data, len );
+      output.append( data, len );
     }
 
     /* Other accessors */
@@ -217,9 +311,46 @@ namespace Terminal {
     uint64_t gen;
 
   private:
+    // id names this row's current contents: it is fresh for every Row
+    // and changes whenever the row is written.  A copy remembers the
+    // id it was copied from as base_id, and the columns written since
+    // as [dirty_first, dirty_last], so comparing the copy against its
+    // base only needs to look at that span.
+    uint64_t id;
+    uint64_t base_id;
+    int dirty_first, dirty_last;
+
+    // hash_value caches a digest of cells, for finding rows that have
+    // moved; any write invalidates it.
+    mutable uint64_t hash_value;
+    mutable bool hash_valid;
+
+    // Every live Row is on one list, so GraphemeTable can find the
+    // entries still in use.
+    Row *prev_live, *next_live;
+    void link_live( void );
+    friend class GraphemeTable;
+
     Row();
+    /* Only the copy constructor may introduce a base. */
+    Row &operator=( const Row & );
+
+    /* The columns of x that can differ from ours, as [lo, hi]. */
+    void comparable_span( const Row &x, int width, int &lo, int &hi ) const;
+
   public:
     Row( const size_t s_width, const color_type background_color );
+    Row( const Row &other );
+    ~Row();
+
+    void mark_dirty( int first, int last )
+    {
+      dirty_first = std::min( dirty_first, first );
+      dirty_last = std::max( dirty_last, last );
+      id = get_gen();
+      hash_valid = false;
+    }
+    void mark_dirty( void ) { mark_dirty( 0, INT_MAX ); }
 
     void insert_cell( int col, color_type background_color );
     void delete_cell( int col, color_type background_color );
@@ -228,13 +359,46 @@ namespace Terminal {
 
     bool operator==( const Row &x ) const
     {
-      return ( gen == x.gen && cells == x.cells );
+      if ( ( gen != x.gen ) || ( cells.size() != x.cells.size() ) ) {
+	return false;
+      }
+      int lo, hi;
+      comparable_span( x, cells.size(), lo, hi );
+      /* every bit of a Cell is defined, so rows compare bytewise */
+      return ( lo > hi )
+	|| ( memcmp( &cells[ lo ], &x.cells[ lo ], ( hi - lo + 1 ) * sizeof( Cell ) ) == 0 );
+    }
+
+    /* Content-only comparison, ignoring gen: are these the same cells? */
+    bool same_contents( const Row &x ) const
+    {
+      return ( hash() == x.hash() )
+	&& ( cells.size() == x.cells.size() )
+	&& ( memcmp( cells.data(), x.cells.data(), cells.size() * sizeof( Cell ) ) == 0 );
+    }
+
+    uint64_t hash( void ) const
+    {
+      if ( !hash_valid ) {
+	hash_value = compute_hash();
+	hash_valid = true;
+      }
+      return hash_value;
     }
 
     bool get_wrap( void ) const { return cells.back().get_wrap(); }
-    void set_wrap( bool w ) { cells.back().set_wrap( w ); }
+    void set_wrap( bool w )
+    {
+      mark_dirty( cells.size() - 1, cells.size() - 1 );
+      cells.back().set_wrap( w );
+    }
+
+    /* Bounds of the cells among the first width that differ from x's,
+       as [first, last]; first is width if none differ. */
+    void differing_span( const Row &x, int width, int &first, int &last ) const;
 
     uint64_t get_gen() const;
+    uint64_t compute_hash( void ) const;
   };
 
   class SavedCursor {
@@ -396,6 +560,10 @@ namespace Terminal {
 
     void scroll( int N );
     void move_rows_autoscroll( int rows );
+    /* Rows [top, bottom] take the contents of rows [top + shift,
+       bottom + shift]; the rows left behind are blanked.  This is the
+       block move Display::find_scroll() looks for. */
+    void move_rows( int top, int bottom, int shift );
 
     inline const Row *get_row( int row ) const
     {
@@ -428,7 +596,9 @@ namespace Terminal {
       if ( row == -1 ) row = ds.get_cursor_row();
       if ( col == -1 ) col = ds.get_cursor_col();
 
-      return &get_mutable_row( row )->cells.at( col );
+      Row *mutable_row = get_mutable_row( row );
+      mutable_row->mark_dirty( col, col );
+      return &mutable_row->cells.at( col );
     }
 
     Cell *get_combining_cell( void );
@@ -465,7 +635,7 @@ namespace Terminal {
 
     bool operator==( const Framebuffer &x ) const
     {
-      return ( rows == x.rows ) && ( window_title == x.window_title ) && ( clipboard  == x.clipboard ) && ( bell_count == x.bell_count ) && ( ds == x.ds );
+      return ( rows == x.rows ) && ( window_title == x.window_title ) && ( icon_name == x.icon_name ) && ( clipboard  == x.clipboard ) && ( bell_count == x.bell_count ) && ( ds == x.ds );
     }
   };
 }
@@ -36,6 +36,11 @@
 
 using namespace Terminal;
 
+bool UserInput::passes_through( const Parser::UserByte *act ) const
+{
+  return ( state == Ground ) && ( act->c != 0x1b );
+}
+
 std::string UserInput::input( const Parser::UserByte *act,
 			      bool application_mode_cursor_keys )
 {
@@ -55,6 +55,8 @@ namespace Terminal {
 
     std::string input( const Parser::UserByte *act,
 		       bool application_mode_cursor_keys );
+    /* whether input() would return the byte as it is, staying in Ground */
+    bool passes_through( const Parser::UserByte *act ) const;
 
     bool operator==( const UserInput &x ) const { return state == x.state; }
   };
@@ -0,0 +1,242 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests the compact packet format: sequence numbers rebuilt from the
+   compact header, fragments of both forms, and compact instructions. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "src/crypto/prng.h"
+#include "src/network/network.h"
+#include "src/network/transportfragment.h"
+#include "src/util/fatal_assert.h"
+
+using namespace Network;
+
+static bool verbose = false;
+
+/* The receiver expects the sequence number after the last it took,
+   so a packet can be that one, later (after losses), or earlier
+   (reordered); any within half the header's span must come back. */
+static void test_compact_nonce( void )
+{
+  const uint64_t span = uint64_t( 1 ) << 32;
+  const uint64_t seqs[] = { 0, 1, 1000, span / 2, span - 3, span - 1, span, span + 1, span + 2,
+			    2 * span - 1, 2 * span, 5 * span + 7, ( uint64_t( 1 ) << 48 ) - 1,
+			    ( uint64_t( 1 ) << 56 ) - 2 };
+  const uint64_t distances[] = { 0, 1, 2, 100, 65536, span / 2 - 1 };
+  const uint64_t flags[] = { Packet::COMPACT_FLAG, Packet::COMPACT_FLAG | Packet::REPLY_FLAG,
+			     ( uint64_t( 1 ) << 63 ) | Packet::COMPACT_FLAG };
+  unsigned int checked = 0;
+
+  for ( uint64_t seq : seqs ) {
+    for ( uint64_t flag : flags ) {
+      const uint64_t nonce_val = flag | seq;
+      char header[ Packet::COMPACT_HEADER_LEN ];
+      Packet::write_compact_header( header, Nonce( nonce_val ) );
+
+      for ( uint64_t distance : distances ) {
+	/* arriving late, behind packets already taken */
+	fatal_assert( Packet::compact_nonce( header, seq + distance ) == nonce_val );
+	/* arriving early, after losses */
+	if ( seq >= distance ) {
+	  fatal_assert( Packet::compact_nonce( header, seq - distance ) == nonce_val );
+	}
+	checked++;
+      }
+    }
+  }
+
+  /* one run across the wrap, some out of order */
+  uint64_t expected = span - 10;
+  const int order[] = { 0, 1, 3, 2, 4, 7, 5, 6, 8, 9, 12, 10, 11, 13, 14, 15, 19, 16, 17, 18 };
+  for ( int offset : order ) {
+    const uint64_t seq = span - 10 + offset;
+    char header[ Packet::COMPACT_HEADER_LEN ];
+    Packet::write_compact_header( header, Nonce( Packet::COMPACT_FLAG | seq ) );
+    fatal_assert( Packet::compact_nonce( header, expected ) == ( Packet::COMPACT_FLAG | seq ) );
+    if ( seq >= expected ) {
+      expected = seq + 1;
+    }
+    checked++;
+  }
+
+  if ( verbose ) {
+    printf( "compact nonce: %u checked\n", checked );
+  }
+}
+
+static Instruction make_instruction( uint64_t old_num, uint64_t new_num, uint64_t throwaway_num,
+				     const std::string &diff )
+{
+  Instruction inst;
+  inst.set_protocol_version( MOSH_PROTOCOL_VERSION );
+  inst.set_old_num( old_num );
+  inst.set_new_num( new_num );
+  inst.set_ack_num( 17 );
+  inst.set_throwaway_num( throwaway_num );
+  if ( !diff.empty() ) {
+    inst.set_diff( diff );
+  }
+  return inst;
+}
+
+static void test_compact_instruction( void )
+{
+  std::vector<Instruction> insts;
+  insts.push_back( make_instruction( 10, 12, 10, "diff" ) ); /* throwaway_num == old_num */
+  insts.push_back( make_instruction( 10, 12, 3, "diff" ) );
+  insts.push_back( make_instruction( 10, 10, 10, "" ) ); /* an empty ack */
+  insts.push_back( make_instruction( 0, 1, 0, "first" ) );
+  insts.push_back( make_instruction( uint64_t( 1 ) << 40, ( uint64_t( 1 ) << 40 ) + 5, 1, "far" ) );
+  insts.push_back( make_instruction( 10, 12, 10, "diff" ) );
+  insts.back().set_protocol_version( MOSH_PROTOCOL_VERSION + 1 ); /* not implied */
+  insts.back().set_diff_encoding( 2 );
+  insts.back().set_chaff( "chaff" );
+
+  for ( const Instruction &inst : insts ) {
+    Instruction compact( inst );
+    compact_instruction( compact );
+    fatal_assert( compact.ByteSizeLong() <= inst.ByteSizeLong() );
+    Instruction expanded;
+    fatal_assert( expanded.ParseFromString( compact.SerializeAsString() ) );
+    expand_instruction( expanded );
+    fatal_assert( expanded.SerializeAsString() == inst.SerializeAsString() );
+  }
+
+  if ( verbose ) {
+    printf( "compact instruction: %zu checked\n", insts.size() );
+  }
+}
+
+/* Sends inst through a fresh Fragmenter and FragmentAssembly, in the
+   order given by skip (a fragment to leave out, or -1) and reverse */
+static bool round_trip( const Instruction &inst, bool compact, bool parity, int skip, bool reverse,
+			size_t *fragment_count )
+{
+  Fragmenter fragmenter;
+  FragmentAssembly assembly;
+  std::vector<Fragment> fragments = fragmenter.make_fragments( inst, 500, parity, compact );
+  *fragment_count = fragments.size();
+  if ( reverse ) {
+    fragments = std::vector<Fragment>( fragments.rbegin(), fragments.rend() );
+  }
+
+  /* with parity, the last fragment to arrive may not be needed */
+  bool done = false;
+  for ( size_t i = 0; ( i < fragments.size() ) && !done; i++ ) {
+    if ( static_cast<int>( fragments[ i ].fragment_num ) == skip ) {
+      continue;
+    }
+    const std::string wire = fragments[ i ].tostring();
+    fatal_assert( wire.size() <= 500 );
+    Fragment received( wire, compact );
+    fatal_assert( received == fragments[ i ] );
+    done = assembly.add_fragment( received );
+  }
+  if ( !done ) {
+    return false;
+  }
+
+  return assembly.get_assembly().SerializeAsString() == inst.SerializeAsString();
+}
+
+static void test_fragments( void )
+{
+  PRNG prng;
+  unsigned int checked = 0;
+
+  const size_t sizes[] = { 0, 100, 480, 2000, 5000 };
+  for ( size_t size : sizes ) {
+    for ( int random = 0; random < 2; random++ ) {
+      /* random diffs do not deflate and span fragments; repetitive
+	 ones deflate, compact or not */
+      std::string diff( size, 'x' );
+      if ( random ) {
+	prng.fill( &diff[ 0 ], size );
+      } else {
+	for ( size_t i = 0; i < size; i++ ) {
+	  diff[ i ] = "mosh "[ i % 5 ];
+	}
+      }
+      const Instruction inst = make_instruction( 100, 101, 99, diff );
+
+      for ( int compact = 0; compact < 2; compact++ ) {
+	for ( int parity = 0; parity < 2; parity++ ) {
+	  size_t count;
+	  fatal_assert( round_trip( inst, compact, parity, -1, false, &count ) );
+	  fatal_assert( round_trip( inst, compact, parity, -1, true, &count ) );
+	  checked += 2;
+
+	  if ( parity && ( count > 1 ) ) {
+	    /* the parity fragment restores any one that is lost */
+	    for ( size_t skip = 0; skip + 1 < count; skip++ ) {
+	      fatal_assert( round_trip( inst, compact, parity, skip, false, &count ) );
+	      fatal_assert( round_trip( inst, compact, parity, skip, true, &count ) );
+	      checked += 2;
+	    }
+	  } else if ( count > 1 ) {
+	    /* without it, one lost leaves the instruction incomplete */
+	    fatal_assert( !round_trip( inst, compact, parity, 0, false, &count ) );
+	    checked++;
+	  }
+	}
+      }
+    }
+  }
+
+  if ( verbose ) {
+    printf( "fragments: %u checked\n", checked );
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  try {
+    test_compact_nonce();
+    test_compact_instruction();
+    test_fragments();
+  } catch ( const std::exception &e ) {
+    fprintf( stderr, "Error: %s\n", e.what() );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
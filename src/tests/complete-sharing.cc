@@ -0,0 +1,243 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that Complete's copy-on-write sharing is invisible: random
+   copies of random states are mutated on both sides, and every state
+   must act, compare and diff as a private replay of the same inputs
+   from a fresh Complete does. */
+
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "src/statesync/completeterminal.h"
+#include "src/terminal/parseraction.h"
+#include "src/util/fatal_assert.h"
+#include "src/util/locale_utils.h"
+
+static bool verbose = false;
+static std::mt19937 rng;
+
+static int uniform( int low, int high )
+{
+  return std::uniform_int_distribution<int>( low, high )( rng );
+}
+
+/* One input to a Complete */
+struct Input {
+  enum { HOST, USER, RESIZE, INPUT_FRAME, ECHO_ACK } kind;
+  std::string bytes;
+  int width, height;
+  uint64_t frame, now;
+
+  Input() : kind( HOST ), bytes(), width( 0 ), height( 0 ), frame( 0 ), now( 0 ) {}
+};
+
+static Input random_input( uint64_t &frame, uint64_t &now )
+{
+  static const char *const host[] = { "hello", "\r\n", "\033[H", "\033[2J", "\033[5;10H", "\033[31mred\033[0m",
+				      "e\xcc\x81", "\xe4\xb8\xad", "\033[6n", "\033[c", "\033[3L", "\033[2M",
+				      "\033]0;title\007", "\007", "\033[?25l", "\033[?25h", "\033[?1049h",
+				      "\033[?1049l", "\033[?2004h", "\033[5;15r\033[S\033[r" };
+  static const char user[] = { 'a', 'Z', ' ', '\r', '\x7f', '\033', '[', 'A', '\x03' };
+  Input input;
+  now += uniform( 0, 40 );
+  input.now = now;
+  switch ( uniform( 0, 9 ) ) {
+  case 0: case 1: case 2: case 3:
+    input.kind = Input::HOST;
+    for ( int i = uniform( 1, 6 ); i > 0; i-- ) {
+      input.bytes += host[ uniform( 0, sizeof( host ) / sizeof( host[ 0 ] ) - 1 ) ];
+    }
+    break;
+  case 4: case 5:
+    input.kind = Input::USER;
+    input.bytes = std::string( 1, user[ uniform( 0, sizeof( user ) - 1 ) ] );
+    break;
+  case 6:
+    input.kind = Input::RESIZE;
+    input.width = uniform( 1, 100 );
+    input.height = uniform( 1, 40 );
+    break;
+  case 7:
+    input.kind = Input::INPUT_FRAME;
+    input.frame = ++frame;
+    break;
+  default:
+    input.kind = Input::ECHO_ACK;
+    break;
+  }
+  return input;
+}
+
+/* Applies input, returning what the Complete answered */
+static std::string apply( Terminal::Complete &complete, const Input &input )
+{
+  switch ( input.kind ) {
+  case Input::HOST:
+    return complete.act( input.bytes );
+  case Input::USER:
+    return complete.act( Parser::UserByte( input.bytes[ 0 ] ) );
+  case Input::RESIZE:
+    return complete.act( Parser::Resize( input.width, input.height ) );
+  case Input::INPUT_FRAME:
+    complete.register_input_frame( input.frame, input.now );
+    return std::string();
+  case Input::ECHO_ACK:
+    return complete.set_echo_ack( input.now ) ? "acked" : "";
+  }
+  return std::string();
+}
+
+/* Whether two states hold the same screen and echo ack */
+static bool same_state( const Terminal::Complete &a, const Terminal::Complete &b, bool bells = true )
+{
+  const Terminal::Framebuffer &fb = a.get_fb(), &other = b.get_fb();
+  const int width = fb.ds.get_width(), height = fb.ds.get_height();
+  if ( (width != other.ds.get_width()) || (height != other.ds.get_height()) ) {
+    return false;
+  }
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < width; x++ ) {
+      if ( !(*fb.get_cell( y, x ) == *other.get_cell( y, x )) ) {
+	return false;
+      }
+    }
+  }
+  return (fb.ds == other.ds)
+    && (fb.get_window_title() == other.get_window_title())
+    && (fb.get_icon_name() == other.get_icon_name())
+    && (!bells || (fb.get_bell_count() == other.get_bell_count()))
+    && (a.get_echo_ack() == b.get_echo_ack());
+}
+
+/* A state that may share with others, and a private replay of it */
+struct Entry {
+  Terminal::Complete shared;
+  std::vector<Input> log;
+  std::unique_ptr<Terminal::Complete> replay;
+
+  Entry( const Terminal::Complete &s_shared, const std::vector<Input> &s_log )
+    : shared( s_shared ), log( s_log ), replay( new Terminal::Complete( 80, 24 ) )
+  {
+    for ( const Input &input : log ) {
+      apply( *replay, input );
+    }
+  }
+};
+
+int main( int argc, char *argv[] )
+{
+  unsigned int seed = 1;
+  int steps = 3000;
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp( argv[ i ], "-v" ) == 0 ) {
+      verbose = true;
+    } else if ( strcmp( argv[ i ], "-s" ) == 0 && i + 1 < argc ) {
+      seed = strtoul( argv[ ++i ], NULL, 0 );
+    } else if ( strcmp( argv[ i ], "-n" ) == 0 && i + 1 < argc ) {
+      steps = atoi( argv[ ++i ] );
+    }
+  }
+  rng.seed( seed );
+
+  /* the emulator takes UTF-8 host output only in a UTF-8 locale */
+  set_native_locale();
+  static const char *const locales[] = { "C.UTF-8", "en_US.UTF-8", "en_US.utf8" };
+  for ( size_t i = 0; !is_utf8_locale() && i < sizeof( locales ) / sizeof( locales[ 0 ] ); i++ ) {
+    setlocale( LC_ALL, locales[ i ] );
+  }
+  if ( !is_utf8_locale() ) {
+    fprintf( stderr, "no UTF-8 locale\n" );
+    return 77;
+  }
+
+  const size_t POOL_SIZE = 8;
+  std::vector<std::unique_ptr<Entry>> pool;
+  pool.emplace_back( new Entry( Terminal::Complete( 80, 24 ), std::vector<Input>() ) );
+  uint64_t frame = 0, now = 1000;
+  int equal_versions = 0;
+
+  for ( int step = 0; step < steps; step++ ) {
+    /* copy a state, as the transport does for its history */
+    if ( uniform( 0, 2 ) == 0 ) {
+      const Entry &original = *pool[ uniform( 0, pool.size() - 1 ) ];
+      pool.emplace_back( new Entry( original.shared, original.log ) );
+      if ( pool.size() > POOL_SIZE ) {
+	pool.erase( pool.begin() + uniform( 0, pool.size() - 2 ) );
+      }
+    }
+
+    /* change one, which must not show through in the others */
+    Entry &entry = *pool[ uniform( 0, pool.size() - 1 ) ];
+    const Input input = random_input( frame, now );
+    entry.log.push_back( input );
+    fatal_assert( apply( entry.shared, input ) == apply( *entry.replay, input ) );
+
+    for ( size_t i = 0; i < pool.size(); i++ ) {
+      if ( !same_state( pool[ i ]->shared, *pool[ i ]->replay ) ) {
+	fprintf( stderr, "Step %d (seed %u): state %zu differs from its replay\n", step, seed, i );
+	return EXIT_FAILURE;
+      }
+    }
+
+    /* equal says nothing it shouldn't, and diffs (forward in echo ack,
+       as the transport sends them) carry the change */
+    const Entry &a = *pool[ uniform( 0, pool.size() - 1 ) ];
+    const Entry &b = *pool[ uniform( 0, pool.size() - 1 ) ];
+    if ( a.shared == b.shared ) {
+      fatal_assert( same_state( *a.replay, *b.replay ) );
+      equal_versions++;
+    }
+    for ( unsigned int formats = 0;
+	  a.shared.get_echo_ack() >= b.shared.get_echo_ack() && formats <= Terminal::Complete::DIFF_FORMATS;
+	  formats++ ) {
+      Terminal::Complete client( *b.replay );
+      fatal_assert( client.apply_string( a.shared.diff_from( b.shared, formats ) ) );
+      /* only a FramePatch says exactly where the cursor waits at the
+	 margin; and a client rings once for any number of bells */
+      if ( formats == Terminal::Complete::FRAME_PATCH ) {
+	fatal_assert( same_state( client, *a.replay, false ) );
+      }
+    }
+  }
+
+  if ( verbose ) {
+    printf( "%d steps, %d pairs equal by version\n", steps, equal_versions );
+  }
+  return EXIT_SUCCESS;
+}
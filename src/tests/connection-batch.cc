@@ -0,0 +1,112 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that Connection::recv() drains a burst of datagrams in
+   batches of at most RECV_BATCH, handing them out in order, over a
+   loopback pair of Connections. */
+
+#include <poll.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "src/network/network.h"
+#include "src/util/fatal_assert.h"
+
+static bool verbose = false;
+
+static std::string payload( unsigned int n )
+{
+  char buf[ 32 ];
+  snprintf( buf, sizeof( buf ), "datagram %u ", n );
+  return std::string( buf ) + std::string( n * 23 % 1000, static_cast<char>( 'a' + n % 26 ) );
+}
+
+/* Receives count datagrams on server, checking they are payload( first )
+   onwards; returns how many batches they came in. */
+static unsigned int receive( Network::Connection &server, unsigned int first, unsigned int count )
+{
+  unsigned int batches = 0, n = first;
+  while ( n < first + count ) {
+    const std::vector<int> fds = server.fds();
+    std::vector<struct pollfd> pfds;
+    for ( int fd : fds ) {
+      pfds.push_back( { fd, POLLIN, 0 } );
+    }
+    fatal_assert( poll( &pfds[ 0 ], pfds.size(), 1000 ) > 0 );
+
+    size_t size = 0;
+    do {
+      fatal_assert( server.recv() == payload( n ) );
+      n++;
+      size++;
+    } while ( server.has_pending() );
+    fatal_assert( size <= Network::Connection::RECV_BATCH );
+    batches++;
+
+    if ( verbose ) {
+      printf( "batch of %zu\n", size );
+    }
+  }
+  fatal_assert( n == first + count );
+  return batches;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  try {
+    Network::Connection server( "127.0.0.1", NULL );
+    Network::Connection client( server.get_key().c_str(), "127.0.0.1", server.port().c_str() );
+
+    /* back to back, before the server reads any */
+    const unsigned int burst = 40;
+    for ( unsigned int i = 0; i < burst; i++ ) {
+      client.send( payload( i ) );
+    }
+    const unsigned int batches = receive( server, 0, burst );
+    fatal_assert( batches == ( burst + Network::Connection::RECV_BATCH - 1 ) / Network::Connection::RECV_BATCH );
+
+    /* a lone datagram is still delivered on its own */
+    client.send( payload( burst ) );
+    fatal_assert( receive( server, burst, 1 ) == 1 );
+  } catch ( const std::exception &e ) {
+    fprintf( stderr, "Error: %s\n", e.what() );
+    return 1;
+  }
+
+  return 0;
+}
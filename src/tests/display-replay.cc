@@ -0,0 +1,229 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that Display::new_frame() redraws a screen faithfully, by
+   feeding random host output, heavy on scrolls and moved blocks of
+   lines, to one emulator and replaying each frame it draws into a
+   second emulator standing in for the user's terminal. */
+
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+#include "src/statesync/completeterminal.h"
+#include "src/terminal/terminaldisplay.h"
+#include "src/util/locale_utils.h"
+
+static bool verbose = false;
+static std::mt19937 rng;
+
+static int uniform( int low, int high )
+{
+  return std::uniform_int_distribution<int>( low, high )( rng );
+}
+
+static std::string csi( const char *format, int a = 0, int b = 0 )
+{
+  char buf[ 64 ];
+  snprintf( buf, sizeof( buf ), format, a, b );
+  return std::string( "\033[" ) + buf;
+}
+
+/* Up to length narrow graphemes.  Wide characters and writes through
+   the margin can leave screens no terminal output reproduces exactly
+   (half a wide character, a wrap on the bottom row), so they are left
+   out: what is tested here is how rows move. */
+static std::string text( int length )
+{
+  static const char *const graphemes[] = { "e\xcc\x81", "\xc3\xa9", "a\xcc\x81\xcc\xa7",
+					   "o\xcc\x81\xcc\x82\xcc\x83\xcc\x84" };
+  std::string out;
+  for ( int i = uniform( 0, length ); i > 0; i-- ) {
+    if ( uniform( 0, 15 ) == 0 ) {
+      out += graphemes[ uniform( 0, sizeof( graphemes ) / sizeof( graphemes[ 0 ] ) - 1 ) ];
+    } else {
+      out.push_back( static_cast<char>( uniform( 0x20, 0x7e ) ) );
+    }
+  }
+  return out;
+}
+
+/* A random piece of host output */
+static std::string host_output( int width, int height )
+{
+  static const char *const pens[] = { "0", "1", "4", "7", "31", "42", "38;5;200", "48;2;10;20;30", "1;33;44" };
+  std::string out;
+
+  switch ( uniform( 0, 9 ) ) {
+  case 0: {
+    const int col = uniform( 1, width );
+    out = csi( "%d;%dH", uniform( 1, height ), col ) + text( width - col );
+    break;
+  }
+  case 1: case 2: /* a log scrolling the whole screen */
+    out = csi( "%d;%dH", height, 1 );
+    for ( int i = uniform( 1, height + 2 ); i > 0; i-- ) {
+      out += "\r\n" + text( width - 1 );
+    }
+    break;
+  case 3: { /* ... or part of it */
+    const int top = uniform( 1, height ), bottom = uniform( top, height );
+    out = csi( "%d;%dr", top, bottom ) + csi( "%d;%dH", bottom, 1 );
+    for ( int i = uniform( 1, bottom - top + 2 ); i > 0; i-- ) {
+      out += "\r\n" + text( width - 1 );
+    }
+    out += csi( "r" );
+    break;
+  }
+  case 4: { /* scroll a region either way */
+    const int top = uniform( 1, height ), bottom = uniform( top, height );
+    out = csi( "%d;%dr", top, bottom ) + csi( uniform( 0, 1 ) ? "%dS" : "%dT", uniform( 1, height ) ) + csi( "r" );
+    break;
+  }
+  case 5: /* reverse index at the top */
+    out = csi( "%d;%dH", 1, 1 );
+    for ( int i = uniform( 1, 4 ); i > 0; i-- ) {
+      out += "\033M" + text( width / 2 ) + "\r";
+    }
+    break;
+  case 6: /* insert and delete lines */
+    out = csi( "%d;%dH", uniform( 1, height ), 1 ) + csi( uniform( 0, 1 ) ? "%dL" : "%dM", uniform( 1, height ) );
+    break;
+  case 7:
+    out = std::string( "\033[" ) + pens[ uniform( 0, sizeof( pens ) / sizeof( pens[ 0 ] ) - 1 ) ] + "m";
+    break;
+  case 8: { /* erasure */
+    static const char *const erase[] = { "K", "1K", "2K", "J", "1J", "2J", "3X", "2P", "4@" };
+    out = std::string( "\033[" ) + erase[ uniform( 0, sizeof( erase ) / sizeof( erase[ 0 ] ) - 1 ) ];
+    break;
+  }
+  default:
+    out = csi( uniform( 0, 1 ) ? "?25l" : "?25h" );
+    break;
+  }
+
+  return out;
+}
+
+/* Whether the user's terminal shows what the host drew */
+static bool same_screen( const Terminal::Framebuffer &screen, const Terminal::Framebuffer &host )
+{
+  const int width = host.ds.get_width(), height = host.ds.get_height();
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < width; x++ ) {
+      const Terminal::Cell &a = *screen.get_cell( y, x ), &b = *host.get_cell( y, x );
+      std::string grapheme, other_grapheme;
+      a.print_grapheme( grapheme );
+      b.print_grapheme( other_grapheme );
+      if ( (grapheme != other_grapheme) || (a.get_wide() != b.get_wide())
+	   || !(a.get_renditions() == b.get_renditions())
+	   || (a.get_wrap() != b.get_wrap()) ) {
+	fprintf( stderr, "Cell (%d, %d) differs: '%s' vs. '%s'\n", y, x, grapheme.c_str(), other_grapheme.c_str() );
+	return false;
+      }
+    }
+  }
+  if ( (screen.ds.get_cursor_row() != host.ds.get_cursor_row())
+       || (screen.ds.get_cursor_col() != host.ds.get_cursor_col())
+       || (screen.ds.cursor_visible != host.ds.cursor_visible) ) {
+    fprintf( stderr, "Cursor differs: (%d, %d)%s vs. (%d, %d)%s\n",
+	     screen.ds.get_cursor_row(), screen.ds.get_cursor_col(), screen.ds.cursor_visible ? "" : " hidden",
+	     host.ds.get_cursor_row(), host.ds.get_cursor_col(), host.ds.cursor_visible ? "" : " hidden" );
+    return false;
+  }
+  return true;
+}
+
+int main( int argc, char *argv[] )
+{
+  unsigned int seed = 1;
+  int frames = 3000;
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp( argv[ i ], "-v" ) == 0 ) {
+      verbose = true;
+    } else if ( strcmp( argv[ i ], "-s" ) == 0 && i + 1 < argc ) {
+      seed = strtoul( argv[ ++i ], NULL, 0 );
+    } else if ( strcmp( argv[ i ], "-n" ) == 0 && i + 1 < argc ) {
+      frames = atoi( argv[ ++i ] );
+    }
+  }
+  rng.seed( seed );
+
+  /* the emulator takes UTF-8 host output only in a UTF-8 locale */
+  set_native_locale();
+  static const char *const locales[] = { "C.UTF-8", "en_US.UTF-8", "en_US.utf8" };
+  for ( size_t i = 0; !is_utf8_locale() && i < sizeof( locales ) / sizeof( locales[ 0 ] ); i++ ) {
+    setlocale( LC_ALL, locales[ i ] );
+  }
+  if ( !is_utf8_locale() ) {
+    fprintf( stderr, "no UTF-8 locale\n" );
+    return 77;
+  }
+
+  const int width = 80, height = 24;
+  const Terminal::Display display( false );
+  Terminal::Complete host( width, height ); /* what the application drew */
+  Terminal::Complete screen( width, height ); /* what the user's terminal shows */
+  Terminal::Framebuffer last( host.get_fb() );
+  size_t frame_bytes = 0;
+  int moved = 0;
+
+  for ( int frame = 0; frame < frames; frame++ ) {
+    for ( int i = uniform( 1, 3 ); i > 0; i-- ) {
+      host.act( host_output( width, height ) );
+    }
+
+    const Terminal::Framebuffer &f = host.get_fb();
+    int top, bottom, shift;
+    if ( display.find_scroll( last.get_rows(), f, top, bottom, shift ) ) {
+      moved++;
+    }
+
+    const std::string diff = display.new_frame( frame > 0, last, f );
+    frame_bytes += diff.size();
+    screen.act( diff );
+    last = f;
+
+    if ( !same_screen( screen.get_fb(), f ) ) {
+      fprintf( stderr, "Frame %d (seed %u): the redrawn screen differs\n", frame, seed );
+      return EXIT_FAILURE;
+    }
+  }
+
+  if ( verbose ) {
+    printf( "%d frames, %d with a moved block, %zu bytes drawn\n", frames, moved, frame_bytes );
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,283 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that a FramePatch diff leaves the client with the same screen
+   as the terminal output it replaces, by replaying random screens,
+   scrolls and resizes against earlier bases; and that a corrupt patch
+   is refused rather than taken down the client. */
+
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "src/protobufs/hostinput.pb.h"
+#include "src/statesync/completeterminal.h"
+#include "src/terminal/parseraction.h"
+#include "src/util/fatal_assert.h"
+#include "src/util/locale_utils.h"
+
+using namespace HostBuffers;
+
+static bool verbose = false;
+static std::mt19937 rng;
+
+static int uniform( int low, int high )
+{
+  return std::uniform_int_distribution<int>( low, high )( rng );
+}
+
+static std::string csi( const char *format, int a = 0, int b = 0 )
+{
+  char buf[ 64 ];
+  snprintf( buf, sizeof( buf ), format, a, b );
+  return std::string( "\033[" ) + buf;
+}
+
+/* A random piece of host output */
+static std::string host_output( int width, int height )
+{
+  static const char *const graphemes[] = { "\xe4\xb8\xad", "\xe3\x81\x82", "e\xcc\x81", "\xc3\xa9",
+					   "\xf0\x9f\x98\x80", "a\xcc\x81\xcc\xa7" };
+  static const char *const pens[] = { "0", "1", "4", "7", "31", "42", "38;5;200", "48;2;10;20;30", "1;33;44" };
+  std::string out;
+
+  switch ( uniform( 0, 13 ) ) {
+  case 0: case 1: case 2: /* text, often past the margin */
+    for ( int i = uniform( 1, 2 * width ); i > 0; i-- ) {
+      out.push_back( static_cast<char>( uniform( 0x20, 0x7e ) ) );
+    }
+    break;
+  case 3: /* wide and combining characters */
+    for ( int i = uniform( 1, 8 ); i > 0; i-- ) {
+      out += graphemes[ uniform( 0, sizeof( graphemes ) / sizeof( graphemes[ 0 ] ) - 1 ) ];
+    }
+    break;
+  case 4:
+    out = csi( "%d;%dH", uniform( 1, height ), uniform( 1, width ) );
+    break;
+  case 5: /* scroll the screen */
+    out = csi( "%d;%dH", height, 1 );
+    for ( int i = uniform( 1, height + 2 ); i > 0; i-- ) {
+      out += "x\r\n";
+    }
+    break;
+  case 6: { /* scroll a region */
+    const int top = uniform( 1, height ), bottom = uniform( top, height );
+    out = csi( "%d;%dr", top, bottom ) + csi( "%d;%dH", bottom, 1 );
+    for ( int i = uniform( 1, 4 ); i > 0; i-- ) {
+      out += "y\n";
+    }
+    out += uniform( 0, 1 ) ? csi( "%dS", uniform( 1, 3 ) ) : csi( "%dT", uniform( 1, 3 ) );
+    out += csi( "r" ) + csi( "%d;%dH", top, 1 );
+    break;
+  }
+  case 7: /* insert and delete lines */
+    out = csi( "%d;%dH", uniform( 1, height ), 1 ) + csi( uniform( 0, 1 ) ? "%dL" : "%dM", uniform( 1, 4 ) );
+    break;
+  case 8:
+    out = std::string( "\033[" ) + pens[ uniform( 0, sizeof( pens ) / sizeof( pens[ 0 ] ) - 1 ) ] + "m";
+    break;
+  case 9: { /* erasure */
+    static const char *const erase[] = { "K", "1K", "2K", "J", "1J", "2J", "3X", "2P", "4@" };
+    out = std::string( "\033[" ) + erase[ uniform( 0, sizeof( erase ) / sizeof( erase[ 0 ] ) - 1 ) ];
+    break;
+  }
+  case 10:
+    out = uniform( 0, 1 ) ? "\033]0;title\007" : "\033]2;\xe2\x98\x83\007";
+    break;
+  case 11:
+    out = uniform( 0, 1 ) ? "\007" : "\033]52;c;Y2xpcA==\007";
+    break;
+  case 12:
+    out = csi( uniform( 0, 1 ) ? "?25l" : "?25h" ) + csi( uniform( 0, 1 ) ? "?2004h" : "?1000h" );
+    break;
+  default: /* the same again: rows rewritten unchanged */
+    out = csi( "%d;%dH", 1, 1 );
+    break;
+  }
+
+  return out;
+}
+
+/* Applies diff, as the client would, to a copy of base */
+static Terminal::Complete client_after( const Terminal::Complete &base, const std::string &diff )
+{
+  Terminal::Complete client( base );
+  fatal_assert( client.apply_string( diff ) );
+  return client;
+}
+
+/* Whether the screens and the state a client shows of them match */
+static bool same_screen( const Terminal::Complete &a, const Terminal::Complete &b )
+{
+  const Terminal::Framebuffer &fb = a.get_fb(), &other = b.get_fb();
+  const int width = fb.ds.get_width(), height = fb.ds.get_height();
+  if ( (width != other.ds.get_width()) || (height != other.ds.get_height()) ) {
+    return false;
+  }
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < width; x++ ) {
+      if ( !(*fb.get_cell( y, x ) == *other.get_cell( y, x )) ) {
+	return false;
+      }
+    }
+  }
+  return (fb.ds.get_cursor_row() == other.ds.get_cursor_row())
+    && (fb.ds.get_cursor_col() == other.ds.get_cursor_col())
+    && (fb.ds.cursor_visible == other.ds.cursor_visible)
+    && (fb.ds.bracketed_paste == other.ds.bracketed_paste)
+    && (fb.ds.mouse_reporting_mode == other.ds.mouse_reporting_mode)
+    && (fb.get_window_title() == other.get_window_title())
+    && (fb.get_icon_name() == other.get_icon_name())
+    && (fb.get_clipboard() == other.get_clipboard());
+}
+
+/* Corrupts the FramePatch in diff; applying it must not abort.
+   Returns how many corrupt patches were refused. */
+static int apply_corrupt( const Terminal::Complete &base, const std::string &diff )
+{
+  HostMessage message;
+  fatal_assert( message.ParseFromString( diff ) );
+  int refused = 0;
+  for ( int i = 0; i < message.instruction_size(); i++ ) {
+    if ( !message.instruction( i ).HasExtension( framepatch ) ) {
+      continue;
+    }
+    std::string patch = message.instruction( i ).GetExtension( framepatch ).SerializeAsString();
+    if ( patch.empty() ) {
+      continue;
+    }
+    if ( uniform( 0, 1 ) ) {
+      patch.resize( uniform( 0, patch.size() - 1 ) );
+    } else {
+      for ( int j = uniform( 1, 3 ); j > 0; j-- ) {
+	patch[ uniform( 0, patch.size() - 1 ) ] ^= static_cast<char>( uniform( 1, 255 ) );
+      }
+    }
+
+    HostMessage corrupt;
+    if ( corrupt.add_instruction()->MutableExtension( framepatch )->ParseFromString( patch ) ) {
+      Terminal::Complete client( base );
+      if ( !client.apply_string( corrupt.SerializeAsString() ) ) {
+	refused++;
+      }
+    }
+  }
+  return refused;
+}
+
+int main( int argc, char *argv[] )
+{
+  unsigned int seed = 1;
+  int steps = 3000;
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp( argv[ i ], "-v" ) == 0 ) {
+      verbose = true;
+    } else if ( strcmp( argv[ i ], "-s" ) == 0 && i + 1 < argc ) {
+      seed = strtoul( argv[ ++i ], NULL, 0 );
+    } else if ( strcmp( argv[ i ], "-n" ) == 0 && i + 1 < argc ) {
+      steps = atoi( argv[ ++i ] );
+    }
+  }
+  rng.seed( seed );
+
+  /* the emulator takes UTF-8 host output only in a UTF-8 locale */
+  set_native_locale();
+  static const char *const locales[] = { "C.UTF-8", "en_US.UTF-8", "en_US.utf8" };
+  for ( size_t i = 0; !is_utf8_locale() && i < sizeof( locales ) / sizeof( locales[ 0 ] ); i++ ) {
+    setlocale( LC_ALL, locales[ i ] );
+  }
+  if ( !is_utf8_locale() ) {
+    fprintf( stderr, "no UTF-8 locale\n" );
+    return 77;
+  }
+
+  Terminal::Complete server( 80, 24 );
+  std::vector<Terminal::Complete> history( 1, server );
+  const size_t HISTORY_SIZE = 8;
+  size_t patch_bytes = 0, hostbyte_bytes = 0;
+  int agreed = 0, refused = 0;
+
+  for ( int step = 0; step < steps; step++ ) {
+    const int width = server.get_fb().ds.get_width(), height = server.get_fb().ds.get_height();
+    if ( uniform( 0, 19 ) == 0 ) {
+      server.act( Parser::Resize( uniform( 1, 120 ), uniform( 1, 50 ) ) );
+    } else {
+      for ( int i = uniform( 1, 4 ); i > 0; i-- ) {
+	server.act( host_output( width, height ) );
+      }
+    }
+
+    /* the client may hold any recent state */
+    const Terminal::Complete &base = history[ uniform( 0, history.size() - 1 ) ];
+    const std::string patch_diff = server.diff_from( base, Terminal::Complete::FRAME_PATCH );
+    const std::string hostbyte_diff = server.diff_from( base );
+    patch_bytes += patch_diff.size();
+    hostbyte_bytes += hostbyte_diff.size();
+
+    const Terminal::Complete by_patch = client_after( base, patch_diff );
+    const Terminal::Complete by_hostbytes = client_after( base, hostbyte_diff );
+    /* The patch carries the screen exactly.  Terminal output cannot
+       always say where the cursor waits at the margin or which lines
+       wrapped; where it does, the two clients must agree. */
+    if ( !same_screen( by_patch, server ) ) {
+      by_patch.compare( server );
+      fprintf( stderr, "Step %d (seed %u): FramePatch client differs from the server\n", step, seed );
+      return EXIT_FAILURE;
+    }
+    /* a client rings once for any number of bells */
+    const unsigned int bells = base.get_fb().get_bell_count();
+    fatal_assert( (by_patch.get_fb().get_bell_count() != bells) == (server.get_fb().get_bell_count() != bells) );
+    if ( same_screen( by_hostbytes, server ) ) {
+      fatal_assert( same_screen( by_patch, by_hostbytes ) );
+      agreed++;
+    }
+
+    refused += apply_corrupt( base, patch_diff );
+
+    history.push_back( server );
+    if ( history.size() > HISTORY_SIZE ) {
+      history.erase( history.begin() );
+    }
+  }
+
+  if ( verbose ) {
+    printf( "%d steps, %d where terminal output was exact: %zu bytes of FramePatch, %zu of terminal output\n",
+	    steps, agreed, patch_bytes, hostbyte_bytes );
+    printf( "%d corrupt patches refused\n", refused );
+  }
+  return EXIT_SUCCESS;
+}
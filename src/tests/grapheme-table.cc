@@ -0,0 +1,146 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that GraphemeTable reuses the slots of long grapheme clusters
+   no live Row still shows, so a long session keeps its combining
+   characters; that clusters still on screen survive the sweep; and
+   that a cell outside any Row never picks up a reused slot's cluster. */
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "src/terminal/terminalframebuffer.h"
+#include "src/util/fatal_assert.h"
+
+using namespace Terminal;
+
+static bool verbose = false;
+
+/* a cluster too long to fit inside a Cell */
+static std::string cluster( const char *tag, unsigned int n )
+{
+  char buf[ 32 ];
+  snprintf( buf, sizeof( buf ), "%s%010u", tag, n );
+  return buf;
+}
+
+static std::string contents( const Cell &cell )
+{
+  const char *data;
+  size_t len;
+  cell.get_contents( data, len );
+  return std::string( data, len );
+}
+
+static void set( Cell &cell, const std::string &s )
+{
+  cell.set_contents( s.data(), s.size() );
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  const unsigned int max = GraphemeTable::MAX_ENTRIES;
+
+  /* a row that stays on screen throughout */
+  Row keeper( 4, 0 );
+  for ( unsigned int i = 0; i < keeper.cells.size(); i++ ) {
+    set( keeper.cells[ i ], cluster( "keep", i ) );
+  }
+
+  /* a cell outside any Row, as a prediction keeps, and a copy */
+  Cell loose( 0 );
+  set( loose, cluster( "loose", 0 ) );
+  const Cell loose_copy = loose;
+
+  /* churn through several tables' worth of clusters, keeping a few
+     copies of the row alive as a state history would */
+  std::shared_ptr<Row> history[ 8 ];
+  Row scratch( 1, 0 );
+  for ( unsigned int n = 0; n < 4 * max; n++ ) {
+    const std::string s = cluster( "tmp", n );
+    set( scratch.cells[ 0 ], s );
+    fatal_assert( contents( scratch.cells[ 0 ] ) == s );
+    history[ n % 8 ] = std::make_shared<Row>( scratch );
+  }
+  fatal_assert( GraphemeTable::live_entries() <= max );
+  for ( unsigned int i = 0; i < keeper.cells.size(); i++ ) {
+    fatal_assert( contents( keeper.cells[ i ] ) == cluster( "keep", i ) );
+  }
+  for ( unsigned int i = 0; i < 8; i++ ) {
+    history[ i ].reset();
+  }
+
+  /* the loose cell's entry was freed and its slot taken: it must not
+     show or equal the cluster now there */
+  fatal_assert( contents( loose ).empty() );
+  fatal_assert( loose == loose_copy );
+  for ( unsigned int i = 0; i < 8; i++ ) {
+    fatal_assert( !( loose == scratch.cells[ 0 ] ) );
+    set( scratch.cells[ 0 ], cluster( "again", i ) );
+  }
+
+  if ( verbose ) {
+    printf( "%u clusters interned, %lu entries in use\n", 4 * max,
+	    static_cast<unsigned long>( GraphemeTable::live_entries() ) );
+  }
+
+  /* a screen that really does show a full table refuses new clusters */
+  std::unique_ptr<Row> full( new Row( max, 0 ) );
+  for ( unsigned int i = 0; i < max; i++ ) {
+    set( full->cells[ i ], cluster( "full", i ) );
+  }
+  set( scratch.cells[ 0 ], cluster( "over", 0 ) );
+  fatal_assert( contents( scratch.cells[ 0 ] ) != cluster( "over", 0 ) );
+  for ( unsigned int i = 0; i < keeper.cells.size(); i++ ) {
+    fatal_assert( contents( keeper.cells[ i ] ) == cluster( "keep", i ) );
+  }
+
+  /* and takes them again once that screen is gone */
+  full.reset();
+  unsigned int tries = 0;
+  do {
+    set( scratch.cells[ 0 ], cluster( "over", 0 ) );
+    fatal_assert( ++tries <= max );
+  } while ( contents( scratch.cells[ 0 ] ) != cluster( "over", 0 ) );
+
+  if ( verbose ) {
+    printf( "full table recovered after %u tries\n", tries );
+  }
+
+  return 0;
+}
@@ -34,8 +34,9 @@
 
    This tests cryptographic primitives implemented by others.  It uses the
    same interfaces and indeed the same compiled object code as the Mosh
-   client and server.  It does not particularly test any code written for
-   the Mosh project. */
+   client and server.  It runs with each AES implementation built in, so
+   the hardware AES kernels are the only code written for the Mosh project
+   it particularly tests. */
 
 #include <cstdint>
 #include <cstdlib>
@@ -546,8 +547,15 @@ int main( int argc, char *argv[] )
   }
 
   try {
-    test_all_vectors();
-    test_iterative();
+    /* every AES implementation built in that this CPU can run */
+    for ( int impl = 0; impl < ae_impl_count(); impl++ ) {
+      fatal_assert( AE_SUCCESS == ae_impl_select( impl ) );
+      if ( verbose ) {
+	printf( "implementation %s\n\n", ae_impl_name( impl ) );
+      }
+      test_all_vectors();
+      test_iterative();
+    }
   } catch ( const std::exception &e ) {
     fprintf( stderr, "Error: %s\r\n", e.what() );
     return 1;
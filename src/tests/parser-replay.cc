@@ -0,0 +1,185 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Prints a digest of what the terminal parser makes of each input
+   file named, then of a fixed series of random inputs, for
+   parser-replay.test to hold against the parser's recorded output. */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "src/terminal/parser.h"
+#include "src/util/locale_utils.h"
+
+/* FNV-1a over the actions, both as tokens and as named Actions */
+class Digest {
+private:
+  uint64_t hash;
+
+public:
+  size_t actions;
+
+  Digest() : hash( 0xcbf29ce484222325 ), actions( 0 ) {}
+
+  void add( const void *data, size_t len )
+  {
+    const unsigned char *bytes = static_cast<const unsigned char *>( data );
+    for ( size_t i = 0; i < len; i++ ) {
+      hash = (hash ^ bytes[ i ]) * 0x100000001b3;
+    }
+  }
+
+  void add( const Parser::Token &token )
+  {
+    const uint32_t fields[] = { token.type, static_cast<uint32_t>( token.ch ), token.char_present };
+    add( fields, sizeof( fields ) );
+    actions++;
+  }
+
+  void add( Parser::Action &action )
+  {
+    const std::string name = action.name();
+    add( name.data(), name.size() );
+    const uint32_t fields[] = { static_cast<uint32_t>( action.ch ), action.char_present };
+    add( fields, sizeof( fields ) );
+  }
+
+  uint64_t value( void ) const { return hash; }
+};
+
+static void replay( const std::string &name, const std::string &input )
+{
+  Parser::UTF8Parser token_parser, action_parser;
+  Parser::Tokens tokens;
+  Parser::Actions actions;
+  Digest digest;
+
+  for ( size_t i = 0; i < input.size(); i++ ) {
+    token_parser.input( input[ i ], tokens );
+    for ( const Parser::Token &token : tokens ) {
+      digest.add( token );
+    }
+    tokens.clear();
+
+    action_parser.input( input[ i ], actions );
+    for ( Parser::ActionPointer &action : actions ) {
+      digest.add( *action );
+    }
+    actions.clear();
+
+    /* a printable run must parse to Prints alone */
+    const size_t run = token_parser.printable_run( input.data() + i + 1, input.size() - i - 1 );
+    digest.add( &run, sizeof( run ) );
+  }
+
+  printf( "%s %zu %zu %016llx\n", name.c_str(), input.size(), digest.actions,
+	  static_cast<unsigned long long>( digest.value() ) );
+}
+
+/* xorshift64*, so the inputs are the same everywhere */
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+static uint32_t random32( void )
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return static_cast<uint32_t>( (rng_state * 0x2545f4914f6cdd1d) >> 32 );
+}
+
+/* Random bytes, weighted towards those that move the state machine */
+static std::string random_input( size_t len )
+{
+  static const char interesting[] = "\x1b[]P;:?0123456789 !\"#$%&'()*+,-./@ABHJKLMmhlqrsu\x07\x18\x1a\x7f";
+  std::string out;
+  while ( out.size() < len ) {
+    const uint32_t r = random32();
+    switch ( r % 8 ) {
+    case 0: case 1: case 2:
+      out.push_back( interesting[ (r >> 8) % (sizeof( interesting ) - 1) ] );
+      break;
+    case 3:
+      out.push_back( static_cast<char>( (r >> 8) % 0x20 ) ); /* C0 */
+      break;
+    case 4:
+      out.push_back( static_cast<char>( 0x80 + (r >> 8) % 0x20 ) ); /* C1, or stray continuation */
+      break;
+    case 5: { /* a UTF-8 sequence, sometimes cut short */
+      static const char *const sequences[] = { "\xc2\x9b", "\xc2\x90", "\xc3\xa9", "\xe4\xb8\xad",
+					       "\xf0\x9f\x98\x80" };
+      const std::string sequence = sequences[ (r >> 8) % 5 ];
+      out += sequence.substr( 0, (r & 0x10000) ? sequence.size() : 1 + (r >> 20) % sequence.size() );
+      break;
+    }
+    default:
+      out.push_back( static_cast<char>( r >> 8 ) );
+      break;
+    }
+  }
+  return out;
+}
+
+int main( int argc, char *argv[] )
+{
+  set_native_locale();
+  static const char *const locales[] = { "C.UTF-8", "en_US.UTF-8", "en_US.utf8" };
+  for ( size_t i = 0; !is_utf8_locale() && i < sizeof( locales ) / sizeof( locales[ 0 ] ); i++ ) {
+    setlocale( LC_ALL, locales[ i ] );
+  }
+  if ( !is_utf8_locale() ) {
+    fprintf( stderr, "no UTF-8 locale\n" );
+    return 77;
+  }
+
+  std::vector<std::string> files( argv + 1, argv + argc );
+  std::sort( files.begin(), files.end() );
+  for ( const std::string &file : files ) {
+    std::ifstream in( file.c_str(), std::ios::binary );
+    if ( !in ) {
+      perror( file.c_str() );
+      return 1;
+    }
+    const std::string input( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+    replay( file.substr( file.rfind( '/' ) + 1 ), input );
+  }
+
+  for ( int i = 0; i < 200; i++ ) {
+    replay( "random-" + std::to_string( i ), random_input( 1 + random32() % 4096 ) );
+  }
+
+  return 0;
+}
@@ -0,0 +1,137 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that a sender goes idle once the receiver renders its current
+   state, even when the two states do not compare equal (e.g. a row
+   rewritten with what it already held). */
+
+#include <poll.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "src/util/fatal_assert.h"
+#include "src/util/timestamp.h"
+#include "src/statesync/completeterminal.h"
+#include "src/statesync/user.h"
+#include "src/network/networktransport-impl.h"
+
+typedef Network::Transport<Terminal::Complete, Network::UserStream> ServerTransport;
+typedef Network::Transport<Network::UserStream, Terminal::Complete> ClientTransport;
+
+static bool verbose = false;
+
+/* Runs both ends for ms milliseconds; returns how many times they
+   woke up */
+static unsigned int run( ServerTransport &server, ClientTransport &client, uint64_t ms )
+{
+  freeze_timestamp();
+  const uint64_t end = frozen_timestamp() + ms;
+  unsigned int wakeups = 0;
+
+  while ( frozen_timestamp() < end ) {
+    server.tick();
+    client.tick();
+
+    int wait = std::min( server.wait_time(), client.wait_time() );
+    wait = std::min( wait, int( end - frozen_timestamp() ) );
+
+    std::vector<struct pollfd> fds;
+    const std::vector<int> server_fds = server.fds();
+    const std::vector<int> client_fds = client.fds();
+    for ( int fd : server_fds ) {
+      fds.push_back( { fd, POLLIN, 0 } );
+    }
+    for ( int fd : client_fds ) {
+      fds.push_back( { fd, POLLIN, 0 } );
+    }
+    fatal_assert( poll( &fds[ 0 ], fds.size(), wait ) >= 0 );
+    freeze_timestamp();
+    wakeups++;
+
+    for ( size_t i = 0; i < fds.size(); i++ ) {
+      if ( fds[ i ].revents & POLLIN ) {
+	if ( i < server_fds.size() ) {
+	  server.recv();
+	} else {
+	  client.recv();
+	}
+      }
+    }
+  }
+
+  return wakeups;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  try {
+    freeze_timestamp();
+    Terminal::Complete terminal( 80, 24 );
+    Network::UserStream blank;
+    ServerTransport server( terminal, blank, "127.0.0.1", NULL );
+    ClientTransport client( blank, terminal, server.get_key().c_str(), "127.0.0.1", server.port().c_str() );
+
+    if ( verbose ) {
+      server.set_verbose( 1 );
+    }
+    run( server, client, 200 );
+    fatal_assert( server.has_remote_addr() );
+
+    server.get_current_state().act( "a\r" );
+    run( server, client, 300 );
+    fatal_assert( client.get_latest_remote_state().num == server.get_sent_state_last() );
+
+    /* the same again: a new state, but no diff to send */
+    server.get_current_state().act( "a\r" );
+    const unsigned int wakeups = run( server, client, 1000 );
+
+    if ( verbose ) {
+      fprintf( stderr, "%u wakeups while idle\n", wakeups );
+    }
+    /* a sender that keeps finding nothing to send wakes every
+       SEND_MINDELAY */
+    fatal_assert( wakeups < 20 );
+    fatal_assert( !client.get_latest_remote_state().state.compare( server.get_current_state() ) );
+  } catch ( const std::exception &e ) {
+    fprintf( stderr, "Error: %s\n", e.what() );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}